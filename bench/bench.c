@@ -0,0 +1,764 @@
+/*
+ * Copyright (c) 2011, Edd Barrett <vext01@gmail.com>
+ * Copyright (c) 2011, Christiano F. Haesbaert <haesbaert@haesbaert.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks: loading the magic file, testing rules of each type,
+ * classifying whole files, over a synthetic corpus made the same way every
+ * time for a given seed, and finding the pattern of a search test over
+ * ranges of each size. Results go to stdout as JSON.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defile.h"
+#include "file.h"
+
+/* Headers go in whole, files smaller than this are cut short of them */
+#define BENCH_MINBUF	4096
+
+struct bench_file {
+	char		 path[MAXPATHLEN];
+	size_t		 size;
+};
+
+struct bench_samples {
+	double		*v;
+	size_t		 n;
+	size_t		 alloc;
+};
+
+void __dead	 usage(void);
+u_int64_t	 bench_rand(u_int64_t *);
+u_int64_t	 bench_now(void);
+void		 bench_le16(u_char *, u_int16_t);
+void		 bench_le32(u_char *, u_int32_t);
+void		 bench_le64(u_char *, u_int64_t);
+void		 bench_be32(u_char *, u_int32_t);
+void		 bench_gen_random(u_char *, size_t, u_int64_t *);
+void		 bench_gen_text(u_char *, size_t, u_int64_t *);
+void		 bench_gen_elf(u_char *, size_t, u_int64_t *);
+void		 bench_gen_pe(u_char *, size_t, u_int64_t *);
+void		 bench_gen_zip(u_char *, size_t, u_int64_t *);
+void		 bench_gen_png(u_char *, size_t, u_int64_t *);
+struct bench_file *bench_corpus(const char *, u_int64_t, int, size_t *);
+void		 bench_add(struct bench_samples *, double);
+int		 bench_cmp(const void *, const void *);
+void		 bench_print(const char *, struct bench_samples *,
+		    const char *, const char *);
+void		 bench_print_string(const char *);
+void		 bench_load(const char *, int);
+void		 bench_rules(struct defile *, struct bench_file *, size_t, int);
+void		 bench_classify(struct defile *, struct bench_file *, size_t,
+		    int);
+void		 bench_search(u_int64_t, int);
+void		 bench_lanes(u_int64_t, int);
+
+extern char	*__progname;
+
+/*
+ * What the corpus is made of, each kind in each size.
+ */
+struct {
+	const char	*name;
+	void		(*gen)(u_char *, size_t, u_int64_t *);
+} bench_kinds[] = {
+	{ "elf",	bench_gen_elf },
+	{ "pe",		bench_gen_pe },
+	{ "zip",	bench_gen_zip },
+	{ "png",	bench_gen_png },
+	{ "text",	bench_gen_text },
+	{ "random",	bench_gen_random },
+	{ NULL,		NULL }
+};
+size_t	bench_sizes[] = { 64, 1024, 16384, 262144, 0 };
+
+/* Ranges of the search tests, and what they look for */
+size_t	bench_ranges[] = { 64, 256, 1024, 4096, 16384, 65536, 0 };
+#define BENCH_NEEDLE	"format, header"
+
+/* How many lanes of the index get compared at once */
+u_int32_t	bench_nlanes[] = { 8, 16, 32, 64, 0 };
+#define BENCH_VALUES	1024
+
+/* Test results end up here, so the tests can't be optimised away */
+volatile u_int64_t	 bench_sink;
+
+void __dead
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-g] [-c count] [-f magic] [-n runs] "
+	    "[-s seed] dir\n", __progname);
+	exit(1);
+}
+
+/*
+ * splitmix64, so that a seed makes the same corpus everywhere.
+ */
+u_int64_t
+bench_rand(u_int64_t *state)
+{
+	u_int64_t	 z;
+
+	z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+	return (z ^ (z >> 31));
+}
+
+/*
+ * Nanoseconds since some point in the past.
+ */
+u_int64_t
+bench_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+void
+bench_le16(u_char *p, u_int16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+void
+bench_le32(u_char *p, u_int32_t v)
+{
+	bench_le16(p, v);
+	bench_le16(p + 2, v >> 16);
+}
+
+void
+bench_le64(u_char *p, u_int64_t v)
+{
+	bench_le32(p, v);
+	bench_le32(p + 4, v >> 32);
+}
+
+void
+bench_be32(u_char *p, u_int32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+void
+bench_gen_random(u_char *buf, size_t len, u_int64_t *r)
+{
+	u_int64_t	 v;
+	size_t		 i;
+
+	for (i = 0; i < len; i += sizeof(v)) {
+		v = bench_rand(r);
+		memcpy(buf + i, &v, MIN(sizeof(v), len - i));
+	}
+}
+
+/*
+ * Lines of words, as in a README.
+ */
+void
+bench_gen_text(u_char *buf, size_t len, u_int64_t *r)
+{
+	static const char *words[] = {
+		"the", "file", "magic", "of", "a", "is", "to", "and", "in",
+		"test", "offset", "byte", "string", "rule", "which", "that",
+		"with", "for", "not", "be", "read", "header", "format"
+	};
+	const char	*w;
+	size_t		 i = 0, col = 0, n;
+
+	while (i < len) {
+		w = words[bench_rand(r) % (sizeof(words) / sizeof(words[0]))];
+		n = MIN(strlen(w), len - i);
+		memcpy(buf + i, w, n);
+		i += n;
+		col += n + 1;
+		if (i < len)
+			buf[i++] = col > 72 ? '\n' : ' ';
+		if (col > 72)
+			col = 0;
+	}
+}
+
+/*
+ * A 64 bit little endian x86-64 executable.
+ */
+void
+bench_gen_elf(u_char *buf, size_t len, u_int64_t *r)
+{
+	bench_gen_random(buf, len, r);
+	memcpy(buf, "\177ELF\002\001\001\000", 8);
+	bzero(buf + 8, 8);
+	bench_le16(buf + 16, 2);		/* ET_EXEC */
+	bench_le16(buf + 18, 62);		/* EM_X86_64 */
+	bench_le32(buf + 20, 1);
+	bench_le64(buf + 24, 0x401000);		/* Entry */
+	bench_le64(buf + 32, 64);		/* Program headers */
+	bench_le64(buf + 40, len > 4096 ? len - 4096 : 0);
+	bench_le32(buf + 48, 0);
+	bench_le16(buf + 52, 64);
+	bench_le16(buf + 54, 56);
+	bench_le16(buf + 56, 9);
+	bench_le16(buf + 58, 64);
+	bench_le16(buf + 60, 30);
+	bench_le16(buf + 62, 29);
+}
+
+/*
+ * An x86-64 PE32+ executable, behind its DOS stub.
+ */
+void
+bench_gen_pe(u_char *buf, size_t len, u_int64_t *r)
+{
+	static const char stub[] = "This program cannot be run in DOS mode.";
+
+	bench_gen_random(buf, len, r);
+	bzero(buf, 0x80);
+	memcpy(buf, "MZ", 2);
+	bench_le16(buf + 2, 0x90);
+	bench_le16(buf + 4, 3);
+	bench_le16(buf + 8, 4);
+	bench_le16(buf + 0x18, 0x40);
+	bench_le32(buf + 0x3c, 0x80);		/* e_lfanew */
+	memcpy(buf + 0x4e, stub, sizeof(stub) - 1);
+	memcpy(buf + 0x80, "PE\0\0", 4);
+	bench_le16(buf + 0x84, 0x8664);		/* Machine */
+	bench_le16(buf + 0x86, 6);		/* Sections */
+	bench_le16(buf + 0x94, 0xf0);		/* Optional header size */
+	bench_le16(buf + 0x96, 0x22);
+	bench_le16(buf + 0x98, 0x20b);		/* PE32+ */
+	bench_le16(buf + 0xdc, 3);		/* Console subsystem */
+}
+
+/*
+ * One deflated member, and the end of central directory record.
+ */
+void
+bench_gen_zip(u_char *buf, size_t len, u_int64_t *r)
+{
+	static const char name[] = "bench/corpus.txt";
+	size_t		 n = sizeof(name) - 1, data;
+
+	bench_gen_random(buf, len, r);
+	data = len > 30 + n + 22 ? len - 30 - n - 22 : 0;
+	memcpy(buf, "PK\003\004", 4);
+	bench_le16(buf + 4, 20);		/* Version needed */
+	bench_le16(buf + 6, 0);
+	bench_le16(buf + 8, 8);			/* Deflated */
+	bench_le32(buf + 10, 0x5a2e6c40);	/* Time and date */
+	bench_le32(buf + 18, data);
+	bench_le32(buf + 22, data * 3);
+	bench_le16(buf + 26, n);
+	bench_le16(buf + 28, 0);
+	memcpy(buf + 30, name, n);
+	if (len >= 256) {
+		bzero(buf + len - 22, 22);
+		memcpy(buf + len - 22, "PK\005\006", 4);
+		bench_le16(buf + len - 12, 1);
+		bench_le16(buf + len - 14, 1);
+	}
+}
+
+/*
+ * An RGBA image whose IDAT runs up to the IEND.
+ */
+void
+bench_gen_png(u_char *buf, size_t len, u_int64_t *r)
+{
+	bench_gen_random(buf, len, r);
+	memcpy(buf, "\211PNG\r\n\032\n", 8);
+	bench_be32(buf + 8, 13);
+	memcpy(buf + 12, "IHDR", 4);
+	bench_be32(buf + 16, 64 + bench_rand(r) % 1024);
+	bench_be32(buf + 20, 64 + bench_rand(r) % 1024);
+	memcpy(buf + 24, "\010\006\000\000\000", 5);
+	bench_be32(buf + 33, len > 57 ? len - 57 : 0);
+	memcpy(buf + 37, "IDAT", 4);
+	if (len >= 256)
+		memcpy(buf + len - 12, "\0\0\0\0IEND\256B`\202", 12);
+}
+
+/*
+ * Write count files of each kind and size to dir, returning what they
+ * are in *nfiles entries.
+ */
+struct bench_file *
+bench_corpus(const char *dir, u_int64_t seed, int count, size_t *nfiles)
+{
+	struct bench_file	*files, *f;
+	u_char			*buf;
+	u_int64_t		 r;
+	size_t			 n = 0, len, s;
+	int			 k, i, fd;
+
+	for (k = 0; bench_kinds[k].name != NULL; k++)
+		;
+	for (s = 0; bench_sizes[s] != 0; s++)
+		;
+	if ((files = calloc(k * s * count, sizeof(*files))) == NULL)
+		err(1, "calloc");
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+		err(1, "%s", dir);
+
+	for (k = 0; bench_kinds[k].name != NULL; k++)
+		for (s = 0; bench_sizes[s] != 0; s++)
+			for (i = 0; i < count; i++) {
+				f = &files[n++];
+				f->size = bench_sizes[s];
+				(void)snprintf(f->path, sizeof(f->path),
+				    "%s/%s-%zu-%02d", dir, bench_kinds[k].name,
+				    f->size, i);
+				len = MAX(f->size, BENCH_MINBUF);
+				if ((buf = malloc(len)) == NULL)
+					err(1, "malloc");
+				r = seed ^ (u_int64_t)n << 32;
+				bench_kinds[k].gen(buf, f->size, &r);
+				if ((fd = open(f->path, O_WRONLY | O_CREAT |
+				    O_TRUNC, 0644)) == -1)
+					err(1, "%s", f->path);
+				if (write(fd, buf, f->size) != (ssize_t)f->size)
+					err(1, "write: %s", f->path);
+				close(fd);
+				free(buf);
+			}
+	*nfiles = n;
+
+	return (files);
+}
+
+void
+bench_add(struct bench_samples *bs, double v)
+{
+	double	*p;
+
+	if (bs->n == bs->alloc) {
+		bs->alloc = bs->alloc == 0 ? 64 : bs->alloc * 2;
+		if ((p = reallocarray(bs->v, bs->alloc, sizeof(*p))) == NULL)
+			err(1, "reallocarray");
+		bs->v = p;
+	}
+	bs->v[bs->n++] = v;
+}
+
+int
+bench_cmp(const void *a, const void *b)
+{
+	double	 x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * Print "name": {...} with the spread of the samples, in unit. extra,
+ * if not NULL, goes in the object as is.
+ */
+void
+bench_print(const char *name, struct bench_samples *bs, const char *unit,
+    const char *extra)
+{
+	static const int pct[] = { 50, 90, 99 };
+	double		 sum = 0;
+	size_t		 i, rank;
+
+	qsort(bs->v, bs->n, sizeof(*bs->v), bench_cmp);
+	for (i = 0; i < bs->n; i++)
+		sum += bs->v[i];
+	bench_print_string(name);
+	printf(": { \"unit\": \"%s\", \"n\": %zu", unit, bs->n);
+	if (bs->n > 0) {
+		printf(", \"min\": %.3f, \"mean\": %.3f", bs->v[0],
+		    sum / bs->n);
+		/* Nearest rank */
+		for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i++) {
+			rank = (bs->n * pct[i] + 99) / 100;
+			printf(", \"p%d\": %.3f", pct[i], bs->v[rank - 1]);
+		}
+		printf(", \"max\": %.3f", bs->v[bs->n - 1]);
+	}
+	if (extra != NULL)
+		printf(", %s", extra);
+	printf(" }");
+}
+
+void
+bench_print_string(const char *s)
+{
+	putchar('"');
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((u_char)*s < ' ')
+			printf("\\u%04x", (u_char)*s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+/*
+ * Getting a usable db through the library, whichever way it comes, and
+ * parsing all of the text file every time.
+ */
+void
+bench_load(const char *magic, int runs)
+{
+	struct bench_samples	 load, parse;
+	struct defile		*h;
+	struct df_db		*db;
+	FILE			*fp;
+	u_int64_t		 t;
+	int			 i;
+
+	bzero(&load, sizeof(load));
+	bzero(&parse, sizeof(parse));
+	for (i = 0; i < runs; i++) {
+		t = bench_now();
+		if ((h = df_open_db(magic, 0)) == NULL)
+			err(1, "df_open_db");
+		if (df_load(h) == -1)
+			err(1, "%s", magic);
+		df_close_db(h);
+		bench_add(&load, (bench_now() - t) / 1000.0);
+
+		t = bench_now();
+		if ((fp = fopen(magic, "r")) == NULL)
+			err(1, "%s", magic);
+		if ((db = df_db_load(fp, 0)) == NULL)
+			errx(1, "%s: can't parse", magic);
+		df_db_index(db, NULL);
+		df_db_plan(db, DF_READMAX);
+		df_db_free(db);
+		bench_add(&parse, (bench_now() - t) / 1000.0);
+	}
+	bench_print("load", &load, "us", NULL);
+	printf(",\n  ");
+	bench_print("parse", &parse, "us", NULL);
+	free(load.v);
+	free(parse.v);
+}
+
+/*
+ * Test each rule on its own against every file, runs times over, and
+ * group the cost per test by the type of the rule; n is how many rules
+ * of the type there are.
+ */
+void
+bench_rules(struct defile *h, struct bench_file *files, size_t nfiles,
+    int runs)
+{
+	struct bench_samples	 types[MT_DEFAULT + 1];
+	struct df_source	**srcs;
+	struct df_value		 v;
+	struct df_db		*db = h->db;
+	const struct df_rule	*r;
+	u_int64_t		 t, hits;
+	u_int32_t		 i;
+	size_t			 f;
+	int			 n, fd, first = 1;
+
+	bzero(types, sizeof(types));
+	if ((srcs = calloc(nfiles, sizeof(*srcs))) == NULL)
+		err(1, "calloc");
+	/* Left open, tests outside what was read go back to the file */
+	for (f = 0; f < nfiles; f++) {
+		if ((fd = open(files[f].path, O_RDONLY)) == -1)
+			err(1, "%s", files[f].path);
+		srcs[f] = df_source_new(db->plan);
+		if (df_source_read(srcs[f], db->plan, fd, files[f].size) == -1)
+			err(1, "read: %s", files[f].path);
+	}
+
+	for (i = 0; i < db->nrules; i++) {
+		r = &db->rules[i];
+		if (r->mtype > MT_DEFAULT)
+			continue;
+		hits = 0;
+		t = bench_now();
+		for (n = 0; n < runs; n++)
+			for (f = 0; f < nfiles; f++)
+				hits += df_rule_test(db, r, srcs[f], &v);
+		t = bench_now() - t;
+		bench_sink += hits;
+		bench_add(&types[r->mtype], (double)t / (runs * nfiles));
+	}
+
+	printf("{");
+	for (n = 0; n <= MT_DEFAULT; n++) {
+		if (types[n].n == 0)
+			continue;
+		printf("%s\n    ", first ? "" : ",");
+		first = 0;
+		bench_print(df_mtype_name(n), &types[n], "ns", NULL);
+		free(types[n].v);
+	}
+	printf("\n  }");
+
+	for (f = 0; f < nfiles; f++) {
+		close(srcs[f]->fd);
+		df_source_free(srcs[f]);
+	}
+	free(srcs);
+}
+
+/*
+ * Open and classify every file through the library, runs times over
+ * after a pass to warm the page cache.
+ */
+void
+bench_classify(struct defile *h, struct bench_file *files, size_t nfiles,
+    int runs)
+{
+	struct bench_samples	 bs;
+	u_int64_t		 t, start;
+	size_t			 f;
+	char			 buf[BUFSIZ], extra[64];
+	int			 n, fd;
+
+	bzero(&bs, sizeof(bs));
+	start = 0;
+	for (n = -1; n < runs; n++) {
+		if (n == 0)
+			start = bench_now();
+		for (f = 0; f < nfiles; f++) {
+			t = bench_now();
+			if ((fd = open(files[f].path, O_RDONLY)) == -1)
+				err(1, "%s", files[f].path);
+			if (df_classify_fd(h, fd, buf, sizeof(buf)) == -1)
+				err(1, "%s", files[f].path);
+			close(fd);
+			if (n >= 0)
+				bench_add(&bs, (bench_now() - t) / 1000.0);
+		}
+	}
+	t = bench_now() - start;
+	(void)snprintf(extra, sizeof(extra), "\"files_per_sec\": %.1f",
+	    t == 0 ? 0 : bs.n * 1e9 / t);
+	bench_print("classify", &bs, "us", extra);
+	free(bs.v);
+}
+
+/*
+ * Search tests as they are run, through each way of finding the pattern
+ * this CPU can do and through memmem(3), with the pattern at the last
+ * place in the range so all of it gets looked at. The text has plenty of
+ * places where its first and last bytes are the right distance apart,
+ * but never has the pattern itself.
+ */
+void
+bench_search(u_int64_t seed, int runs)
+{
+	struct bench_samples	 bs;
+	struct df_memfind_impl	*mi;
+	const u_char		*pat = (const u_char *)BENCH_NEEDLE;
+	u_char			*buf;
+	u_int64_t		 t, hits;
+	size_t			 len = strlen(BENCH_NEEDLE), i, j, n, range, iters;
+	/* Called through this, or the compiler calls it only once */
+	void			*(*volatile mm)(const void *, size_t,
+				    const void *, size_t) = memmem;
+	int			 cpu = df_cpu_flags(), run;
+
+	printf("{");
+	for (i = 0; (range = bench_ranges[i]) != 0; i++) {
+		n = range - 1 + len;
+		if ((buf = malloc(n)) == NULL)
+			err(1, "malloc");
+		bench_gen_text(buf, n, &seed);
+		memcpy(buf + range - 1, pat, len);
+		/* Enough of them for the clock to see */
+		iters = MAX(1, (1 << 20) / range);
+
+		printf("%s\n    \"%zu\": {\n      ", i == 0 ? "" : ",", range);
+		bzero(&bs, sizeof(bs));
+		for (run = 0; run < runs; run++) {
+			hits = 0;
+			t = bench_now();
+			for (j = 0; j < iters; j++)
+				hits += mm(buf, n, pat, len) != NULL;
+			bench_add(&bs, (double)(bench_now() - t) / iters);
+			bench_sink += hits;
+		}
+		bench_print("memmem", &bs, "ns", NULL);
+		free(bs.v);
+		for (mi = df_memfind_impls; mi->name != NULL; mi++) {
+			if ((mi->cpu & cpu) != mi->cpu)
+				continue;
+			bzero(&bs, sizeof(bs));
+			for (run = 0; run < runs; run++) {
+				hits = 0;
+				t = bench_now();
+				for (j = 0; j < iters; j++)
+					hits += mi->fn(buf, n, range, pat,
+					    len);
+				bench_add(&bs,
+				    (double)(bench_now() - t) / iters);
+				bench_sink += hits;
+			}
+			printf(",\n      ");
+			bench_print(mi->name, &bs, "ns", NULL);
+			free(bs.v);
+		}
+		printf("\n    }");
+		free(buf);
+	}
+	printf("\n  }");
+}
+
+/*
+ * Compare values against lanes of masked equality tests, some of which
+ * they pass, with each way there is of doing that.
+ */
+void
+bench_lanes(u_int64_t seed, int runs)
+{
+	struct bench_samples	 bs;
+	struct df_lanes_impl	*li;
+	u_int32_t		 mask[DF_LANES_MAX], value[DF_LANES_MAX];
+	u_int32_t		 x[BENCH_VALUES], n;
+	u_int64_t		 t, bits;
+	size_t			 i, j;
+	int			 cpu = df_cpu_flags(), run;
+
+	for (i = 0; i < DF_LANES_MAX; i++) {
+		mask[i] = bench_rand(&seed);
+		value[i] = bench_rand(&seed) & mask[i];
+	}
+	for (i = 0; i < BENCH_VALUES; i++)
+		x[i] = i % 4 == 0 ? value[i % DF_LANES_MAX] :
+		    bench_rand(&seed);
+
+	printf("{");
+	for (i = 0; (n = bench_nlanes[i]) != 0; i++) {
+		printf("%s\n    \"%u\": {", i == 0 ? "" : ",", n);
+		for (li = df_lanes_impls; li->name != NULL; li++) {
+			if ((li->cpu & cpu) != li->cpu)
+				continue;
+			bzero(&bs, sizeof(bs));
+			for (run = 0; run < runs; run++) {
+				bits = 0;
+				t = bench_now();
+				for (j = 0; j < BENCH_VALUES; j++)
+					bits += li->fn(mask, value, n, x[j]);
+				bench_add(&bs,
+				    (double)(bench_now() - t) / BENCH_VALUES);
+				bench_sink += bits;
+			}
+			printf("%s\n      ", li == df_lanes_impls ? "" : ",");
+			bench_print(li->name, &bs, "ns", NULL);
+			free(bs.v);
+		}
+		printf("\n    }");
+	}
+	printf("\n  }");
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_file	*files;
+	struct defile		*h;
+	const char		*errstr, *magic = MAGIC;
+	u_int64_t		 seed = 1;
+	size_t			 nfiles, f, bytes = 0;
+	int			 ch, gflag = 0, count = 8, runs = 20;
+
+	while ((ch = getopt(argc, argv, "c:f:gn:s:")) != -1) {
+		switch (ch) {
+		case 'c':
+			count = strtonum(optarg, 1, 1000, &errstr);
+			if (errstr != NULL)
+				errx(1, "count %s: %s", optarg, errstr);
+			break;
+		case 'f':
+			magic = optarg;
+			break;
+		case 'g':
+			gflag = 1;
+			break;
+		case 'n':
+			runs = strtonum(optarg, 1, 100000, &errstr);
+			if (errstr != NULL)
+				errx(1, "runs %s: %s", optarg, errstr);
+			break;
+		case 's':
+			seed = strtonum(optarg, 0, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "seed %s: %s", optarg, errstr);
+			break;
+		default:
+			usage();
+			break;	/* NOTREACHED */
+		}
+	}
+	argv += optind;
+	argc -= optind;
+	if (argc != 1)
+		usage();
+
+	files = bench_corpus(argv[0], seed, count, &nfiles);
+	if (gflag)
+		return (EXIT_SUCCESS);
+	for (f = 0; f < nfiles; f++)
+		bytes += files[f].size;
+
+	/* Every rule compiled, so that bench_rules() times them all */
+	if ((h = df_open_db(magic, DF_EAGER)) == NULL)
+		err(1, "df_open_db");
+	if (df_load(h) == -1)
+		err(1, "%s", magic);
+
+	printf("{\n  \"magic\": ");
+	bench_print_string(magic);
+	printf(",\n  \"seed\": %llu,\n  \"runs\": %d,\n"
+	    "  \"corpus\": { \"files\": %zu, \"bytes\": %zu },\n"
+	    "  \"rules\": %u,\n  ", (unsigned long long)seed, runs, nfiles,
+	    bytes, h->db->nrules);
+	bench_load(magic, runs);
+	printf(",\n  \"tests\": ");
+	bench_rules(h, files, nfiles, runs);
+	printf(",\n  ");
+	bench_classify(h, files, nfiles, runs);
+	printf(",\n  \"search\": ");
+	bench_search(seed, runs);
+	printf(",\n  \"lanes\": ");
+	bench_lanes(seed, runs);
+	printf("\n}\n");
+
+	df_close_db(h);
+	free(files);
+
+	return (EXIT_SUCCESS);
+}
@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Compare -Q read ahead depths classifying a tree on a cold cache.
+#
+# usage: prefetch.sh [-j jobs] [-f magic] dir [depth ...]
+#
+# Before each run the page cache is emptied with $DROP_CACHES, which has
+# to be set to whatever does that here: unmounting and mounting again the
+# filesystem dir is on, or on Linux "sync; echo 3 >/proc/sys/vm/drop_caches".
+# Without it the runs are warm and only show the overhead of reading ahead.
+
+FILE=${FILE:-./file}
+TIME=${TIME:-/usr/bin/time}
+jobs=1
+magic=
+
+usage() {
+	echo "usage: ${0##*/} [-j jobs] [-f magic] dir [depth ...]" >&2
+	exit 1
+}
+
+while getopts f:j: ch; do
+	case $ch in
+	f)	magic="-f $OPTARG" ;;
+	j)	jobs=$OPTARG ;;
+	*)	usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -ge 1 ] || usage
+dir=$1
+shift
+[ $# -ge 1 ] || set -- 0 1 2 4 8 16 32 64
+
+if [ -z "$DROP_CACHES" ]; then
+	echo "${0##*/}: DROP_CACHES not set, the cache stays warm" >&2
+fi
+
+nfiles=$($FILE $magic -R "$dir" 2>/dev/null | wc -l)
+printf "%6s %10s %12s\n" depth seconds files/s
+for depth in "$@"; do
+	[ -n "$DROP_CACHES" ] && sh -c "$DROP_CACHES"
+	secs=$($TIME -p $FILE $magic -j $jobs -Q $depth -R "$dir" \
+	    2>&1 >/dev/null | awk '$1 == "real" { print $2 }')
+	echo $depth $secs $nfiles |
+	    awk '{ printf "%6d %10.2f %12.0f\n", $1, $2, $3 / ($2 + 0.001) }'
+done
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2011, Edd Barrett <vext01@gmail.com>
+ * Copyright (c) 2011, Christiano F. Haesbaert <haesbaert@haesbaert.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/param.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defile.h"
+#include "file.h"
+
+#define DF_CACHE_HASH(dev, ino, n)					\
+	((u_int32_t)(((dev) * 0x9e3779b97f4a7c15ULL ^ (ino)) *		\
+	    0xff51afd7ed558ccdULL >> 32) & ((n) - 1))
+
+/*
+ * Map the cache at path, making it if need be. We write to it if no one
+ * else is, otherwise only read. A cache made for other rules is emptied,
+ * or ignored if we can't write to it.
+ */
+struct df_cache *
+df_cache_open(const char *path, u_int64_t fingerprint)
+{
+	struct df_cache		*c;
+	struct df_cache_header	*ch;
+	struct stat		 sb;
+	size_t			 len;
+	int			 fd, writer = 1;
+
+	len = sizeof(*ch) + (size_t)DF_CACHE_NSLOTS *
+	    sizeof(struct df_cache_slot);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+		writer = 0;
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+			warn("%s", path);
+			return (NULL);
+		}
+	}
+	if (writer && flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		if (errno != EWOULDBLOCK)
+			warn("flock: %s", path);
+		writer = 0;
+	}
+	if (fstat(fd, &sb) == -1) {
+		warn("%s", path);
+		goto bad;
+	}
+	/* Only the writer ever changes the size, readers would fault */
+	if ((size_t)sb.st_size != len) {
+		if (!writer)
+			goto bad;
+		if (ftruncate(fd, 0) == -1 || ftruncate(fd, len) == -1) {
+			warn("%s", path);
+			goto bad;
+		}
+	}
+
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		err(1, "calloc");
+	c->map = mmap(NULL, len, PROT_READ | (writer ? PROT_WRITE : 0),
+	    MAP_SHARED, fd, 0);
+	if (c->map == MAP_FAILED) {
+		warn("mmap: %s", path);
+		free(c);
+		goto bad;
+	}
+	c->fd = fd;
+	c->maplen = len;
+	c->slots = (struct df_cache_slot *)((char *)c->map + sizeof(*ch));
+	c->nslots = DF_CACHE_NSLOTS;
+	c->fingerprint = fingerprint;
+	c->writer = writer;
+	pthread_mutex_init(&c->lock, NULL);
+
+	ch = c->map;
+	if (ch->ch_magic != DF_CACHE_MAGIC ||
+	    ch->ch_version != DF_CACHE_VERSION ||
+	    ch->ch_nslots != c->nslots ||
+	    ch->ch_slot_size != sizeof(struct df_cache_slot) ||
+	    ch->ch_fingerprint != fingerprint) {
+		if (!writer) {
+			df_cache_close(c);
+			return (NULL);
+		}
+		/*
+		 * The checksums of what's in there now won't add up with
+		 * the new fingerprint, so the slots count as free. Leaving
+		 * them be doesn't dirty every page, or pull the file from
+		 * under anyone still reading it.
+		 */
+		DPRINTF(1, "cache %s: starting afresh", path);
+		ch->ch_fingerprint = fingerprint;
+		ch->ch_magic = DF_CACHE_MAGIC;
+		ch->ch_version = DF_CACHE_VERSION;
+		ch->ch_nslots = c->nslots;
+		ch->ch_slot_size = sizeof(struct df_cache_slot);
+	}
+	DPRINTF(1, "cache %s: %s", path, writer ? "read-write" : "read-only");
+
+	return (c);
+bad:
+	close(fd);
+	return (NULL);
+}
+
+void
+df_cache_close(struct df_cache *c)
+{
+	if (c == NULL)
+		return;
+	munmap(c->map, c->maplen);
+	close(c->fd);
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+/*
+ * Checksum of everything in a slot but the checksum, never 0.
+ */
+u_int64_t
+df_cache_slot_sum(const struct df_cache_slot *cs, u_int64_t fingerprint)
+{
+	u_int64_t	 h;
+	size_t		 len;
+
+	len = offsetof(struct df_cache_slot, cs_desc) - sizeof(cs->cs_sum);
+	h = df_hash64(&cs->cs_dev, len, fingerprint);
+	h = df_hash64(cs->cs_desc, MIN(cs->cs_len, sizeof(cs->cs_desc)), h);
+
+	return (h == 0 ? 1 : h);
+}
+
+/*
+ * Is cs about the file sb describes, as it is now?
+ */
+int
+df_cache_key(const struct df_cache_slot *cs, const struct stat *sb)
+{
+	return (cs->cs_dev == (u_int64_t)sb->st_dev &&
+	    cs->cs_ino == (u_int64_t)sb->st_ino &&
+	    cs->cs_size == sb->st_size &&
+	    cs->cs_mtime == sb->st_mtim.tv_sec &&
+	    cs->cs_mtime_nsec == sb->st_mtim.tv_nsec &&
+	    cs->cs_ctime == sb->st_ctim.tv_sec &&
+	    cs->cs_ctime_nsec == sb->st_ctim.tv_nsec);
+}
+
+/*
+ * Look for what the file sb describes was found to be last time, into
+ * buf. Returns 0 if it was there.
+ */
+int
+df_cache_lookup(struct df_cache *c, const struct stat *sb, char *buf,
+    size_t len)
+{
+	struct df_cache_slot	 cs;
+	u_int32_t		 h, i;
+
+	h = DF_CACHE_HASH((u_int64_t)sb->st_dev, (u_int64_t)sb->st_ino,
+	    c->nslots);
+	for (i = 0; i < DF_CACHE_PROBES; i++) {
+		/* Work on a copy, the writer may be at it as we read */
+		memcpy(&cs, &c->slots[(h + i) & (c->nslots - 1)], sizeof(cs));
+		if (cs.cs_sum == 0)
+			return (-1);
+		if (!df_cache_key(&cs, sb))
+			continue;
+		if (cs.cs_len >= sizeof(cs.cs_desc) || cs.cs_len >= len ||
+		    cs.cs_sum != df_cache_slot_sum(&cs, c->fingerprint))
+			return (-1);
+		memcpy(buf, cs.cs_desc, cs.cs_len);
+		buf[cs.cs_len] = '\0';
+		return (0);
+	}
+
+	return (-1);
+}
+
+/*
+ * Remember desc for the file sb describes. It goes in the first of its
+ * slots that is free, left over from other rules, or already about it;
+ * failing that, its first.
+ */
+void
+df_cache_store(struct df_cache *c, const struct stat *sb, const char *desc)
+{
+	struct df_cache_slot	*cs, *slot = NULL;
+	size_t			 len = strlen(desc);
+	u_int32_t		 h, i;
+
+	if (!c->writer || len >= sizeof(cs->cs_desc))
+		return;
+	h = DF_CACHE_HASH((u_int64_t)sb->st_dev, (u_int64_t)sb->st_ino,
+	    c->nslots);
+	pthread_mutex_lock(&c->lock);
+	for (i = 0; i < DF_CACHE_PROBES && slot == NULL; i++) {
+		cs = &c->slots[(h + i) & (c->nslots - 1)];
+		if (cs->cs_sum == 0 ||
+		    (cs->cs_dev == (u_int64_t)sb->st_dev &&
+		    cs->cs_ino == (u_int64_t)sb->st_ino) ||
+		    cs->cs_sum != df_cache_slot_sum(cs, c->fingerprint))
+			slot = cs;
+	}
+	if (slot == NULL)
+		slot = &c->slots[h];
+
+	/* Invalid while it's being written */
+	slot->cs_sum = 0;
+	slot->cs_dev = sb->st_dev;
+	slot->cs_ino = sb->st_ino;
+	slot->cs_size = sb->st_size;
+	slot->cs_mtime = sb->st_mtim.tv_sec;
+	slot->cs_mtime_nsec = sb->st_mtim.tv_nsec;
+	slot->cs_ctime = sb->st_ctim.tv_sec;
+	slot->cs_ctime_nsec = sb->st_ctim.tv_nsec;
+	slot->cs_len = len;
+	memcpy(slot->cs_desc, desc, len);
+	slot->cs_sum = df_cache_slot_sum(slot, c->fingerprint);
+	pthread_mutex_unlock(&c->lock);
+}
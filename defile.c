@@ -0,0 +1,972 @@
+/*
+ * Copyright (c) 2011, Edd Barrett <vext01@gmail.com>
+ * Copyright (c) 2011, Christiano F. Haesbaert <haesbaert@haesbaert.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <util.h>
+
+#include "defile.h"
+#include "file.h"
+
+int		 df_classify(struct defile *, struct df_db *, struct df_matches *,
+    struct df_source *, char *, size_t);
+int		 df_profile_cmp(const void *, const void *);
+void		 df_load_order(struct defile *, struct df_db *);
+int		 df_hits_cmp(const void *, const void *);
+
+/*
+ * Get a handle on the magic file at path, or the default one if NULL.
+ * Nothing is read until df_load().
+ */
+struct defile *
+df_open_db(const char *path, int flags)
+{
+	struct defile	*h;
+	int		 error;
+
+	if ((h = calloc(1, sizeof(*h))) == NULL)
+		return (NULL);
+	if ((h->magic_path = strdup(path != NULL ? path : MAGIC)) == NULL) {
+		free(h);
+		return (NULL);
+	}
+	h->flags = flags;
+	h->read_max = DF_READMAX;
+	h->epoch = 1;
+	if ((error = pthread_key_create(&h->key, df_thread_free)) != 0) {
+		free(h->magic_path);
+		free(h);
+		errno = error;
+		return (NULL);
+	}
+	pthread_mutex_init(&h->reload_lock, NULL);
+	pthread_mutex_init(&h->threads_lock, NULL);
+	LIST_INIT(&h->threads);
+
+	return (h);
+}
+
+/*
+ * Compile the magic db.
+ */
+int
+df_load(struct defile *h)
+{
+	if (h->db != NULL)
+		return (0);
+	if ((h->db = df_load_db(h)) == NULL)
+		return (-1);
+	h->db->gen = h->epoch;
+
+	return (0);
+}
+
+/*
+ * Make a db out of the magic file as it is now. Use the image next to it
+ * if there is an up to date one, otherwise parse the text file.
+ */
+struct df_db *
+df_load_db(struct defile *h)
+{
+	FILE		*magic_file;
+	struct df_db	*db;
+	struct stat	 sb;
+
+	if (stat(h->magic_path, &sb) == -1)
+		return (NULL);
+	if ((db = df_db_map(h->magic_path, &sb)) == NULL) {
+		if ((magic_file = fopen(h->magic_path, "r")) == NULL)
+			return (NULL);
+		db = df_db_load(magic_file, !(h->flags & DF_EAGER));
+		if (db == NULL)
+			return (NULL);
+	}
+	df_load_order(h, db);
+	df_db_plan(db, h->read_max);
+
+	return (db);
+}
+
+/*
+ * Load the magic file again and switch to it, leaving the old db to the
+ * threads still using it. Only the thread calling this waits for them.
+ */
+int
+df_reload(struct defile *h)
+{
+	struct df_db	*db, *old;
+	u_int64_t	 epoch;
+
+	pthread_mutex_lock(&h->reload_lock);
+	/* Profiles count by rule, and the rules are about to change */
+	if (h->db == NULL || h->profile != NULL) {
+		pthread_mutex_unlock(&h->reload_lock);
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((db = df_load_db(h)) == NULL) {
+		pthread_mutex_unlock(&h->reload_lock);
+		return (-1);
+	}
+	old = h->db;
+	epoch = h->epoch + 1;
+	db->gen = epoch;
+	__atomic_store_n(&h->db, db, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&h->epoch, epoch, __ATOMIC_SEQ_CST);
+	df_synchronize(h, epoch);
+	df_db_free(old);
+	pthread_mutex_unlock(&h->reload_lock);
+	DPRINTF(1, "reloaded %s: %u rules", h->magic_path, db->nrules);
+
+	return (0);
+}
+
+/*
+ * Wait until every thread that could still be using a db from before
+ * epoch is done classifying. The list is only locked to look at it, not
+ * while we wait, so that threads classifying for the first time can add
+ * themselves meanwhile; they start on the new db.
+ */
+void
+df_synchronize(struct defile *h, u_int64_t epoch)
+{
+	struct df_thread	*t;
+	u_int64_t		 e;
+	int			 busy;
+
+	for (;;) {
+		busy = 0;
+		pthread_mutex_lock(&h->threads_lock);
+		LIST_FOREACH(t, &h->threads, entry) {
+			e = __atomic_load_n(&t->epoch, __ATOMIC_SEQ_CST);
+			if (e != 0 && e < epoch) {
+				busy = 1;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&h->threads_lock);
+		if (!busy)
+			break;
+		usleep(1000);
+	}
+}
+
+/*
+ * Start classifying: the db to use until df_leave(), NULL if there is
+ * none. Whatever epoch we read, the db we then read is at least as new,
+ * and df_synchronize() won't free it from under us.
+ */
+struct df_db *
+df_enter(struct defile *h, struct df_thread *t)
+{
+	__atomic_store_n(&t->epoch, __atomic_load_n(&h->epoch,
+	    __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+
+	return (__atomic_load_n(&h->db, __ATOMIC_SEQ_CST));
+}
+
+void
+df_leave(struct df_thread *t)
+{
+	__atomic_store_n(&t->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Reload from a thread of our own whenever the magic file or its image
+ * changes, looking every secs seconds.
+ */
+int
+df_watch(struct defile *h, int secs)
+{
+	struct df_watch	*w;
+	int		 error;
+
+	if (h->db == NULL || h->watch != NULL || secs <= 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((w = calloc(1, sizeof(*w))) == NULL)
+		return (-1);
+	w->secs = secs;
+	df_watch_stat(h, w->sb);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	h->watch = w;
+	if ((error = pthread_create(&w->thread, NULL, df_watch_main, h)) != 0) {
+		h->watch = NULL;
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		free(w);
+		errno = error;
+		return (-1);
+	}
+
+	return (0);
+}
+
+void *
+df_watch_main(void *arg)
+{
+	struct defile	*h = arg;
+	struct df_watch	*w = h->watch;
+	struct stat	 sb[2];
+	struct timespec	 ts;
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += w->secs;
+		if (!w->reload)
+			pthread_cond_timedwait(&w->cond, &w->lock, &ts);
+		if (w->stop)
+			break;
+		df_watch_stat(h, sb);
+		if (!w->reload && df_stat_same(&sb[0], &w->sb[0]) &&
+		    df_stat_same(&sb[1], &w->sb[1]))
+			continue;
+		w->reload = 0;
+		memcpy(w->sb, sb, sizeof(w->sb));
+		pthread_mutex_unlock(&w->lock);
+		if (df_reload(h) == -1)
+			warn("reload %s", h->magic_path);
+		pthread_mutex_lock(&w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return (NULL);
+}
+
+/*
+ * Have the thread started by df_watch() reload now, whether or not the
+ * magic file changed, without waiting for it to be done.
+ */
+int
+df_watch_reload(struct defile *h)
+{
+	struct df_watch	*w = h->watch;
+
+	if (w == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	pthread_mutex_lock(&w->lock);
+	w->reload = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	return (0);
+}
+
+/*
+ * The stat of the magic file and of its image, zeroed if missing.
+ */
+void
+df_watch_stat(struct defile *h, struct stat *sb)
+{
+	char	 img[MAXPATHLEN];
+
+	if (stat(h->magic_path, &sb[0]) == -1)
+		bzero(&sb[0], sizeof(sb[0]));
+	if (snprintf(img, sizeof(img), "%s%s", h->magic_path,
+	    DF_DB_SUFFIX) >= (int)sizeof(img) || stat(img, &sb[1]) == -1)
+		bzero(&sb[1], sizeof(sb[1]));
+}
+
+/* Would we have seen a change between a and b? */
+int
+df_stat_same(const struct stat *a, const struct stat *b)
+{
+	return (a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+	    a->st_size == b->st_size &&
+	    a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	    a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+	    a->st_ctim.tv_sec == b->st_ctim.tv_sec &&
+	    a->st_ctim.tv_nsec == b->st_ctim.tv_nsec);
+}
+
+/*
+ * Read the hit profile at path, written by df_profile_write(), to order
+ * the rules by once they are loaded.
+ */
+int
+df_order(struct defile *h, const char *path)
+{
+	FILE		*fp;
+	u_int64_t	(*hits)[2];
+	char		*line, *p;
+	const char	*errstr;
+	size_t		 len, lineno = 0;
+
+	if (h->db != NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((fp = fopen(path, "r")) == NULL)
+		return (-1);
+	while ((line = fparseln(fp, &len, &lineno, NULL, 0)) != NULL) {
+		if (*line == '\0') {
+			free(line);
+			continue;
+		}
+		if ((p = strchr(line, ' ')) == NULL)
+			goto bad;
+		if ((hits = reallocarray(h->hits, h->nhits + 1,
+		    sizeof(*h->hits))) == NULL)
+			err(1, "reallocarray");
+		h->hits = hits;
+		*p++ = '\0';
+		h->hits[h->nhits][0] = strtonum(line, 1, UINT_MAX, &errstr);
+		if (errstr != NULL)
+			goto bad;
+		h->hits[h->nhits][1] = strtonum(p, 0, LLONG_MAX, &errstr);
+		if (errstr != NULL)
+			goto bad;
+		h->nhits++;
+		free(line);
+	}
+	if (ferror(fp)) {
+		fclose(fp);
+		return (-1);
+	}
+	fclose(fp);
+	qsort(h->hits, h->nhits, sizeof(*h->hits), df_index_key_cmp);
+
+	return (0);
+bad:
+	warnx("%s:%zu: bad hit profile line", path, lineno);
+	free(line);
+	fclose(fp);
+	errno = EFTYPE;
+	return (-1);
+}
+
+/*
+ * Index the rules, the ones a hit profile names in the order it gives.
+ */
+void
+df_load_order(struct defile *h, struct df_db *db)
+{
+	u_int64_t	*hits, key[2], (*found)[2];
+	u_int32_t	 idx;
+
+	if (h->nhits == 0) {
+		df_db_index(db, NULL);
+		return;
+	}
+	if ((hits = calloc(db->nrules, sizeof(*hits))) == NULL)
+		err(1, "calloc");
+	for (idx = 0; idx != DF_RULE_NONE; idx = db->rules[idx].next) {
+		key[0] = db->rules[idx].lineno;
+		key[1] = 0;
+		found = bsearch(key, h->hits, h->nhits, sizeof(*h->hits),
+		    df_hits_cmp);
+		if (found != NULL)
+			hits[idx] = (*found)[1];
+	}
+	df_db_index(db, hits);
+	free(hits);
+}
+
+/* Look up a line in the hit profile */
+int
+df_hits_cmp(const void *a, const void *b)
+{
+	const u_int64_t	*ka = a, *kb = b;
+
+	return (ka[0] < kb[0] ? -1 : ka[0] > kb[0]);
+}
+
+/*
+ * The state of the calling thread, made on first use.
+ */
+struct df_thread *
+df_thread_get(struct defile *h)
+{
+	struct df_thread	*t;
+	int			 error;
+
+	if ((t = pthread_getspecific(h->key)) != NULL)
+		return (t);
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		err(1, "calloc");
+	df_matches_init(&t->matches);
+	t->h = h;
+	if ((error = pthread_setspecific(h->key, t)) != 0)
+		errc(1, error, "pthread_setspecific");
+	pthread_mutex_lock(&h->threads_lock);
+	LIST_INSERT_HEAD(&h->threads, t, entry);
+	pthread_mutex_unlock(&h->threads_lock);
+
+	return (t);
+}
+
+void
+df_thread_free(void *arg)
+{
+	struct df_thread	*t = arg;
+
+	if (t == NULL)
+		return;
+	pthread_mutex_lock(&t->h->threads_lock);
+	LIST_REMOVE(t, entry);
+	pthread_mutex_unlock(&t->h->threads_lock);
+	df_source_free(t->src);
+	df_matches_free(&t->matches);
+	free(t);
+}
+
+/*
+ * The read buffer of the calling thread, sized for the plan of db.
+ */
+struct df_source *
+df_thread_source(struct defile *h, struct df_db *db)
+{
+	struct df_thread	*t = df_thread_get(h);
+
+	if (t->src != NULL && t->gen != db->gen) {
+		df_source_free(t->src);
+		t->src = NULL;
+	}
+	if (t->src == NULL) {
+		t->src = df_source_new(db->plan);
+		t->gen = db->gen;
+	}
+
+	return (t->src);
+}
+
+/*
+ * Keep the results for the last n distinct headers seen, so that files
+ * sharing them with an earlier one skip the rules.
+ */
+int
+df_dedup(struct defile *h, size_t n)
+{
+	struct df_dedup	*dd;
+	size_t		 i;
+
+	if (h->dedup != NULL || n == 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((dd = calloc(1, sizeof(*dd))) == NULL)
+		return (-1);
+	for (dd->nbuckets = 16; dd->nbuckets < n; dd->nbuckets *= 2)
+		;
+	if ((dd->entries = calloc(n, sizeof(*dd->entries))) == NULL ||
+	    (dd->buckets = calloc(dd->nbuckets,
+	    sizeof(*dd->buckets))) == NULL) {
+		free(dd->entries);
+		free(dd);
+		return (-1);
+	}
+	dd->nentries = n;
+	TAILQ_INIT(&dd->lru);
+	for (i = 0; i < n; i++)
+		TAILQ_INSERT_TAIL(&dd->lru, &dd->entries[i], lru);
+	pthread_mutex_init(&dd->lock, NULL);
+	h->dedup = dd;
+
+	return (0);
+}
+
+void
+df_dedup_stats(struct defile *h, struct df_dedup_stats *st)
+{
+	if (h->dedup == NULL) {
+		bzero(st, sizeof(*st));
+		return;
+	}
+	pthread_mutex_lock(&h->dedup->lock);
+	*st = h->dedup->stats;
+	pthread_mutex_unlock(&h->dedup->lock);
+}
+
+/*
+ * The hash of everything src read for the plan, and of the file size,
+ * since rules can tell how far the file goes. Seeded by the db, so that
+ * what older rules found is never used with newer ones.
+ */
+u_int64_t
+df_dedup_key(const struct df_source *src, u_int64_t seed)
+{
+	u_int64_t	 key = src->size ^ seed;
+	int		 i;
+
+	for (i = 0; i < src->next; i++)
+		key = df_hash64(src->ext[i].buf, src->ext[i].len,
+		    key ^ src->ext[i].off);
+
+	return (key);
+}
+
+/*
+ * Add the matches kept for key to matches, returns -1 if there are none.
+ */
+int
+df_dedup_lookup(struct df_dedup *dd, u_int64_t key, struct df_matches *matches)
+{
+	struct df_dedup_entry	*e;
+	struct df_match		*dm;
+	char			 data[DF_DEDUP_DATALEN];
+	size_t			 len = 0, off;
+
+	pthread_mutex_lock(&dd->lock);
+	LIST_FOREACH(e, &dd->buckets[key & (dd->nbuckets - 1)], chain)
+		if (e->key == key)
+			break;
+	if (e != NULL) {
+		TAILQ_REMOVE(&dd->lru, e, lru);
+		TAILQ_INSERT_HEAD(&dd->lru, e, lru);
+		memcpy(data, e->data, e->len);
+		len = e->len;
+		dd->stats.hits++;
+	} else
+		dd->stats.misses++;
+	pthread_mutex_unlock(&dd->lock);
+	if (e == NULL)
+		return (-1);
+
+	for (off = 0; off < len; off += strlen(data + off) + 1) {
+		dm = df_match_add(matches, (u_char)data[off] >> 4, "%s",
+		    data + off + 1);
+		dm->flags = data[off++] & 0x0f;
+	}
+
+	return (0);
+}
+
+/*
+ * Keep the matches from dm on for key, in place of the least recently
+ * used. Lists too long to keep aren't.
+ */
+void
+df_dedup_insert(struct df_dedup *dd, u_int64_t key, const struct df_match *dm)
+{
+	struct df_dedup_entry	*e;
+	char			 data[DF_DEDUP_DATALEN];
+	size_t			 len = 0, n;
+
+	for (; dm != NULL; dm = TAILQ_NEXT(dm, entry)) {
+		n = strlen(dm->desc) + 2;
+		if (len + n > sizeof(data) || dm->class > 0x0f ||
+		    dm->flags > 0x0f)
+			return;
+		data[len] = dm->class << 4 | dm->flags;
+		memcpy(data + len + 1, dm->desc, n - 1);
+		len += n;
+	}
+
+	pthread_mutex_lock(&dd->lock);
+	/* Someone else may have just done the same file */
+	LIST_FOREACH(e, &dd->buckets[key & (dd->nbuckets - 1)], chain)
+		if (e->key == key)
+			break;
+	if (e == NULL) {
+		e = TAILQ_LAST(&dd->lru, df_dedup_lru);
+		if (e->used)
+			LIST_REMOVE(e, chain);
+		e->used = 1;
+		e->key = key;
+		e->len = len;
+		memcpy(e->data, data, len);
+		LIST_INSERT_HEAD(&dd->buckets[key & (dd->nbuckets - 1)], e,
+		    chain);
+		TAILQ_REMOVE(&dd->lru, e, lru);
+		TAILQ_INSERT_HEAD(&dd->lru, e, lru);
+	}
+	pthread_mutex_unlock(&dd->lock);
+}
+
+/*
+ * Limit what each file may cost, see struct df_budget. Nothing may be
+ * classifying yet.
+ */
+int
+df_budget(struct defile *h, const struct df_budget *b)
+{
+	if (h->budget == NULL && (h->budget = malloc(sizeof(*b))) == NULL)
+		return (-1);
+	*h->budget = *b;
+
+	return (0);
+}
+
+int
+df_profile(struct defile *h)
+{
+	struct df_profile	*p;
+
+	if (h->db == NULL || h->profile != NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		return (-1);
+	pthread_mutex_init(&p->lock, NULL);
+	LIST_INIT(&p->sets);
+	h->profile = p;
+
+	return (0);
+}
+
+/*
+ * The counters of the calling thread, made on first use.
+ */
+struct df_prof_set *
+df_profile_get(struct defile *h, struct df_db *db)
+{
+	struct df_thread	*t = df_thread_get(h);
+
+	if (t->prof != NULL)
+		return (t->prof);
+	if ((t->prof = calloc(1, sizeof(*t->prof) + db->nrules *
+	    sizeof(struct df_rule_prof))) == NULL)
+		err(1, "calloc");
+	pthread_mutex_lock(&h->profile->lock);
+	LIST_INSERT_HEAD(&h->profile->sets, t->prof, entry);
+	pthread_mutex_unlock(&h->profile->lock);
+
+	return (t->prof);
+}
+
+/* Most time first, then most evaluated */
+int
+df_profile_cmp(const void *a, const void *b)
+{
+	const struct df_rule_prof *x = *(struct df_rule_prof *const *)a;
+	const struct df_rule_prof *y = *(struct df_rule_prof *const *)b;
+
+	if (x->nsec != y->nsec)
+		return (x->nsec < y->nsec ? 1 : -1);
+	if (x->evals != y->evals)
+		return (x->evals < y->evals ? 1 : -1);
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * What every rule cost, over all threads.
+ */
+struct df_rule_prof *
+df_profile_sum(struct defile *h)
+{
+	struct df_rule_prof	*sum;
+	struct df_prof_set	*ps;
+	u_int32_t		 i;
+
+	if ((sum = calloc(h->db->nrules, sizeof(*sum))) == NULL)
+		err(1, "calloc");
+	pthread_mutex_lock(&h->profile->lock);
+	LIST_FOREACH(ps, &h->profile->sets, entry)
+		for (i = 0; i < h->db->nrules; i++) {
+			sum[i].evals += ps->rules[i].evals;
+			sum[i].matches += ps->rules[i].matches;
+			sum[i].bytes += ps->rules[i].bytes;
+			sum[i].nsec += ps->rules[i].nsec;
+		}
+	pthread_mutex_unlock(&h->profile->lock);
+
+	return (sum);
+}
+
+/*
+ * Print a line for each rule that was ever tested, costliest first.
+ */
+void
+df_profile_print(struct defile *h, FILE *fp)
+{
+	struct df_rule_prof	*sum, **sorted, total;
+	const struct df_rule	*r;
+	u_int32_t		 i, n = 0;
+
+	if (h->profile == NULL)
+		return;
+	sum = df_profile_sum(h);
+	if ((sorted = calloc(h->db->nrules, sizeof(*sorted))) == NULL)
+		err(1, "calloc");
+	bzero(&total, sizeof(total));
+	for (i = 0; i < h->db->nrules; i++) {
+		if (sum[i].evals == 0)
+			continue;
+		sorted[n++] = &sum[i];
+		total.evals += sum[i].evals;
+		total.matches += sum[i].matches;
+		total.bytes += sum[i].bytes;
+		total.nsec += sum[i].nsec;
+	}
+	qsort(sorted, n, sizeof(*sorted), df_profile_cmp);
+
+	fprintf(fp, "%10s %10s %10s %12s %8s  %s\n", "usec", "evals",
+	    "matches", "bytes", "ns/eval", "rule");
+	for (i = 0; i < n; i++) {
+		r = &h->db->rules[sorted[i] - sum];
+		fprintf(fp, "%10.1f %10llu %10llu %12llu %8.1f  %s:%u %s %.40s\n",
+		    sorted[i]->nsec / 1000.0,
+		    (unsigned long long)sorted[i]->evals,
+		    (unsigned long long)sorted[i]->matches,
+		    (unsigned long long)sorted[i]->bytes,
+		    (double)sorted[i]->nsec / sorted[i]->evals,
+		    h->magic_path, r->lineno, df_mtype_name(r->mtype),
+		    h->db->strtab + r->desc);
+	}
+	fprintf(fp, "%10.1f %10llu %10llu %12llu %8.1f  total, %u rules\n",
+	    total.nsec / 1000.0, (unsigned long long)total.evals,
+	    (unsigned long long)total.matches,
+	    (unsigned long long)total.bytes,
+	    total.evals == 0 ? 0 : (double)total.nsec / total.evals, n);
+	free(sorted);
+	free(sum);
+}
+
+/*
+ * Write how many times each top level rule matched, by line, for
+ * df_order().
+ */
+int
+df_profile_write(struct defile *h, FILE *fp)
+{
+	struct df_rule_prof	*sum;
+	u_int32_t		 idx;
+
+	if (h->profile == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	sum = df_profile_sum(h);
+	fprintf(fp, "# hit profile of %s: line, matches\n", h->magic_path);
+	for (idx = 0; idx != DF_RULE_NONE; idx = h->db->rules[idx].next)
+		if (sum[idx].matches > 0)
+			fprintf(fp, "%u %llu\n", h->db->rules[idx].lineno,
+			    (unsigned long long)sum[idx].matches);
+	free(sum);
+
+	return (ferror(fp) ? -1 : 0);
+}
+
+/*
+ * Run magic over src into matches, or reuse what was found for a file
+ * that looked the same to the rules.
+ */
+void
+df_magic(struct defile *h, struct df_db *db, struct df_matches *matches,
+    struct df_source *src)
+{
+	struct df_dedup	*dd = h->dedup;
+	struct df_match	*last;
+	u_int64_t	 key;
+
+	src->prof = h->profile != NULL ? df_profile_get(h, db)->rules : NULL;
+	df_budget_start(src, h->budget);
+	/* Memory is looked at whole, there is no header to go by */
+	if (dd == NULL || src->fd == -1) {
+		df_magic_walk(matches, db, src);
+		matches->partial = src->partial;
+		return;
+	}
+	key = df_dedup_key(src, db->gen);
+	if (df_dedup_lookup(dd, key, matches) == 0)
+		return;
+	last = TAILQ_LAST(&matches->list, df_match_list);
+	df_magic_walk(matches, db, src);
+	/* Another time it might get further */
+	if ((matches->partial = src->partial))
+		return;
+	if (src->escaped) {
+		pthread_mutex_lock(&dd->lock);
+		dd->stats.bypassed++;
+		pthread_mutex_unlock(&dd->lock);
+		return;
+	}
+	df_dedup_insert(dd, key, last != NULL ? TAILQ_NEXT(last, entry) :
+	    TAILQ_FIRST(&matches->list));
+}
+
+/*
+ * Run magic over what src has been set up with, then describe the result
+ * into buf. Files nothing knows about are "data". Returns DF_PARTIAL if
+ * the budget ran out first.
+ */
+int
+df_classify(struct defile *h, struct df_db *db, struct df_matches *matches,
+    struct df_source *src, char *buf, size_t len)
+{
+	int		 ret;
+
+	if (src != NULL)
+		df_magic(h, db, matches, src);
+	if (TAILQ_EMPTY(&matches->list))
+		df_match_add(matches, MC_MAGIC, "data");
+	ret = df_matches_print(matches, buf, len);
+	if (ret == 0 && matches->partial)
+		ret = DF_PARTIAL;
+	df_matches_reset(matches);
+
+	return (ret);
+}
+
+/*
+ * Describe the file open on fd into buf. Returns -1 on error, or if the
+ * description was too long for buf.
+ */
+int
+df_classify_fd(struct defile *h, int fd, char *buf, size_t len)
+{
+	struct df_thread	*t = df_thread_get(h);
+	struct df_db		*db;
+	struct df_source	*src = NULL;
+	struct stat		 sb;
+	int			 ret = -1;
+
+	if ((db = df_enter(h, t)) == NULL) {
+		errno = EINVAL;
+		goto done;
+	}
+	if (fstat(fd, &sb) == -1)
+		goto done;
+	if (df_check_mode(&t->matches, &sb, h->flags)) {
+		src = df_thread_source(h, db);
+		if (df_source_read(src, db->plan, fd, sb.st_size) == -1) {
+			df_matches_reset(&t->matches);
+			goto done;
+		}
+	}
+	ret = df_classify(h, db, &t->matches, src, buf, len);
+done:
+	df_leave(t);
+
+	return (ret);
+}
+
+/*
+ * Describe the len bytes at data into buf. The tests run on data in
+ * place, nothing is copied.
+ */
+int
+df_classify_buffer(struct defile *h, const void *data, size_t len,
+    char *buf, size_t buflen)
+{
+	struct df_thread	*t = df_thread_get(h);
+	struct df_db		*db;
+	struct df_source	 src;
+	int			 ret;
+
+	if ((db = df_enter(h, t)) == NULL) {
+		df_leave(t);
+		errno = EINVAL;
+		return (-1);
+	}
+	if (len == 0) {
+		df_match_add(&t->matches, MC_FS, "empty");
+		ret = df_classify(h, db, &t->matches, NULL, buf, buflen);
+	} else {
+		df_source_mem(&src, data, len);
+		ret = df_classify(h, db, &t->matches, &src, buf, buflen);
+	}
+	df_leave(t);
+
+	return (ret);
+}
+
+/*
+ * Like df_classify_buffer(), for data that is split across iovcnt
+ * buffers, such as a payload as it came off the network.
+ */
+int
+df_classify_iov(struct defile *h, const struct iovec *iov, int iovcnt,
+    char *buf, size_t buflen)
+{
+	struct df_thread	*t = df_thread_get(h);
+	struct df_db		*db;
+	struct df_source	 src;
+	int			 ret;
+
+	if ((db = df_enter(h, t)) == NULL ||
+	    df_source_iov(&src, iov, iovcnt) == -1) {
+		df_leave(t);
+		errno = EINVAL;
+		return (-1);
+	}
+	if (src.size == 0) {
+		df_match_add(&t->matches, MC_FS, "empty");
+		ret = df_classify(h, db, &t->matches, NULL, buf, buflen);
+	} else
+		ret = df_classify(h, db, &t->matches, &src, buf, buflen);
+	df_leave(t);
+
+	return (ret);
+}
+
+/*
+ * Release the handle. Other threads that classified through it must have
+ * exited by now, or their buffers are leaked.
+ */
+void
+df_close_db(struct defile *h)
+{
+	struct df_thread	*t;
+	struct df_prof_set	*ps;
+	struct df_watch		*w;
+
+	if (h == NULL)
+		return;
+	if ((w = h->watch) != NULL) {
+		pthread_mutex_lock(&w->lock);
+		w->stop = 1;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		free(w);
+	}
+	if ((t = pthread_getspecific(h->key)) != NULL) {
+		(void)pthread_setspecific(h->key, NULL);
+		df_thread_free(t);
+	}
+	pthread_key_delete(h->key);
+	if (h->profile != NULL) {
+		while ((ps = LIST_FIRST(&h->profile->sets)) != NULL) {
+			LIST_REMOVE(ps, entry);
+			free(ps);
+		}
+		pthread_mutex_destroy(&h->profile->lock);
+		free(h->profile);
+	}
+	free(h->budget);
+	if (h->dedup != NULL) {
+		pthread_mutex_destroy(&h->dedup->lock);
+		free(h->dedup->buckets);
+		free(h->dedup->entries);
+		free(h->dedup);
+	}
+	df_db_free(h->db);
+	pthread_mutex_destroy(&h->threads_lock);
+	pthread_mutex_destroy(&h->reload_lock);
+	free(h->hits);
+	free(h->magic_path);
+	free(h);
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2011, Edd Barrett <vext01@gmail.com>
+ * Copyright (c) 2011, Christiano F. Haesbaert <haesbaert@haesbaert.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DEFILE_H
+#define DEFILE_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdio.h>
+
+/*
+ * libdefile, guesses what a file is from its magic. Modelled on libmagic.
+ *
+ * A handle holds a compiled magic db. Once df_load() has returned it is
+ * only ever read, so one handle can be used by any number of threads at
+ * once; each thread gets its own read buffer behind the scenes.
+ */
+struct defile;
+
+/* df_open_db() flags */
+#define DF_NOSPECIAL	0x01	/* Look inside devices like ordinary files */
+#define DF_EAGER	0x02	/* Compile continuations up front */
+
+struct defile	*df_open_db(const char *, int);
+int		 df_load(struct defile *);
+int		 df_classify_fd(struct defile *, int, char *, size_t);
+int		 df_classify_buffer(struct defile *, const void *, size_t,
+		    char *, size_t);
+int		 df_classify_iov(struct defile *, const struct iovec *, int,
+		    char *, size_t);
+
+/*
+ * Remember the results for files whose headers have been seen before,
+ * see df_dedup(). Call it after df_load() and before classifying.
+ */
+struct df_dedup_stats {
+	u_int64_t	 hits;
+	u_int64_t	 misses;
+	u_int64_t	 bypassed;	/* Rules looked beyond the header */
+};
+int		 df_dedup(struct defile *, size_t);
+void		 df_dedup_stats(struct defile *, struct df_dedup_stats *);
+
+/*
+ * Count what every rule costs from now on, and report on it sorted by
+ * time spent. The report is only complete once other threads are done
+ * classifying.
+ */
+int		 df_profile(struct defile *);
+void		 df_profile_print(struct defile *, FILE *);
+
+/*
+ * Write out how often each top level rule matched as a hit profile, and
+ * have another handle test the rules most likely to match first, as far
+ * as that can't change results. Call df_order() before df_load().
+ */
+int		 df_profile_write(struct defile *, FILE *);
+int		 df_order(struct defile *, const char *);
+
+/*
+ * Bound what classifying one file may cost: the rules tested, the bytes
+ * search and regex tests look through, the indirect offsets followed on
+ * the way down to a rule, and the time taken. A limit of 0 is no limit.
+ * Past any of them no more rules are tested, and the description is what
+ * was found by then; df_classify_*() return DF_PARTIAL instead of 0.
+ * The limits are read without locking, so call df_budget() after
+ * df_load() and before classifying.
+ */
+struct df_budget {
+	u_int64_t	 rules;
+	u_int64_t	 bytes;
+	u_int32_t	 depth;
+	u_int64_t	 usec;
+};
+#define DF_PARTIAL	1
+int		 df_budget(struct defile *, const struct df_budget *);
+
+/*
+ * Load the magic file again and switch to it. Classifications already
+ * under way finish with the rules they started with, later ones get the
+ * new rules, and none of them wait; the old rules are freed once the
+ * last one using them is done. If the new ones can't be loaded the old
+ * ones stay. Not while profiling. df_watch() does this whenever the
+ * magic file or its image changes, looking every so many seconds, and
+ * df_watch_reload() has it do so right away.
+ */
+int		 df_reload(struct defile *);
+int		 df_watch(struct defile *, int);
+int		 df_watch_reload(struct defile *);
+void		 df_close_db(struct defile *);
+
+#endif /* DEFILE_H */
@@ -21,697 +21,993 @@
 #include <fcntl.h>
 #include <err.h>
 #include <errno.h>
-#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <util.h>
 
+#include "defile.h"
 #include "file.h"
 
 void __dead		 usage(void);
-char			*xstrdup(char *);
-int			 lookup_mtype(struct df_parser *, char *);
-struct df_file		*df_open(const char *);
-void			 df_state_init_files(int, char **);
-int			 df_check(struct df_file *);
-int			 df_check_fs(struct df_file *);
-int			 df_check_magic(struct df_file *);
-struct df_match		*df_match_add(struct df_file *, enum match_class,
-    const char *, ...);
-int			 dp_prepare(struct df_parser *);
-int			 dp_prepare_moffset(struct df_parser *, const char *);
-int			 dp_prepare_mtype(struct df_parser *, char *);
-int			 dp_prepare_mdata_numeric(struct df_parser *, char *);
+const char		*df_next_name(void);
+int			 df_walk_next(struct df_file *);
+void			 df_walk_push(struct df_dir *, const char *,
+    const char *, dev_t);
+void			 df_dir_release(struct df_dir *);
+int			 df_open(struct df_file *);
+void			 df_state_init_files(int, char **, const char *, int);
+void			 df_state_init_budget(char *);
+void			 df_write_hits(void);
+int			 df_check_cache(struct df_file *);
+int			 df_check_fs(struct df_file *, struct df_matches *);
+int			 df_check_magic(struct df_file *, struct df_matches *);
+int			 df_check_stdin(struct df_file *, struct df_db *,
+    struct df_matches *);
+void			 df_run(void);
+void			 df_run_workers(int, int);
+void			 df_deal(struct df_file *);
+void			 df_prefetch_start(int);
+void			 df_prefetch_stop(void);
+void			 df_prefetch_submit(struct df_file *);
+void			 df_prefetch_wait(struct df_file *);
+void			*df_prefetch_main(void *);
+void			 df_prefetch(struct df_file *);
+void			*df_worker_main(void *);
+struct df_file		*df_worker_next(struct df_worker *);
 
 extern char	*malloc_options;
 extern char	*__progname;
 struct df_state  df_state;
-int		 df_debug;
-
-struct {
-	int		 mt;
-	const char	*str;
-	/* a function to call to parse the magic test specification */
-	int		(*md_parser)(struct df_parser *, char *);
-	/* a function to perform the test itself */
-	/* XXX int	(*md_test_handler)... */
-} mt_table[] = {
-	{ MT_UNKNOWN,	"unknown",	0 },
-	{ MT_BYTE,	"byte",		dp_prepare_mdata_numeric },
-	{ MT_UBYTE,	"ubyte",	dp_prepare_mdata_numeric },
-	{ MT_SHORT,	"short",	dp_prepare_mdata_numeric },
-	{ MT_LONG,	"long",		dp_prepare_mdata_numeric },
-	{ MT_ULONG,	"ulong",	dp_prepare_mdata_numeric },
-	{ MT_QUAD,	"quad",		dp_prepare_mdata_numeric },
-	{ MT_FLOAT,	"float",	dp_prepare_mdata_numeric },
-	{ MT_DOUBLE,	"double",	dp_prepare_mdata_numeric },
-	{ MT_STRING,	"string",	0 },
-	{ MT_PSTRING,	"pstring",	0 },
-	{ MT_DATE,	"date",		0 },
-	{ MT_QDATE,	"qdate",	0 },
-	{ MT_LDATE,	"ldate",	0 },
-	{ MT_QLDATE,	"qldate",	0 },
-	{ MT_BESHORT,	"beshort",	dp_prepare_mdata_numeric },
-	{ MT_UBESHORT,	"ubeshort",	dp_prepare_mdata_numeric },
-	{ MT_BELONG,	"belong",	dp_prepare_mdata_numeric },
-	{ MT_UBELONG,	"ubelong",	dp_prepare_mdata_numeric },
-	{ MT_BEQUAD,	"bequad",	dp_prepare_mdata_numeric },
-	{ MT_BEFLOAT,	"befloat",	dp_prepare_mdata_numeric },
-	{ MT_BEDOUBLE,	"bedouble",	dp_prepare_mdata_numeric },
-	{ MT_BEDATE,	"bedate",	0 },
-	{ MT_BEQDATE,	"beqdate",	0 },
-	{ MT_BELDATE,	"beldate",	0 },
-	{ MT_BEQLDATE,	"beqldate",	0 },
-	{ MT_BESTRING16,"bestring16",	0 },
-	{ MT_LESHORT,	"leshort",	dp_prepare_mdata_numeric },
-	{ MT_ULESHORT,	"uleshort",	dp_prepare_mdata_numeric },
-	{ MT_LELONG,	"lelong",	dp_prepare_mdata_numeric },
-	{ MT_ULELONG,	"ulelong",	dp_prepare_mdata_numeric },
-	{ MT_LEQUAD,	"lequad",	dp_prepare_mdata_numeric },
-	{ MT_LEFLOAT,	"lefloat",	dp_prepare_mdata_numeric },
-	{ MT_LEDOUBLE,	"ledouble",	dp_prepare_mdata_numeric },
-	{ MT_LEDATE,	"ledate",	0 },
-	{ MT_LEQDATE,	"leqdate",	0 },
-	{ MT_LELDATE,	"leldate",	0 },
-	{ MT_LEQLDATE,	"leqldate",	0 },
-	{ MT_LESTRING16,"lestring16",	0 },
-	{ MT_MELONG,	"melong",	dp_prepare_mdata_numeric },
-	{ MT_MEDATE,	"medate",	dp_prepare_mdata_numeric },
-	{ MT_MELDATE,	"meldate",	dp_prepare_mdata_numeric },
-	{ MT_REGEX,	"regex",	0 },
-	{ MT_SEARCH,	"search",	0 },
-	{ MT_DEFAULT,	"default",	0 },
-	{ -1,		NULL,		0 },
-};
 
 void __dead
 usage(void)
 {
 	/* XXX the more '-d' specified, the more verbose. How to express this in usage()? */
-	fprintf(stderr, "usage: [-dLs] [-f magic] %s file [file...]\n",
-	    __progname);
+	fprintf(stderr, "usage: %s [-dLpRsx] [-B readsize] [-c cache] [-D depth] "
+	    "[-f magic]\n"
+	    "            [-H entries] [-j jobs] [-O profile] [-Q depth] "
+	    "[-T limits]\n"
+	    "            [-W profile] file [file...]\n"
+	    "       %s [-0dLpRsx] [-B readsize] [-c cache] [-D depth] "
+	    "[-f magic]\n"
+	    "            [-H entries] [-j jobs] [-O profile] [-Q depth] "
+	    "[-T limits]\n"
+	    "            [-W profile] -F list\n"
+	    "       %s [-dLsx] [-B readsize] [-c cache] [-f magic] "
+	    "[-H entries] [-j jobs]\n"
+	    "            [-T limits] -S socket\n"
+	    "       %s [-0Rx] [-D depth] -U socket file [file...]\n"
+	    "       %s [-0Rx] [-D depth] -U socket -F list\n"
+	    "       %s -C [-f magic]\n", __progname, __progname, __progname,
+	    __progname, __progname, __progname);
 	exit(1);
 }
 
-char *
-xstrdup(char *old)
+/*
+ * Where the names of the files to check come from: the command line, or
+ * a list of them, one per line or NUL terminated, with "-" for stdin.
+ */
+void
+df_state_init_files(int argc, char **argv, const char *list, int delim)
 {
-	char	*p;
-
-	if ((p = strdup(old)) == NULL)
-		err(1, "failed to alloc");
-
-	return (p);
+	if (list == NULL)
+		df_state.names = argv;
+	else if (strcmp(list, "-") == 0)
+		df_state.list = stdin;
+	else if ((df_state.list = fopen(list, "r")) == NULL)
+		err(1, "%s", list);
+	df_state.list_delim = delim;
 }
 
-int
-lookup_mtype(struct df_parser *df, char *str)
+/*
+ * Parse the per file limits of -T, as in rules=5000,bytes=1048576,ms=20.
+ * depth is how many indirect offsets may be followed down to a rule.
+ */
+void
+df_state_init_budget(char *opt)
 {
-	int i;
+	char		*const keys[] = { "rules", "bytes", "depth", "ms",
+			    NULL };
+	struct df_budget *b = &df_state.budget;
+	const char	*errstr;
+	char		*val;
+	long long	 n;
+	int		 k;
 
-	for (i = 0; mt_table[i].mt != -1; i++) {
-		if (strcmp(str, mt_table[i].str) == 0) {
-			df->mtype = mt_table[i].mt;
-			df->mdata_parser = mt_table[i].md_parser;
-			DPRINTF(3, "Found mtype: %s: %d %p", str, df->mtype, df->mdata_parser);
-			return (0);
+	while (*opt != '\0') {
+		if ((k = getsubopt(&opt, keys, &val)) == -1 || val == NULL)
+			errx(1, "limits: expected rules, bytes, depth or ms");
+		n = strtonum(val, 0, k == 2 ? INT_MAX : LLONG_MAX / 1000,
+		    &errstr);
+		if (errstr != NULL)
+			errx(1, "limit %s: %s", keys[k], errstr);
+		switch (k) {
+		case 0:
+			b->rules = n;
+			break;
+		case 1:
+			b->bytes = n;
+			break;
+		case 2:
+			b->depth = n;
+			break;
+		case 3:
+			b->usec = n * 1000;
+			break;
 		}
 	}
+}
 
-	df->mtype = MT_UNKNOWN;
-	DPRINTF(3, "Did not find mtype: %s", str);
-	return (-1);
+/*
+ * Get hold of the compiled magic db through the library, and the results
+ * of earlier runs with it if asked to.
+ */
+void
+df_state_init_magic(void)
+{
+	u_int64_t	 fp;
+	int		 flags = 0;
+
+	if (df_state.check_flags & CHK_NOSPECIAL)
+		flags |= DF_NOSPECIAL;
+	/* The cache is keyed on all the rules, not just those used so far */
+	if (df_state.cache_path != NULL)
+		flags |= DF_EAGER;
+	if ((df_state.lib = df_open_db(df_state.magic_path, flags)) == NULL)
+		err(1, "df_open_db");
+	df_state.lib->read_max = df_state.read_max;
+	if (df_state.order_path != NULL &&
+	    df_order(df_state.lib, df_state.order_path) == -1)
+		err(1, "%s", df_state.order_path);
+	if (df_load(df_state.lib) == -1) {
+		warn("%s", df_state.magic_path);
+		return;
+	}
+	if (df_state.cache_path != NULL) {
+		/* Options that change what a file is found to be count too */
+		fp = df_db_fingerprint(df_state.lib->db);
+		fp = df_hash64(&df_state.read_max, sizeof(df_state.read_max),
+		    fp);
+		flags = df_state.check_flags &
+		    (CHK_NOSPECIAL | CHK_FOLLOWSYMLINKS);
+		fp = df_hash64(&flags, sizeof(flags), fp);
+		df_state.cache = df_cache_open(df_state.cache_path, fp);
+	}
+	if (df_state.dedup > 0 &&
+	    df_dedup(df_state.lib, df_state.dedup) == -1)
+		err(1, "df_dedup");
+	if ((df_state.budget.rules > 0 || df_state.budget.bytes > 0 ||
+	    df_state.budget.depth > 0 || df_state.budget.usec > 0) &&
+	    df_budget(df_state.lib, &df_state.budget) == -1)
+		err(1, "df_budget");
+	if ((df_state.profile || df_state.hits_path != NULL) &&
+	    df_profile(df_state.lib) == -1)
+		err(1, "df_profile");
 }
+
 /*
- * Opens all files and pushes into a TAILQ
- * Also opens magic
- * Lib
+ * Save how often each top level rule matched this run (-W), for -O to
+ * order the rules by next time.
  */
 void
-df_state_init_files(int argc, char **argv)
+df_write_hits(void)
 {
-	struct df_file	*df;
-	int		 i;
+	FILE	*fp;
 
-	TAILQ_INIT(&df_state.df_files);
-	for (i = 0; i < argc; i++) {
-		if ((df = df_open(argv[i])) == NULL)
-			warn("df_open: %s", argv[i]);
-		else
-			TAILQ_INSERT_TAIL(&df_state.df_files, df, entry);
+	if ((fp = fopen(df_state.hits_path, "w")) == NULL)
+		err(1, "%s", df_state.hits_path);
+	if (df_profile_write(df_state.lib, fp) == -1 || fclose(fp) == EOF)
+		err(1, "%s", df_state.hits_path);
+}
+
+/*
+ * The name of the next file to check, NULL when there are no more. A name
+ * from the list is only good until the next call.
+ */
+const char *
+df_next_name(void)
+{
+	ssize_t		 n;
+
+	if (df_state.names != NULL)
+		return (*df_state.names == NULL ? NULL : *df_state.names++);
+	while ((n = getdelim(&df_state.line, &df_state.linesize,
+	    df_state.list_delim, df_state.list)) != -1) {
+		if (n > 0 && df_state.line[n - 1] == df_state.list_delim)
+			df_state.line[--n] = '\0';
+		if (n > 0)
+			return (df_state.line);
 	}
+	if (ferror(df_state.list))
+		warn("reading file list");
 
-	df_state.magic_file = fopen(df_state.magic_path, "r");
-	if (df_state.magic_file == NULL)
-		warn("df_open: %s", df_state.magic_path);
+	return (NULL);
 }
 
-/* Lib */
+/*
+ * Set up the window slot df for the next file, NULL if there isn't one.
+ * With -R, whatever is being walked comes before the next name.
+ */
 struct df_file *
-df_open(const char *filename)
+df_next_file(struct df_file *df)
 {
-	struct df_file *df;
+	const char	*name;
+	struct stat	 sb;
 
-	if ((df = calloc(1, sizeof(*df))) == NULL)
-		goto err;
+	df_arena_reset(&df->arena);
+	df->fd = -1;
+	df->status = 0;
+	df->desc = NULL;
+	df->done = 0;
+	df->flags = 0;
+	df->dir = NULL;
+	df->prefetch = DFP_NONE;
+	if (df_walk_next(df) == 0)
+		return (df);
 
-	if (strlcpy(df->filename, filename, sizeof(df->filename)) >=
-	    sizeof(df->filename)) {
-		errno = ENAMETOOLONG;
-		goto err;
+	if ((name = df_next_name()) == NULL)
+		return (NULL);
+	if (df_state.names != NULL && strcmp(name, "-") == 0) {
+		df->flags |= DFF_STDIN;
+		name = "/dev/stdin";
 	}
+	df->filename = df_arena_strdup(&df->arena, name);
+	df->name = df->filename;
+	if ((df_state.check_flags & CHK_RECURSE) &&
+	    !(df->flags & DFF_STDIN) &&
+	    fstatat(AT_FDCWD, name, &sb, AT_SYMLINK_NOFOLLOW) == 0 &&
+	    S_ISDIR(sb.st_mode))
+		df_walk_push(NULL, df->filename, df->name, sb.st_dev);
 
-	df->file = fopen(df->filename, "r");
-	if (df->file == NULL)
-		goto err;
+	return (df);
+}
 
-	TAILQ_INIT(&df->df_matches);
+/*
+ * Done with df once it has been printed.
+ */
+void
+df_done_file(struct df_file *df)
+{
+	if (df->dir != NULL)
+		df_dir_release(df->dir);
+	df->dir = NULL;
+}
 
-	/* success */
-	return (df);
-err:
-	if (df->file)
-		fclose(df->file);
-	if (df)
-		free(df);
+/*
+ * Set df up for the next entry of the directories being walked, going
+ * into subdirectories as they come. Returns -1 once the walk is over.
+ * readdir() already reads entries in batches, so there's a system call
+ * per so many entries, not per entry.
+ */
+int
+df_walk_next(struct df_file *df)
+{
+	struct df_dir	*d;
+	struct dirent	*de;
+	struct stat	 sb;
+	size_t		 len, namelen;
+	int		 isdir;
 
-	return (NULL);
+	while ((d = df_state.walk) != NULL) {
+		errno = 0;
+		if ((de = readdir(d->dp)) == NULL) {
+			if (errno != 0)
+				warn("%s", d->path);
+			df_state.walk = d->up;
+			df_dir_release(d);
+			continue;
+		}
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+
+		len = strlen(d->path);
+		namelen = strlen(de->d_name);
+		df->filename = df_arena_alloc(&df->arena, len + namelen + 2);
+		memcpy(df->filename, d->path, len);
+		if (len == 0 || d->path[len - 1] != '/')
+			df->filename[len++] = '/';
+		memcpy(df->filename + len, de->d_name, namelen + 1);
+		df->name = df->filename + len;
+		df->dir = d;
+		d->refs++;
+
+		if (df_state.maxdepth != 0 && d->depth + 2 > df_state.maxdepth)
+			return (0);
+		if (de->d_type != DT_UNKNOWN)
+			isdir = de->d_type == DT_DIR;
+		else
+			isdir = fstatat(d->fd, df->name, &sb,
+			    AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(sb.st_mode);
+		if (isdir)
+			df_walk_push(d, df->filename, df->name, d->dev);
+		return (0);
+	}
+
+	return (-1);
+}
+
+/*
+ * Start walking the directory at path, called name in up if that isn't
+ * NULL. Symbolic links to directories aren't followed.
+ */
+void
+df_walk_push(struct df_dir *up, const char *path, const char *name,
+    dev_t dev)
+{
+	struct df_dir	*d;
+	struct stat	 sb;
+	int		 fd;
+
+	if ((fd = openat(up != NULL ? up->fd : AT_FDCWD, name,
+	    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1) {
+		warn("%s", path);
+		return;
+	}
+	if (fstat(fd, &sb) == -1 ||
+	    ((df_state.check_flags & CHK_ONEFS) && sb.st_dev != dev)) {
+		close(fd);
+		return;
+	}
+	if ((d = calloc(1, sizeof(*d))) == NULL ||
+	    (d->path = strdup(path)) == NULL)
+		err(1, "calloc");
+	if ((d->dp = fdopendir(fd)) == NULL)
+		err(1, "%s", path);
+	d->fd = fd;
+	d->dev = dev;
+	d->depth = up != NULL ? up->depth + 1 : 0;
+	d->refs = 1;
+	d->up = df_state.walk;
+	df_state.walk = d;
+}
+
+void
+df_dir_release(struct df_dir *d)
+{
+	if (--d->refs > 0)
+		return;
+	closedir(d->dp);
+	free(d->path);
+	free(d);
+}
+
+/*
+ * Open df to read it. Only done for what df_check_fs() says to look
+ * into, and without blocking, as a fifo put there meanwhile would.
+ */
+int
+df_open(struct df_file *df)
+{
+	int	 flags = O_RDONLY | O_NONBLOCK;
+
+	if (df->fd != -1)	/* Prefetched */
+		return (0);
+	if (!(df_state.check_flags & CHK_FOLLOWSYMLINKS))
+		flags |= O_NOFOLLOW;
+	if (df->flags & DFF_STDIN)
+		df->fd = STDIN_FILENO;
+	else if ((df->fd = openat(df->dir != NULL ? df->dir->fd : AT_FDCWD,
+	    df->name, flags)) == -1) {
+		warn("df_open: %s", df->filename);
+		return (-1);
+	}
+
+	return (0);
 }
 
 /*
  * Search for matches in magic
  */
 int
-df_check_magic(struct df_file *df)
+df_check_magic(struct df_file *df, struct df_matches *matches)
 {
-	size_t linelen;
-	char *line, *p, **ap;
-	struct df_parser dp;
+	struct df_thread *t = df_thread_get(df_state.lib);
+	struct df_db	 *db;
+	struct df_source *src;
+	int		  ret = 0;
 
+	/* The daemon may swap the db for a new one as we go */
+	db = df_enter(df_state.lib, t);
 	/* No magic file, so no matches */
-	if (df_state.magic_file == NULL)
-		return (0);
-	/* If file is empty, no matches */
-	if (df->sb.st_size == 0)
-		return (0);
-	/* We'll reparse the file */
-	rewind(df_state.magic_file);
-	bzero(&dp, sizeof(dp));
-	/* Parser state */
-	dp.magic_file = df_state.magic_file;
-	dp.level      = -1;
-	dp.lineno     = 0;
-	/* Get a line */
-	while (!feof(df_state.magic_file)) {
-		if ((line = fparseln(df_state.magic_file, &linelen, &dp.lineno,
-		    NULL, 0)) == NULL) {
-			if (ferror(df_state.magic_file)) {
-				warn("magic file");
-				return (-1);
-			} else
+	if (db == NULL || db->nrules == 0)
+		goto done;
+	if ((df->flags & DFF_STDIN) && !S_ISREG(df->sb.st_mode)) {
+		ret = df_check_stdin(df, db, matches);
+		goto done;
+	}
+	/* Read ahead (-Q), which only runs one shot, so with this db */
+	if (df->flags & DFF_READ) {
+		df_magic(df_state.lib, db, matches, df->src);
+		goto done;
+	}
+	src = df_thread_source(df_state.lib, db);
+	if (df_source_read(src, db->plan, df->fd, df->sb.st_size) == -1) {
+		warn("read: %s", df->filename);
+		ret = -1;
+		goto done;
+	}
+	df_magic(df_state.lib, db, matches, src);
+done:
+	df_leave(t);
+
+	return (ret);
+}
+
+/*
+ * Search for matches in whatever is coming down a pipe on stdin. We can't
+ * seek on that, so only the first -B bytes are looked at; the rest is
+ * left unread.
+ */
+int
+df_check_stdin(struct df_file *df, struct df_db *db,
+    struct df_matches *matches)
+{
+	struct df_source	 src;
+	u_char			*buf;
+	size_t			 len = 0, max = df_state.lib->read_max;
+	ssize_t			 n;
+
+	if ((buf = malloc(max)) == NULL)
+		err(1, "malloc");
+	while (len < max) {
+		if ((n = read(df->fd, buf + len, max - len)) == -1) {
+			if (errno == EINTR)
 				continue;
+			warn("read: %s", df->filename);
+			free(buf);
+			return (-1);
 		}
-		/* This duplication is only for debugging purposes */
-		dp.line = xstrdup(line);
-		p	= line;
-		if (*p == 0)
-			goto nextline;
-		/* Break The Line !, Guano Apes rules */
-		for (ap = dp.argv; ap < &dp.argv[3] &&
-			 (*ap = strsep(&p, " \t")) != NULL;) {
-			if (**ap != 0)
-				ap++;
-		}
-		*ap	   = NULL;
-		/* Get the remainder of the line */
-		dp.argv[3] = p;
-		dp.argv[4] = NULL;
-		/* Convert to something meaningfull */
-		if (dp_prepare(&dp) == -1)
-			goto nextline;
-		DPRINTF(2, "%zd: %5s mlevel = %d moffset = %3lu %7s "
-		    "mtype = %d %12s",
-		    dp.lineno,
-		    dp.argv[0], dp.mlevel, dp.moffset,
-		    dp.argv[1], dp.mtype, 
-		    dp.argv[2]);
-	nextline:
-		free(line);
-		free(dp.line);
+		if (n == 0)
+			break;
+		len += n;
+	}
+	if (len == 0)
+		df_match_add(matches, MC_FS, "empty");
+	else {
+		df_source_mem(&src, buf, len);
+		df_magic(df_state.lib, db, matches, &src);
+	}
+	free(buf);
+
+	return (0);
+}
+
+/*
+ * Look df up in the cache, returns 0 if it was there. Only ordinary files
+ * are kept, anything else is about as cheap to check as to look up.
+ */
+int
+df_check_cache(struct df_file *df)
+{
+	char		 buf[DF_CACHE_DESCLEN];
+	int		 dirfd = df->dir != NULL ? df->dir->fd : AT_FDCWD;
+
+	if (df_state.cache == NULL || (df->flags & (DFF_STDIN | DFF_LOOKEDUP)))
+		return (-1);
+	df->flags |= DFF_LOOKEDUP;
+	if (!(df->flags & DFF_STATED)) {
+		if (fstatat(dirfd, df->name, &df->sb,
+		    AT_SYMLINK_NOFOLLOW) == -1)
+			return (-1);
+		df->flags |= DFF_STATED;
 	}
+	if (!S_ISREG(df->sb.st_mode) ||
+	    df_cache_lookup(df_state.cache, &df->sb, buf, sizeof(buf)) == -1)
+		return (-1);
+	df->flags |= DFF_CACHED;
+	if (buf[0] != '\0')
+		df->desc = df_arena_strdup(&df->arena, buf);
 
 	return (0);
 }
 
 /*
- * Search for matches in filesystem goo.
+ * Search for matches in filesystem goo. Returns 1 if the file contents
+ * should be looked at. Other than stdin, df isn't open yet: this decides
+ * whether it will be.
  */
 int
-df_check_fs(struct df_file *df)
+df_check_fs(struct df_file *df, struct df_matches *matches)
 {
 	char		 buf[MAXPATHLEN];
-	int		 n;
-	struct df_file	*df2;
+	int		 n, dirfd;
 
-	if (lstat(df->filename, &df->sb) == -1) {
+	/* Pipes and terminals on stdin are read like a file would be */
+	if (df->flags & DFF_STDIN) {
+		if (fstat(df->fd, &df->sb) == -1) {
+			warn("stat: %s", df->filename);
+			return (-1);
+		}
+		if (!S_ISREG(df->sb.st_mode))
+			return (1);
+		return (df_check_mode(matches, &df->sb, df_state.lib->flags));
+	}
+	dirfd = df->dir != NULL ? df->dir->fd : AT_FDCWD;
+	if (!(df->flags & DFF_STATED) &&
+	    fstatat(dirfd, df->name, &df->sb, AT_SYMLINK_NOFOLLOW) == -1) {
 		warn("stat: %s", df->filename);
 		return (-1);
 	}
+	/* Following a link is looking at what it points to instead */
+	if (S_ISLNK(df->sb.st_mode) &&
+	    (df_state.check_flags & CHK_FOLLOWSYMLINKS)) {
+		if (fstatat(dirfd, df->name, &df->sb, 0) == -1) {
+			warn("can't follow symlink `%s'", df->filename);
+			return (-1);
+		}
+	}
 	if (S_ISLNK(df->sb.st_mode)) {
 		bzero(buf, sizeof(buf));
-		n = readlink(df->filename, buf, sizeof(buf));
+		n = readlinkat(dirfd, df->name, buf, sizeof(buf) - 1);
 		if (n == -1) {
 			warn("unreadable symlink `%s'", df->filename);
 			return (-1);
 		}
-		if (df_state.check_flags & CHK_FOLLOWSYMLINKS) {
-			if ((df2 = df_open(buf)) == NULL) {
-				warn("can't follow symlink `%s'", buf);
-				return (-1);
-			}
-			/* Our next df will be the followed symlink */
-			TAILQ_INSERT_AFTER(&df_state.df_files, df, df2, entry);
-			return (0);
-		}
-		df_match_add(df, MC_FS, "symbolic link to `%s'", buf);
+		df_match_add(matches, MC_FS, "symbolic link to `%s'", buf);
 		return (0);
 	}
-	if (df->sb.st_mode & S_ISUID)
-		df_match_add(df, MC_FS, "setuid");
-	if (df->sb.st_mode & S_ISGID)
-		df_match_add(df, MC_FS, "setgid");
-	if (df->sb.st_mode & S_ISVTX)
-		df_match_add(df, MC_FS, "sticky");
-	if (S_ISDIR(df->sb.st_mode))
-		df_match_add(df, MC_FS, "directory");
-	if (df_state.check_flags & CHK_NOSPECIAL)
-		goto ordinary;
-	if (S_ISCHR(df->sb.st_mode)) {
-		df_match_add(df, MC_FS, "character special");
-		return (0);
-	}
-	if (S_ISBLK(df->sb.st_mode)) {
-		df_match_add(df, MC_FS, "block special");
-		return (0);
-	}
-	if (S_ISFIFO(df->sb.st_mode)) {
-		df_match_add(df, MC_FS, "fifo (named pipe)");
+	return (df_check_mode(matches, &df->sb, df_state.lib->flags));
+}
+
+/*
+ * Check, keeping the description with df until it has been printed. The
+ * matches themselves are only needed until then and go in the calling
+ * thread's scratch arena. The file is only open in here.
+ */
+int
+df_check(struct df_file *df)
+{
+	struct df_matches	*matches = &df_thread_get(df_state.lib)->matches;
+	char			 buf[BUFSIZ];
+	int			 ret;
+
+	df_prefetch_wait(df);
+	if ((df->flags & DFF_CACHED) || df_check_cache(df) == 0)
 		return (0);
+	if ((df->flags & DFF_STDIN) && df_open(df) == -1)
+		return (-1);
+	if ((ret = df_check_fs(df, matches)) == -1)
+		goto done;
+	if (ret) {
+		if ((ret = df_open(df)) == -1)
+			goto done;
+		(void)df_check_magic(df, matches);
 	}
-	/* TODO DOOR ? */
-	if (S_ISSOCK(df->sb.st_mode)) {
-		df_match_add(df, MC_FS, "socket");
-		return (0);
+	/* Cut short by -T, what was found so far is all there is */
+	if (matches->partial)
+		df_match_add(matches, MC_MAGIC, "(partial)");
+	if (!TAILQ_EMPTY(&matches->list)) {
+		(void)df_matches_print(matches, buf, sizeof(buf));
+		df->desc = df_arena_strdup(&df->arena, buf);
 	}
-ordinary:
-	if (df->sb.st_size == 0)
-		df_match_add(df, MC_FS, "empty");
+	if (df_state.cache != NULL && (df->flags & DFF_STATED) &&
+	    S_ISREG(df->sb.st_mode) && !matches->partial)
+		df_cache_store(df_state.cache, &df->sb,
+		    df->desc != NULL ? df->desc : "");
+	ret = 0;
+done:
+	df_matches_reset(matches);
+	if (!(df->flags & DFF_STDIN) && df->fd != -1)
+		close(df->fd);
+	df->fd = -1;
 
-	return (0);
+	return (ret);
 }
 
 /*
- * Builds and adds a match at the end of df->df_matches
+ * Output what df_check() found
  */
-struct df_match *
-df_match_add(struct df_file *df, enum match_class mc, const char *desc, ...)
+void
+df_print(struct df_file *df)
 {
-	struct df_match *dm;
-	va_list		 ap;
-
-	if ((dm = calloc(1, sizeof(*dm))) == NULL)
-		err(1, "calloc"); /* XXX */
-	dm->class = mc;
-	va_start(ap, desc);
-	if (vsnprintf(dm->desc, sizeof(dm->desc), desc, ap) >=
-	    (int)sizeof(dm->desc))
-		err(1, "vsnprintf");
-	va_end(ap);
-	TAILQ_INSERT_TAIL(&df->df_matches, dm, entry);
-
-	return (dm);
+	if (df->status == -1 || df->desc == NULL)
+		return;
+	printf("%s: %s\n", df->filename, df->desc);
 }
 
 /*
- * Check
+ * Check and print one file at a time.
  */
-int
-df_check(struct df_file *df)
+void
+df_run(void)
 {
-	struct df_match *dm;
-
-	if (df_check_fs(df) == -1)
-		return (-1);
-	(void)df_check_magic(df);
-
-	if (!TAILQ_EMPTY(&df->df_matches))
-		printf("%s: ", df->filename);
-	TAILQ_FOREACH(dm, &df->df_matches, entry)
-		printf("%s ", dm->desc);
-	if (!TAILQ_EMPTY(&df->df_matches))
-		printf("\n");
+	struct df_file	 df;
 
-	return (0);
+	bzero(&df, sizeof(df));
+	while (df_next_file(&df) != NULL) {
+		df.status = df_check(&df);
+		df_print(&df);
+		df_done_file(&df);
+	}
+	df_arena_free(&df.arena);
 }
 
 /*
- * Parse magic offset field.
- * Eg. '0', '>>>>>(78.l+23)', '>3', ...
+ * Check all files with n threads, printing results in order as they
+ * become available. At most a window's worth of files is in flight: the
+ * oldest has to be printed before another is taken on. With n == 1 the
+ * checking is done here, which is only worth it with -Q reading ahead.
  */
-int
-dp_prepare_moffset(struct df_parser *dp, const char *s)
+void
+df_run_workers(int n, int depth)
 {
-	char *end = NULL;
-	const char *cp;
-	const char *errstr = NULL;
-
-	cp = s;
-	if (cp == NULL)
-		goto errorinv;
-	/* Check for mimes, skip for now */
-	if (*cp == '!') {
-		dp->mflags |= MF_MIME;
-		return (0);
+	struct df_worker	*w;
+	struct df_file		*df;
+	size_t			 head = 0, inflight = 0, i;
+	int			 error, more = 1;
+
+	df_state.window = MAX(n * DF_JOBWINDOW, 2 * depth);
+	if (n == 1)
+		n = 0;
+	if ((df_state.files = calloc(df_state.window,
+	    sizeof(*df_state.files))) == NULL ||
+	    (df_state.workers = calloc(n + 1, sizeof(*w))) == NULL)
+		err(1, "calloc");
+	df_state.nworkers = n;
+	if (depth > 0)
+		df_prefetch_start(depth);
+	for (i = 0; i < (size_t)n; i++) {
+		w = &df_state.workers[i];
+		if ((w->files = calloc(df_state.window,
+		    sizeof(*w->files))) == NULL)
+			err(1, "calloc");
+		if ((error = pthread_mutex_init(&w->lock, NULL)) != 0)
+			errc(1, error, "pthread_mutex_init");
 	}
-	/*
-	 * Check for an indirect offset, we're parsing something like:
-	 * (0x3c.l)
-	 * (( x [.[bslBSL]][+-][ y ])
-	 */
-	/* XXX indirect offsets will modify the string, it should not. */
-	if (*cp == '(') {
-		if ((end = strchr(cp, ')')) == NULL) {
-			warnx("Unclosed paren at line %zd", dp->lineno);
-			return (-1);
-		}
-		*end = 0;	/* terminate */
-		dp->mflags |= MF_INDIRECT;
-		cp++;		/* Jump over ( */
-		/* cp now points to the 0 in (0x3c.l) */
-		/*
-		 * TODO collect offset at cp here.
-		 */
-		/* If type not specified, assume long */
-		if ((end = strchr(cp, '.')) == NULL)
-			dp->moffset_itype = MT_LONG;
-		else {
-			/* Terminate at dot */
-			*end++ = 0;
-			/* end now points over the dot */
-			switch (*end) {
-			case 'c':
-			case 'b':
-			case 'C':
-			case 'B':
-				dp->moffset_itype = MT_BYTE;
-				break;
-			case 'h':
-			case 's':
-				dp->moffset_itype = MT_LESHORT;
-				break;
-			case 'l':
-				dp->moffset_itype = MT_LELONG;
-				break;
-			case 'S':
-				dp->moffset_itype = MT_BESHORT;
-				break;
-			case 'L':
-				dp->moffset_itype = MT_BELONG;
-				break;
-			case 'e':
-			case 'f':
-			case 'g':
-				dp->moffset_itype = MT_LEDOUBLE;
-				break;
-			case 'E':
-			case 'F':
-			case 'G':
-				dp->moffset_itype = MT_BEDOUBLE;
-				break;
-			default:
-				warnx("indirect offset type `%c' "
-				    "invalid at line %zd", *cp, dp->lineno);
-				return (-1);
-				break; /* NOTREACHED */
-			}
-			end++;
-			/* end should be at `)' or `+' or `-' */
-			switch (*end) {
-			case ')':
-				*end = 0; /* Terminate */
-				break;
-			case '-':
-				/* dp->moffset *= -1; */
-				/* FALLTHROUGH */
-				end++;
-			case '+':
-				/* TODO collect number */
+	for (i = 0; i < (size_t)n; i++) {
+		w = &df_state.workers[i];
+		if ((error = pthread_create(&w->thread, NULL, df_worker_main,
+		    w)) != 0)
+			errc(1, error, "pthread_create");
+	}
+
+	for (;;) {
+		/* Fill the window */
+		while (more && inflight < df_state.window) {
+			df = &df_state.files[(head + inflight) %
+			    df_state.window];
+			if (df_next_file(df) == NULL) {
+				more = 0;
+				pthread_mutex_lock(&df_state.done_lock);
+				df_state.dealt = 1;
+				pthread_cond_broadcast(&df_state.work_cond);
+				pthread_mutex_unlock(&df_state.done_lock);
 				break;
-			default:
-				goto errorinv;
-				break; /* NOTREACHED */
 			}
-			
-		}
-	}
-	if (cp == NULL)
-		goto errorinv;
-	/* Try hex */
-	if (strlen(cp) > 1 && cp[0] == '0' && cp[1] == 'x') {
-		errno = 0;
-		dp->moffset = strtoll(cp, NULL, 16);
-		if (errno) {
-			warn("dp_prepare_moffset: strtoll: %s "
-			    "line %zd", cp, dp->lineno);
-			return (-1);
+			if (depth > 0)
+				df_prefetch_submit(df);
+			if (n > 0)
+				df_deal(df);
+			inflight++;
 		}
-	}
-	dp->moffset = (unsigned long)strtonum(cp, 0,
-	    LLONG_MAX, &errstr);
-	if (errstr) {
-		warn("dp_prepare_moffset: strtonum %s at line %zd",
-		    cp, dp->lineno);
-		return (-1);
+		if (inflight == 0)
+			break;
+
+		/* Print the oldest, waiting for it if need be */
+		df = &df_state.files[head];
+		if (n == 0)
+			df->status = df_check(df);
+		pthread_mutex_lock(&df_state.done_lock);
+		while (n > 0 && !df->done)
+			pthread_cond_wait(&df_state.done_cond,
+			    &df_state.done_lock);
+		pthread_mutex_unlock(&df_state.done_lock);
+		df_print(df);
+		df_done_file(df);
+		head = (head + 1) % df_state.window;
+		inflight--;
 	}
 
-	return (0);
+	for (i = 0; i < (size_t)n; i++)
+		pthread_join(df_state.workers[i].thread, NULL);
+	if (depth > 0)
+		df_prefetch_stop();
+}
 
-errorinv:
-	warnx("dp_prepare_moffset: Invalid offset at line %zd",
-	    dp->lineno);
+/*
+ * Hand df to the next worker round robin, waking one up to take it.
+ */
+void
+df_deal(struct df_file *df)
+{
+	static int		 next;
+	struct df_worker	*w = &df_state.workers[next++ % df_state.nworkers];
 
-	return (-1);
+	pthread_mutex_lock(&w->lock);
+	w->files[w->tail++ % df_state.window] = df;
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_mutex_lock(&df_state.done_lock);
+	df_state.queued++;
+	pthread_cond_signal(&df_state.work_cond);
+	pthread_mutex_unlock(&df_state.done_lock);
 }
 
 /*
- * Bake dp into something usable.
+ * Start depth threads reading ahead for -Q.
  */
-int
-dp_prepare(struct df_parser *dp)
+void
+df_prefetch_start(int depth)
 {
-	char			*cp;
-
-	/* Reset */
-	dp->mlevel	  = 0;
-	dp->moffset	  = 0;
-	dp->moffset_itype = 0;
-	dp->mflags	  = 0;
-	dp->mtype	  = MT_UNKNOWN;
-	dp->mmask	  = 0;
-	dp->d_quad	  = 0;	/* the longest type in the union */
-	dp->test_flags	  = 0;
-	dp->mdata_parser = 0;
-	/* First analyze level and offset */
-	cp = dp->argv[0];
-	if (*cp == '>') {
-		/* Count the > */
-		while (cp && *cp == '>') {
-			dp->mlevel++;
-			cp++;
-		}
-	}
-	/* cp now should point to the start of the offset */
-	if (dp_prepare_moffset(dp, cp) == -1)
-		return (-1);
-	/* We ignore mimes for now */
-	if (dp->mflags & MF_MIME) {
-		DPRINTF(1, "%zd: mime ignored", dp->lineno);
-		goto ignore;
-	}
-	/* Second, analyze test type */
-	if (dp_prepare_mtype(dp, dp->argv[1]) == -1)
-		return (-1);
-	/* Now test data */
-	if (dp->mdata_parser == NULL) {
-		warn("%s: no mdata parser for mtype: %d", __func__, dp->mtype);
-		return (-1);
+	struct df_prefetch	*pf = &df_state.prefetch;
+	int			 error, i;
+
+	if ((pf->threads = calloc(depth, sizeof(*pf->threads))) == NULL ||
+	    (pf->queue = calloc(df_state.window, sizeof(*pf->queue))) == NULL)
+		err(1, "calloc");
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->cond, NULL);
+	for (i = 0; i < depth; i++) {
+		if ((error = pthread_create(&pf->threads[i], NULL,
+		    df_prefetch_main, NULL)) != 0)
+			errc(1, error, "pthread_create");
+		pf->nthreads++;
 	}
-	if (dp->mdata_parser(dp, dp->argv[2]) == -1)
-		return (-1);
-	
-	return (0);
-ignore:
-	return (-1);
+}
+
+void
+df_prefetch_stop(void)
+{
+	struct df_prefetch	*pf = &df_state.prefetch;
+	int			 i;
+
+	pthread_mutex_lock(&pf->lock);
+	pf->quit = 1;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->lock);
+	for (i = 0; i < pf->nthreads; i++)
+		pthread_join(pf->threads[i], NULL);
 }
 
 /*
- * Parse the test type field
- * Eg. 'lelong', 'byte', 'leshort&0x0001', ...
+ * Queue df to be read ahead. The queue is as big as the window and only
+ * holds files in it, so there is always room.
  */
-int
-dp_prepare_mtype(struct df_parser *dp, char *cp)
+void
+df_prefetch_submit(struct df_file *df)
 {
-	char			*mask, *mod;
-	const char		*errstr = NULL;
-
-	/* Split mask and test type first */
-	cp   = dp->argv[1];
-	mask = strchr(cp, '&');
-	if (mask != NULL) {
-		*mask++ = 0;
-		errno  = 0;
-		errstr = NULL;
-		if (strlen(mask) > 1 && mask[0] == '0' && mask[1] == 'x') {
-			/* Hexa */
-			dp->mmask = strtoll(mask, NULL, 16);
-			if (errno)
-				goto badmask;
-		} else if (strlen(mask) > 1 && mask[0] == '0') {
-			/* Octa */
-			dp->mmask = strtoll(mask, NULL, 8);
-			if (errno)
-				goto badmask;
-		} else {
-			/* Decimal */
-			dp->mmask = strtonum(mask, 0, LLONG_MAX, &errstr);
-			if (errstr)
-				goto badmask;
-		}
-		dp->mflags |= MF_MASK;
-	}
-	/* If no &, check for modifier / as in string/ or search/ */
-	if (mask == NULL &&
-	    (strncmp(cp, "string", 6) == 0 ||
-	    strncmp(cp, "search", 6) == 0)) {
-		mod = strchr(cp, '/');
-		if (mod != NULL) {
-			if (mod[1] == 0)
-				goto badmod;
-			*mod++ = 0;
-			/* TODO collect mod */
+	struct df_prefetch	*pf = &df_state.prefetch;
+
+	df->prefetch = DFP_QUEUED;
+	pthread_mutex_lock(&pf->lock);
+	pf->queue[pf->tail++ % df_state.window] = df;
+	pthread_cond_signal(&pf->cond);
+	pthread_mutex_unlock(&pf->lock);
+}
+
+/*
+ * Wait for the read ahead of df, if any, to be over.
+ */
+void
+df_prefetch_wait(struct df_file *df)
+{
+	pthread_mutex_lock(&df_state.done_lock);
+	while (df->prefetch == DFP_QUEUED)
+		pthread_cond_wait(&df_state.done_cond, &df_state.done_lock);
+	pthread_mutex_unlock(&df_state.done_lock);
+}
+
+void *
+df_prefetch_main(void *arg)
+{
+	struct df_prefetch	*pf = &df_state.prefetch;
+	struct df_file		*df;
+
+	for (;;) {
+		pthread_mutex_lock(&pf->lock);
+		while (pf->head == pf->tail && !pf->quit)
+			pthread_cond_wait(&pf->cond, &pf->lock);
+		if (pf->head == pf->tail) {
+			pthread_mutex_unlock(&pf->lock);
+			break;
 		}
-	}
-	/* Convert the string to something meaningful and decide upon a test handler */
-	if ((lookup_mtype(dp, cp) == -1) || (dp->mtype == MT_UNKNOWN)) {
-		warnx("dp_prepare: Uknown magic type %s at line %zd", cp, dp->lineno);
-		return (-1);
-	}
+		df = pf->queue[pf->head++ % df_state.window];
+		pthread_mutex_unlock(&pf->lock);
 
-	return (0);
+		df_prefetch(df);
+		pthread_mutex_lock(&df_state.done_lock);
+		df->prefetch = DFP_DONE;
+		pthread_cond_broadcast(&df_state.done_cond);
+		pthread_mutex_unlock(&df_state.done_lock);
+	}
 
-badmod:
-	warn("dp_prepare: bad mod %s at line %zd", mod, dp->lineno);
-	return (-1);
-badmask:
-	warn("dp_prepare: bad mask %s at line %zd", mask, dp->lineno);
-	return (-1);
+	return (arg);
 }
 
 /*
- * Parse a numeric magic data field
- * Eg. '>0', '0407', '0x84500526'
+ * Do the blocking part of checking df: stat it and, if it's an ordinary
+ * file, open it and read what the rules want. Anything else, or anything
+ * that fails, is left for df_check() to deal with and complain about.
  */
-int
-dp_prepare_mdata_numeric(struct df_parser *df, char *cp)
+void
+df_prefetch(struct df_file *df)
 {
-	char			*special = "=<>&^~x!";
-	int			 ret = -1;
+	struct df_db	*db = df_state.lib->db;
+	int		 dirfd = df->dir != NULL ? df->dir->fd : AT_FDCWD;
 
-	if (cp == NULL) {
-		warn("%s: null magic data", __func__); /* XXX why does this happen? */
-		return (-1);
-	}
+	if (df->flags & DFF_STDIN)
+		return;
+	if (fstatat(dirfd, df->name, &df->sb, AT_SYMLINK_NOFOLLOW) == -1)
+		return;
+	df->flags |= DFF_STATED;
+	if (df_check_cache(df) == 0)
+		return;
+	if (!S_ISREG(df->sb.st_mode) || df->sb.st_size == 0 || db == NULL ||
+	    db->nrules == 0)
+		return;
+	if ((df->fd = openat(dirfd, df->name,
+	    O_RDONLY | O_NONBLOCK | O_NOFOLLOW)) == -1)
+		return;
+	if (df->src == NULL)
+		df->src = df_source_new(db->plan);
+	if (df_source_read(df->src, db->plan, df->fd, df->sb.st_size) == 0)
+		df->flags |= DFF_READ;
+}
 
-	DPRINTF(2, "Parse numerical magic data: %s", cp);
+void *
+df_worker_main(void *arg)
+{
+	struct df_worker	*w = arg;
+	struct df_file		*df;
 
-	/* continue until we have parsed all special prefixes */
-	while (strspn(cp, special)) {
-		DPRINTF(2, "Found numerical speical prefix: %c", *cp);
-		switch (*cp) {
-		case '=':
-			df->test_flags |= DF_TEST_PFX_EQ;
-			break;
-		case '<':
-			df->test_flags |= DF_TEST_PFX_LT;
-			break;
-		case '>':
-			df->test_flags |= DF_TEST_PFX_GT;
-			break;
-		case '&':
-			df->test_flags |= DF_TEST_PFX_BSET;
-			break;
-		case '^':
-			df->test_flags |= DF_TEST_PFX_BCLR;
-			break;
-		case '~':
-			df->test_flags |= DF_TEST_PFX_BNEG;
-			break;
-		case 'x':
-			df->test_flags |= DF_TEST_PFX_X;
-			break;
-		case '!':
-			df->test_flags |= DF_TEST_PFX_NEG;
+	for (;;) {
+		if ((df = df_worker_next(w)) != NULL) {
+			df->status = df_check(df);
+			pthread_mutex_lock(&df_state.done_lock);
+			df->done = 1;
+			pthread_cond_broadcast(&df_state.done_cond);
+			pthread_mutex_unlock(&df_state.done_lock);
+			continue;
+		}
+		/* Nothing queued anywhere, wait for more or the end */
+		pthread_mutex_lock(&df_state.done_lock);
+		while (df_state.queued == 0 && !df_state.dealt)
+			pthread_cond_wait(&df_state.work_cond,
+			    &df_state.done_lock);
+		if (df_state.queued == 0) {
+			pthread_mutex_unlock(&df_state.done_lock);
 			break;
-		default:
-			/* should not happen */
-			warn("%s: unknown special prefix: %c", __func__, *cp);
-		};
-		cp++;
+		}
+		pthread_mutex_unlock(&df_state.done_lock);
 	}
 
-	/* XXX check for incompatible flag combos */
-	/* EQ + LT */
-	/* EQ + GT */
-	/* GT + LT */
-	/* SET + CLR */
+	return (NULL);
+}
+
+/*
+ * Next file for w to check, stolen from another worker if w has none left.
+ * Returns NULL if there is no work anywhere right now.
+ */
+struct df_file *
+df_worker_next(struct df_worker *w)
+{
+	struct df_worker	*victim;
+	struct df_file		*df = NULL;
+	int			 i;
 
-	/* XXX store away test data in an "endian certain" mannaer */
+	pthread_mutex_lock(&w->lock);
+	if (w->head < w->tail)
+		df = w->files[w->head++ % df_state.window];
+	pthread_mutex_unlock(&w->lock);
 
-	ret = 0;
+	for (i = 0; i < df_state.nworkers && df == NULL; i++) {
+		victim = &df_state.workers[i];
+		if (victim == w)
+			continue;
+		pthread_mutex_lock(&victim->lock);
+		if (victim->head < victim->tail)
+			df = victim->files[--victim->tail % df_state.window];
+		pthread_mutex_unlock(&victim->lock);
+	}
 
-	return (ret);
+	if (df != NULL) {
+		pthread_mutex_lock(&df_state.done_lock);
+		df_state.queued--;
+		pthread_mutex_unlock(&df_state.done_lock);
+	}
+
+	return (df);
 }
 
 int
 main(int argc, char **argv)
 {
-	struct df_file	*df;
-	int		 ch;
+	struct df_dedup_stats	 st;
+	const char	*errstr, *list = NULL, *serve = NULL, *ask = NULL;
+	int		 ch, Cflag = 0, jobs = 1, depth = 0, delim = '\n';
 
 #ifdef DEBUG
 	malloc_options = "AFGJPXS";
 #endif
 	df_state.magic_path = MAGIC;
+	df_state.read_max = DF_READMAX;
+	pthread_mutex_init(&df_state.done_lock, NULL);
+	pthread_cond_init(&df_state.done_cond, NULL);
+	pthread_cond_init(&df_state.work_cond, NULL);
 
-	while ((ch = getopt(argc, argv, "df:Ls")) != -1) {
+	while ((ch = getopt(argc, argv,
+	    "0B:Cc:D:dF:f:H:j:LO:pQ:RS:T:U:W:sx")) != -1) {
 		switch (ch) {
+		case '0':
+			delim = '\0';
+			break;
+		case 'B':
+			df_state.read_max = strtonum(optarg, DF_HDRLEN,
+			    INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "read size %s: %s", optarg, errstr);
+			break;
+		case 'C':
+			Cflag = 1;
+			break;
+		case 'c':
+			df_state.cache_path = optarg;
+			break;
+		case 'D':
+			df_state.maxdepth = strtonum(optarg, 1, INT_MAX,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "depth %s: %s", optarg, errstr);
+			break;
 		case 'd':
 #ifndef DEBUG
 			errx(1, "this binary was not built with DEBUG");
 #endif
 			df_debug++;
 			break;
+		case 'F':
+			list = optarg;
+			break;
 		case 'f':
 			df_state.magic_path = optarg;
 			break;
+		case 'H':
+			df_state.dedup = strtonum(optarg, 1, 1 << 20, &errstr);
+			if (errstr != NULL)
+				errx(1, "entries %s: %s", optarg, errstr);
+			break;
+		case 'j':
+			jobs = strtonum(optarg, 1, 256, &errstr);
+			if (errstr != NULL)
+				errx(1, "jobs %s: %s", optarg, errstr);
+			break;
 		case 's':	/* Treat file devices as ordinary files */
 			df_state.check_flags |= CHK_NOSPECIAL;
 			break;
 		case 'L':
 			df_state.check_flags |= CHK_FOLLOWSYMLINKS;
 			break;
+		case 'O':
+			df_state.order_path = optarg;
+			break;
+		case 'p':
+			df_state.profile = 1;
+			break;
+		case 'Q':
+			depth = strtonum(optarg, 0, 256, &errstr);
+			if (errstr != NULL)
+				errx(1, "queue depth %s: %s", optarg, errstr);
+			break;
+		case 'R':
+			df_state.check_flags |= CHK_RECURSE;
+			break;
+		case 'S':
+			serve = optarg;
+			break;
+		case 'T':
+			df_state_init_budget(optarg);
+			break;
+		case 'U':
+			ask = optarg;
+			break;
+		case 'W':
+			df_state.hits_path = optarg;
+			break;
+		case 'x':	/* Don't walk into other filesystems */
+			df_state.check_flags |= CHK_ONEFS;
+			break;
 		default:
 			usage();
 			break;	/* NOTREACHED */
@@ -719,12 +1015,46 @@ main(int argc, char **argv)
 	}
 	argv += optind;
 	argc -= optind;
-	if (argc == 0)
+	if (Cflag) {
+		if (argc != 0)
+			usage();
+		if (df_db_compile(df_state.magic_path) == -1)
+			return (EXIT_FAILURE);
+		return (EXIT_SUCCESS);
+	}
+	if (serve != NULL) {
+		if (argc != 0 || list != NULL || ask != NULL)
+			usage();
+		df_state_init_magic();
+		if (df_serve(serve, jobs) == -1)
+			return (EXIT_FAILURE);
+		return (EXIT_SUCCESS);
+	}
+	if ((argc == 0) == (list == NULL))
 		usage();
 
-	df_state_init_files(argc, argv);
-	TAILQ_FOREACH(df, &df_state.df_files, entry)
-		(void)df_check(df);
+	df_state_init_files(argc, argv, list, delim);
+	/* The daemon does the checking, with its own magic and options */
+	if (ask != NULL) {
+		if (df_ask(ask) == -1)
+			return (EXIT_FAILURE);
+		return (EXIT_SUCCESS);
+	}
+	df_state_init_magic();
+	if (jobs > 1 || depth > 0)
+		df_run_workers(jobs, depth);
+	else
+		df_run();
+	if (df_state.dedup > 0) {
+		df_dedup_stats(df_state.lib, &st);
+		DPRINTF(1, "dedup: %llu hits, %llu misses, %llu bypassed",
+		    (unsigned long long)st.hits, (unsigned long long)st.misses,
+		    (unsigned long long)st.bypassed);
+	}
+	if (df_state.profile)
+		df_profile_print(df_state.lib, stderr);
+	if (df_state.hits_path != NULL)
+		df_write_hits();
 
 	return (EXIT_SUCCESS);
 }
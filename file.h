@@ -17,30 +17,247 @@
 
 #include <sys/param.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <dirent.h>
+#include <pthread.h>
+
+/*
+ * How much of a file we read up front for magic tests. The window is sized
+ * from the rule offsets, but never less than DF_HDRLEN so that indirect
+ * offsets have something to land in, nor more than the -B limit.
+ */
+#define DF_HDRLEN	8192
+#define DF_READMAX	(64 * 1024)
+
+/*
+ * Bump allocator. What comes out of an arena is only ever given back all
+ * at once. Resetting keeps the memory, folded into a single chunk, so an
+ * arena reset for every file soon stops allocating at all.
+ */
+#define DF_ARENA_CHUNK		4096
+#define DF_ARENA_ALIGN(n)	(((n) + 15) & ~(size_t)15)
+struct df_arena_chunk {
+	struct df_arena_chunk	*next;
+	size_t			 size;		/* Usable bytes */
+	size_t			 used;
+};
+struct df_arena {
+	struct df_arena_chunk	*chunks;	/* Current chunk first */
+	size_t			 total;		/* Usable bytes in all chunks */
+};
+
+/*
+ * The matches found for one file, in the order found, and the arena they
+ * and their descriptions live in, along with whatever else finding them
+ * took.
+ */
+TAILQ_HEAD(df_match_list, df_match);
+struct df_matches {
+	struct df_match_list	 list;
+	struct df_arena		 arena;
+	int			 partial;	/* Cut short by the budget */
+};
 
 /*
- * Main structure which represents a file to be checked parsed, we have one
- * for each command line argument.
+ * Main structure which represents a file to be checked parsed. Files are
+ * streamed through a fixed window of these; a slot is reused once its
+ * file has been printed, and the file is only open while being checked.
  */
 struct df_file {
-	TAILQ_ENTRY(df_file) entry;
-	TAILQ_HEAD(, df_match) df_matches;
-	FILE		*file;			/* File handler */
-	char		 filename[MAXPATHLEN];	/* File path */
+	int		 fd;			/* File descriptor */
+	char		*filename;		/* File path */
+	struct df_dir	*dir;			/* Found in, by -R */
+	const char	*name;			/* Relative to dir */
 	struct stat	 sb;			/* File stat */
+	int		 status;		/* df_check() result */
+	char		*desc;			/* What df_check() found */
+	int		 done;			/* Checked, ready to print */
+	int		 flags;
+#define DFF_STDIN	0x01			/* Standard input, "-" */
+#define DFF_STATED	0x02			/* sb is filled in */
+#define DFF_READ	0x04			/* src holds the contents */
+#define DFF_CACHED	0x08			/* desc came from the cache */
+#define DFF_LOOKEDUP	0x10			/* Cache was asked already */
+	int		 prefetch;		/* DFP_*, under done_lock */
+#define DFP_NONE	0
+#define DFP_QUEUED	1
+#define DFP_DONE	2
+	struct df_source *src;			/* For -Q, kept with the slot */
+	struct df_arena	 arena;			/* filename and desc */
+};
+
+/*
+ * A directory being walked by -R. Files found in it are looked up
+ * relative to its descriptor, which is kept open until the last of them
+ * has been printed. Only the main thread walks and prints, so the
+ * reference count needs no lock.
+ */
+struct df_dir {
+	DIR			*dp;
+	int			 fd;		/* dirfd(dp) */
+	char			*path;
+	dev_t			 dev;		/* Of the root, for -x */
+	int			 depth;		/* Below the root */
+	int			 refs;		/* Files in flight, +1 if walking */
+	struct df_dir		*up;		/* Walk stack */
+};
+
+/*
+ * A classification thread for -j. Files are dealt out to the workers
+ * round robin. Each takes from the front of its own deque and, when that
+ * runs dry, steals from the back of the others'. A deque is a ring as big
+ * as the window, head and tail only ever go up.
+ */
+struct df_worker {
+	pthread_t		 thread;
+	pthread_mutex_t		 lock;		/* Protects head and tail */
+	struct df_file		**files;
+	size_t			 head, tail;
+};
+
+/*
+ * Threads for -Q, which stat and open files and read what the rules want
+ * of them ahead of whoever checks them. Each has one request outstanding
+ * at a time, so their number is the I/O queue depth.
+ */
+struct df_prefetch {
+	pthread_t		*threads;
+	int			 nthreads;
+	pthread_mutex_t		 lock;		/* Protects the below */
+	pthread_cond_t		 cond;
+	struct df_file		**queue;	/* Ring as big as the window */
+	size_t			 head, tail;
+	int			 quit;
+};
+
+/*
+ * Files in flight per -j thread. Enough that a slow file doesn't hold
+ * the others up much, bounded so a huge list runs in constant memory.
+ */
+#define DF_JOBWINDOW	16
+
+/*
+ * Requests to the daemon (-S) and its responses, over a Unix socket. Each
+ * is a header then len bytes: the path to check for DF_REQ_PATH, nothing
+ * for DF_REQ_FD, whose descriptor comes along as SCM_RIGHTS; for a
+ * response, the description. Requests can be sent without waiting for
+ * the answers to earlier ones, which come back as they are ready, tagged
+ * with the id of their request. All in host byte order.
+ */
+#define DF_REQ_PATH	1
+#define DF_REQ_FD	2
+struct df_req {
+	u_int32_t		 len;
+	u_int32_t		 id;
+	u_int32_t		 type;		/* DF_REQ_* */
+};
+struct df_resp {
+	u_int32_t		 len;
+	u_int32_t		 id;
+	int32_t			 error;		/* errno, 0 if checked */
+};
+
+/*
+ * A connection to the daemon. Its requests are parsed out of in as they
+ * arrive and queued for the workers; answers wait in out until the
+ * socket takes them. Once a client has so many requests outstanding, or
+ * so many bytes of answers it hasn't read, we stop reading from it until
+ * that goes down.
+ */
+#define DF_CLIENT_MAXINFLIGHT	128
+#define DF_CLIENT_MAXOUT	(64 * 1024)
+#define DF_CLIENT_MAXFDS	64	/* Passed, not yet asked about */
+struct df_client {
+	TAILQ_ENTRY(df_client)	 entry;
+	int			 fd;
+	u_char			 in[sizeof(struct df_req) + MAXPATHLEN];
+	size_t			 inlen;
+	u_char			*out;
+	size_t			 outlen, outoff, outsize;
+	int			 fds[DF_CLIENT_MAXFDS];
+	int			 nfds;
+	int			 inflight;	/* Queued or being checked */
+	int			 eof;		/* Nothing more coming */
+	int			 dead;		/* Closed, waiting for jobs */
+};
+
+/*
+ * One request, from the queue to a worker and back.
+ */
+struct df_job {
+	TAILQ_ENTRY(df_job)	 entry;
+	struct df_client	*client;
+	u_int32_t		 id;
+	int			 fd;		/* Passed to us, or -1 */
+	char			*path;		/* ... or what to open */
+	char			*desc;		/* What was found, or NULL */
+	int			 error;
+};
+
+/*
+ * The daemon. The main thread polls the listening socket, the clients and
+ * a pipe the workers (-j) write to as they finish jobs; only it touches
+ * the clients.
+ */
+#define DF_SERVER_MAXCLIENTS	256
+struct df_server {
+	int			 fd;		/* Listening */
+	int			 wake[2];	/* Jobs done, or a signal */
+	TAILQ_HEAD(, df_client)	 clients;
+	int			 nclients;
+	pthread_t		*threads;
+	int			 nthreads;
+	pthread_mutex_t		 lock;		/* Protects the below */
+	pthread_cond_t		 cond;		/* More jobs, or quit */
+	TAILQ_HEAD(, df_job)	 jobs;
+	TAILQ_HEAD(, df_job)	 done;
+	int			 quit;
 };
 
+/*
+ * Requests the client (-U) has outstanding at once. Answers are printed
+ * in the order asked, so this is also how far ahead of the oldest one
+ * the daemon can get.
+ */
+#define DF_ASK_WINDOW	64
+
 /*
  * Main file program state, we have one global for it.
  */
 struct df_state {
-	TAILQ_HEAD(, df_file)	 df_files;	/* All our jobs */
+	struct df_file		*files;		/* The window, a ring */
+	size_t			 window;
+	char			**names;	/* Files from the command line */
+	FILE			*list;		/* ... or from a list (-F) */
+	int			 list_delim;	/* Between names in the list */
+	char			*line;		/* Last name read from the list */
+	size_t			 linesize;
+	struct df_dir		*walk;		/* Where -R is at */
+	int			 maxdepth;	/* For -R, 0 if no limit */
 	const char		*magic_path;	/* Magic file path */
-	FILE			*magic_file;	/* Magic file */
-	int			 magic_line;	/* Where we are in magic db */
+	struct defile		*lib;		/* Compiled magic and friends */
+	size_t			 read_max;	/* Largest single read (-B) */
+	struct df_worker	*workers;	/* -j threads */
+	int			 nworkers;
+	struct df_prefetch	 prefetch;	/* -Q threads */
+	const char		*cache_path;	/* -c */
+	struct df_cache		*cache;		/* Results of earlier runs */
+	size_t			 dedup;		/* -H entries */
+	int			 profile;	/* -p, report rule costs */
+	const char		*order_path;	/* -O hit profile to order by */
+	const char		*hits_path;	/* -W hit profile to write */
+	struct df_budget	 budget;	/* -T limits, per file */
+	pthread_mutex_t		 done_lock;	/* Protects these and done */
+	pthread_cond_t		 done_cond;
+	pthread_cond_t		 work_cond;	/* More to do, or all dealt */
+	size_t			 queued;	/* Dealt, not yet taken */
+	int			 dealt;		/* No more files coming */
 	u_int	 		 check_flags;	/* Checking knobs */
 #define CHK_NOSPECIAL		0x01
 #define CHK_FOLLOWSYMLINKS	0x02
+#define CHK_RECURSE		0x04
+#define CHK_ONEFS		0x08
 };
 
 /*
@@ -106,10 +323,13 @@ enum match_class {
 	MC_LANG
 };
 
+#define DF_DESCLEN	256
 struct df_match {
 	TAILQ_ENTRY(df_match) entry;
-	char		 desc[256]; 	/* string represtation */
+	char		*desc; 		/* string represtation */
 	enum match_class class;		/* df_match_class */
+	int		 flags;
+#define DM_NOSPACE	0x01	/* Don't separate from the previous match */
 	/* XXX maybe instance in future ? */
 };
 
@@ -119,12 +339,12 @@ struct df_match {
 struct df_parser {
 	FILE			*magic_file;
 	size_t			 lineno; 	/* Current line number */
-	char			*line;		/* Current linet */
 	int			 level; 	/* Current parser level */
 	char			*argv[5];	/* The broken tokens */
 	int			 mlevel;	/* Magic level */
 	u_long			 moffset;	/* Magic offset */
 	enum df_magic_test	 moffset_itype;	/* Indirect type if MF_INDIRECT */
+	int64_t			 moffset_adj;	/* Added to indirect offset */
 	enum df_magic_test	 mtype; 	/* Magic type */
 	int (*mdata_parser)(struct df_parser *, char *); /* magic test parser */
 	u_int64_t		 mmask;		/* Magic mask */
@@ -132,6 +352,10 @@ struct df_parser {
 #define MF_INDIRECT	0x01	/* Indirect offset (mo) */
 #define MF_MASK		0x02	/* Value must be masked (mm is valid) */
 #define MF_MIME		0x04	/* We're parsing a mime entry */	
+#define MF_FROMEND	0x08	/* Offset counts back from end of file */
+	u_int64_t		 mrange;	/* Positions a search tries */
+	u_int32_t		 mstrflags;	/* DF_STR_* modifiers */
+	size_t			 mstrlen;	/* Of d_string, may hold NULs */
 	/* the test (d)ata itself */
 	union {
 		u_int8_t	 d_byte;
@@ -186,13 +410,921 @@ struct df_parser {
 	u_int32_t		  test_flags;
 };
 
+/*
+ * How a test gets at the value in the file: one opcode for each width,
+ * byte order and signedness a test type can have, picked for each rule
+ * when it is compiled. The handlers in magic.c that load a value and test
+ * it are generated from these lists of name, C type, unsigned type of the
+ * same width, and the macro turning that from file to host order.
+ */
+#define DF_NOSWAP(x)	(x)
+#define DF_METOH32(x)	(letoh32(x) << 16 | letoh32(x) >> 16)
+#define DF_INT_OPS(X)							\
+	X(S8,	 int8_t,	u_int8_t,	DF_NOSWAP)		\
+	X(U8,	 u_int8_t,	u_int8_t,	DF_NOSWAP)		\
+	X(S16LE, int16_t,	u_int16_t,	letoh16)		\
+	X(U16LE, u_int16_t,	u_int16_t,	letoh16)		\
+	X(S16BE, int16_t,	u_int16_t,	betoh16)		\
+	X(U16BE, u_int16_t,	u_int16_t,	betoh16)		\
+	X(S32LE, int32_t,	u_int32_t,	letoh32)		\
+	X(U32LE, u_int32_t,	u_int32_t,	letoh32)		\
+	X(S32BE, int32_t,	u_int32_t,	betoh32)		\
+	X(U32BE, u_int32_t,	u_int32_t,	betoh32)		\
+	X(S32ME, int32_t,	u_int32_t,	DF_METOH32)		\
+	X(S64LE, int64_t,	u_int64_t,	letoh64)		\
+	X(S64BE, int64_t,	u_int64_t,	betoh64)
+#define DF_FLOAT_OPS(X)							\
+	X(F32LE, float,		u_int32_t,	letoh32)		\
+	X(F32BE, float,		u_int32_t,	betoh32)		\
+	X(F64LE, double,	u_int64_t,	letoh64)		\
+	X(F64BE, double,	u_int64_t,	betoh64)
+
+#define DF_OP_ENUM(name, type, raw, swap)	DF_OP_##name,
+enum df_op {
+	DF_OP_NONE,		/* Not a test we know, never matches */
+	DF_INT_OPS(DF_OP_ENUM)
+	DF_FLOAT_OPS(DF_OP_ENUM)
+	DF_OP_STRING,		/* The pattern at the offset */
+	DF_OP_SEARCH,		/* ... anywhere in the range from it */
+	DF_OP_REGEX,		/* A regular expression in the range */
+	DF_OP_MAX
+};
+#define DF_OP_ISSTRING(op)	((op) == DF_OP_STRING ||		\
+				    (op) == DF_OP_SEARCH || (op) == DF_OP_REGEX)
+
+/* Types in host order are whichever of the above that is */
+#if BYTE_ORDER == LITTLE_ENDIAN
+#define DF_OP_S16H	DF_OP_S16LE
+#define DF_OP_S32H	DF_OP_S32LE
+#define DF_OP_U32H	DF_OP_U32LE
+#define DF_OP_S64H	DF_OP_S64LE
+#define DF_OP_F32H	DF_OP_F32LE
+#define DF_OP_F64H	DF_OP_F64LE
+#else
+#define DF_OP_S16H	DF_OP_S16BE
+#define DF_OP_S32H	DF_OP_S32BE
+#define DF_OP_U32H	DF_OP_U32BE
+#define DF_OP_S64H	DF_OP_S64BE
+#define DF_OP_F32H	DF_OP_F32BE
+#define DF_OP_F64H	DF_OP_F64BE
+#endif
+
+/* What df_op_load() makes of a value that can't be an offset */
+#define DF_OFF_BAD	INT64_MIN
+#define DF_OFF_FMAX	0x1p63
+
+/*
+ * The outcomes of comparing the value in the file with that of the rule
+ * that make the rule match. The first three are bits 0 to 2 so a handler
+ * can shift by the result of the comparison.
+ */
+#define DF_REL_LT	0x01
+#define DF_REL_EQ	0x02
+#define DF_REL_GT	0x04
+#define DF_REL_UN	0x08	/* Unordered, a NaN */
+#define DF_REL_AND	0x10	/* Compare value & rule's with the rule's */
+#define DF_REL_ANY	(DF_REL_LT | DF_REL_EQ | DF_REL_GT | DF_REL_UN)
+
+/*
+ * The / modifiers of string, search and regex tests. A blank in the
+ * pattern matches one or more (W) or any number of (w) blanks in the file;
+ * the lower (c) or upper (C) case letters of the pattern match either
+ * case. The range of a regex counts lines if l. b and t, binary and text,
+ * and s, which only matters to relative offsets, are taken and make no
+ * difference.
+ */
+#define DF_STR_LOWER	0x01	/* c */
+#define DF_STR_UPPER	0x02	/* C */
+#define DF_STR_COMPACT	0x04	/* W */
+#define DF_STR_BLANKS	0x08	/* w */
+#define DF_STR_TRIM	0x10	/* T, of blanks around what's printed */
+#define DF_STR_LINES	0x20	/* l */
+#define DF_STRMAX	128	/* Longest pattern, and string printed */
+
+/*
+ * A compiled magic rule, one for each line of the magic db that we could
+ * make sense of. Rules live in db order in a flat array and continuations
+ * are linked to their parent by array index, not by pointer.
+ */
+#define DF_RULE_NONE	0xffffffffU
+#define DF_MAXLEVEL	64
+struct df_rule {
+	int64_t			 offset;	/* Test (or indirect) offset */
+	int64_t			 offset_adj;	/* Added to indirect offset */
+	union {
+		u_int64_t	 mask;		/* All ones unless MF_MASK */
+		u_int64_t	 range;		/* Of a search or regex */
+	};
+	union {
+		int64_t		 d_num;		/* Integer types, host order */
+		double		 d_float;	/* Floating point types */
+		struct {
+			u_int32_t str;		/* Pattern, offset in strtab */
+			u_int16_t len;
+			u_int8_t  flags;	/* DF_STR_* */
+		}		 s;		/* String types */
+	}			 value;
+	u_int32_t		 parent;	/* Rule we continue */
+	u_int32_t		 child;		/* Our first continuation */
+	u_int32_t		 next;		/* Next rule on the same level */
+	u_int32_t		 lineno;	/* Line in the magic db */
+	u_int32_t		 desc;		/* Description, offset in strtab */
+	u_int32_t		 test_flags;	/* DF_TEST_PFX_* */
+	u_int8_t		 level;		/* Continuation level */
+	u_int8_t		 mtype;		/* enum df_magic_test */
+	u_int8_t		 itype;		/* Indirect type if MF_INDIRECT */
+	u_int8_t		 mflags;	/* MF_* */
+	u_int8_t		 op;		/* enum df_op of mtype */
+	u_int8_t		 iop;		/* ... and of itype */
+	u_int8_t		 rel;		/* DF_REL_*, from test_flags */
+	u_int8_t		 lazy;		/* Continuations not compiled yet */
+};
+
+/*
+ * Continuation lines of a top level rule, left in the text magic file
+ * until the rule first matches. Their rules go in the count slots from
+ * first on, reserved for them at load.
+ */
+struct df_lazy {
+	off_t			 off;		/* Of the first line */
+	size_t			 lineno;	/* Lines before it */
+	u_int32_t		 rule;		/* Top level rule */
+	u_int32_t		 first;
+	u_int32_t		 count;
+};
+
+/*
+ * The compiled magic db. Built once at startup and only read afterwards,
+ * but for the continuations of lazily loaded rules, which are compiled
+ * in place on first use under lazy_lock, and the DFAs of regex tests,
+ * which grow under locks of their own.
+ * It comes either from parsing the text magic file or from mapping an
+ * image previously written with -C, in which case map is set.
+ */
+struct df_db {
+	struct df_rule		*rules;		/* All rules, in db order */
+	u_int32_t		 nrules;
+	u_int32_t		 rules_alloc;
+	char			*strtab;	/* Descriptions */
+	size_t			 strtab_len;
+	size_t			 strtab_alloc;
+	void			*map;		/* Mapped image, if any */
+	size_t			 maplen;
+	struct df_index		*index;		/* Top level dispatch */
+	struct df_readplan	*plan;		/* What to read of a file */
+	struct df_arena		 arena;		/* index and plan */
+	u_int64_t		 gen;		/* Load of its handle */
+	FILE			*lazy_file;	/* Magic file, if lazy */
+	struct df_lazy		*lazy;		/* By rule */
+	u_int32_t		 nlazy;
+	u_int32_t		 fill;		/* Next reserved slot */
+	u_int32_t		 fill_end;
+	struct df_rule		*later;		/* Where lazy lines look */
+	u_int32_t		 nlater;
+	pthread_mutex_t		 lazy_lock;
+	struct df_re		**re;		/* By rule, for regex tests */
+};
+
+/*
+ * A piece of a file available to the magic tests.
+ */
+struct df_extent {
+	int64_t			 off;		/* Offset in file */
+	size_t			 len;
+	const u_char		*buf;
+};
+
+/*
+ * Read plan, worked out from the static offsets of all rules so that a
+ * file is read with one pread for the window at its start, plus one for
+ * each group of rules looking further in and one for the tail if any rule
+ * counts from the end.
+ */
+#define DF_PLAN_MAXEXTENTS	4
+#define DF_PLAN_GAP		4096	/* Coalesce extents closer than this */
+struct df_readplan {
+	size_t			 window;	/* Read from offset 0 */
+	size_t			 tail;		/* Read back from the end */
+	struct df_extent	 extents[DF_PLAN_MAXEXTENTS];
+	int			 nextents;
+	size_t			 bufsize;	/* All of the above */
+	size_t			 max;		/* Most read for one test */
+};
+
+/*
+ * The bytes of one file as read according to the plan. Tests that look
+ * somewhere nobody planned for get a small read of their own into the
+ * spill area. Once that is full the oldest spill is read over, so like
+ * the plan's own extents these last at least until the next
+ * df_source_get(), but no longer. Reads too long for a spill, up to the
+ * plan's max, go to a buffer of their own that is reused the same way.
+ *
+ * A source can instead sit over memory the caller already has, possibly
+ * split across several buffers. Values that straddle two of those are
+ * gathered into a small scratch area, which is only good until the next
+ * df_source_get().
+ *
+ * What the tests have cost so far is counted against the budget, if
+ * there is one; the clock is only looked at every DF_BUDGET_CLOCK rules.
+ */
+#define DF_MAXEXTENTS		(DF_PLAN_MAXEXTENTS + 6)
+#define DF_SPILLLEN		512
+#define DF_NSPILL		4
+#define DF_GATHERLEN		64
+#define DF_BUDGET_CLOCK		16
+struct df_source {
+	int			 fd;		/* To read more from, or -1 */
+	int64_t			 size;		/* Of the file */
+	struct df_extent	 ext[DF_MAXEXTENTS];
+	int			 next;
+	u_char			*buf;		/* Backing store for ext */
+	size_t			 bufsize;
+	int			 nspill;	/* Spill reads done */
+	int			 spillext[DF_NSPILL]; /* ... their ext */
+	int			 escaped;	/* Went beyond the plan */
+	size_t			 max;		/* Longest read allowed */
+	u_char			*big;		/* For reads past a spill */
+	size_t			 bigsize;
+	const struct iovec	*iov;		/* Caller's buffers, or NULL */
+	int			 iovcnt;
+	int			 iovidx;	/* Where the last get landed */
+	int64_t			 iovoff;	/* ... and its offset */
+	u_char			 gather[DF_GATHERLEN];
+	u_int64_t		 nread;		/* Bytes the tests asked for */
+	struct df_rule_prof	*prof;		/* Counters, if profiling */
+	const struct df_budget	*budget;	/* Limits, or NULL */
+	u_int64_t		 nrules;	/* Rules tested */
+	u_int64_t		 nscanned;	/* Bytes searched */
+	u_int64_t		 deadline;	/* Monotonic ns, if timed */
+	u_int32_t		 depth;		/* Indirect rules above */
+	int			 partial;	/* Went over the budget */
+};
+
+/*
+ * Aho-Corasick automaton over the patterns of the top level string and
+ * search tests, so that one pass over the start of a file finds every
+ * such rule that may match it. It works on bytes folded to lower case and
+ * on at most DF_AC_KEYLEN bytes of a pattern, up to its first blank if
+ * blanks are loose, so what it finds still has to be tested. A hit only
+ * counts if it starts where its rule could have matched, that is at the
+ * offset of a string test or in the range of a search.
+ *
+ * The input bytes are mapped to classes, one for each byte seen in the
+ * patterns and one for all others, and the transitions are filled in
+ * for every state and class.
+ */
+#define DF_AC_KEYLEN	8
+struct df_ac {
+	u_int16_t		 classes[256];	/* Input byte to class */
+	u_int32_t		 nclasses;
+	u_int32_t		 nstates;
+	u_int32_t		*delta;		/* [state * nclasses + class] */
+	u_int32_t		*out;		/* out_lits[out[s]..out[s + 1]] */
+	u_int32_t		*out_lits;	/* Ending in each state */
+	struct df_ac_lit {
+		u_int32_t	 pos;		/* Of its rule, in order */
+		u_int32_t	 len;		/* Bytes in the automaton */
+		int64_t		 lo, hi;	/* Where it may start */
+	}			*lits;		/* By pos */
+	u_int32_t		 nlits;
+	size_t			 end;		/* Bytes of the file to scan */
+};
+
+/*
+ * Ways of finding the pattern of a plain search test, best first, and the
+ * DF_CPU_* features each needs.
+ */
+#define DF_CPU_SSE2	0x01
+#define DF_CPU_AVX2	0x02
+typedef int64_t (*df_memfind_fn)(const u_char *, size_t, size_t,
+    const u_char *, size_t);
+struct df_memfind_impl {
+	const char		*name;
+	df_memfind_fn		 fn;
+	int			 cpu;		/* Features it needs */
+};
+
+/*
+ * The same for comparing one value against the lanes of a df_lanes.
+ */
+typedef u_int64_t (*df_lanes_fn)(const u_int32_t *, const u_int32_t *,
+    u_int32_t, u_int32_t);
+struct df_lanes_impl {
+	const char		*name;
+	df_lanes_fn		 fn;
+	int			 cpu;
+};
+
+/*
+ * A compiled regex test, see regex.c. The pattern is parsed into a tree
+ * of df_re_ast, which is made into one NFA for the pattern and one for
+ * it backwards. Each is run as a DFA whose states are added as files
+ * need them, under the DFA's lock; what has been added is only read, so
+ * looking it up takes no lock. Once there are DF_RE_MAXDFA states the DFA
+ * no longer changes, and a scan that gets off it works out new sets of
+ * NFA states on every byte instead, in scratch of its own and without
+ * the lock.
+ */
+#define DF_RE_MAXNFA	2048	/* NFA states a pattern may make */
+#define DF_RE_MAXDFA	256	/* DFA states kept, each way */
+#define DF_RE_HASH	(2 * DF_RE_MAXDFA)
+#define DF_RE_MAXREP	255	/* Biggest count in {m,n} */
+#define DF_RE_MAXDEPTH	32	/* Of nested groups */
+#define DF_RE_INF	0xffff	/* No most in {m,} */
+#define DF_RE_ERR	0xffffffffU
+#define DF_RE_NONE	0xffffffffU	/* Not a DFA state we kept */
+#define DF_RE_WINDOW	8192	/* Bytes looked at if not told */
+#define DF_RE_LINELEN	80	/* Bytes a line is taken to be */
+enum df_re_type {
+	DF_RE_EMPTY,		/* Tree only */
+	DF_RE_SET,		/* A byte of a set */
+	DF_RE_CAT,		/* Tree only, a then b */
+	DF_RE_ALT,		/* Tree only, a or b */
+	DF_RE_REP,		/* Tree only, a {min,max} times */
+	DF_RE_BOL,		/* ^ */
+	DF_RE_EOL,		/* $ */
+	DF_RE_SPLIT,		/* NFA only, out or out1 */
+	DF_RE_MATCH		/* NFA only */
+};
+struct df_re_ast {
+	u_int8_t		 type;		/* enum df_re_type */
+	u_int16_t		 min, max;
+	u_int32_t		 a, b;		/* Operands, or set */
+	u_int32_t		 cost;		/* NFA states it makes, about */
+};
+struct df_re_parser {
+	const u_char		*p, *end;
+	int			 icase;
+	int			 depth;		/* Of groups */
+	const char		*err;
+	struct df_re_ast	*ast;
+	u_int32_t		 nast;
+	u_int32_t		 ast_alloc;
+	u_char			(*sets)[32];	/* Bitmaps of bytes */
+	u_int32_t		 nsets;
+	u_int32_t		 sets_alloc;
+};
+struct df_re_nfa {
+	u_int8_t		 type;		/* enum df_re_type */
+	u_int16_t		 set;
+	u_int16_t		 out, out1;
+};
+#define DF_RE_DBOL	0x01	/* At the start of a line */
+#define DF_RE_DMATCH	0x02	/* Has matched */
+#define DF_RE_DEOLMATCH	0x04	/* ... if a line ends here */
+#define DF_RE_DDEAD	0x08	/* Can't ever match */
+struct df_re_dstate {
+	u_int32_t		 set;		/* Its NFA states, in pool */
+	u_int16_t		 len;
+	u_int8_t		 flags;		/* DF_RE_D* */
+};
+struct df_re_work {
+	u_int32_t		*mark;		/* gen, if in the set made */
+	u_int32_t		 gen;
+	u_int32_t		*stack;
+	u_int16_t		*next;		/* Set being made */
+	u_int16_t		*mid;
+	u_int16_t		*cur;		/* Set we're in, if not kept */
+	u_int32_t		 ncur;
+	int			 curflags;
+};
+struct df_re_dfa {
+	pthread_mutex_t		 lock;
+	u_int32_t		 root;		/* NFA state it starts from */
+	u_int32_t		 start[2];	/* + 1, by DF_RE_DBOL */
+	u_int32_t		*delta;		/* [state*nclasses+class] + 1 */
+	struct df_re_dstate	*states;
+	u_int32_t		 nstates;
+	u_int32_t		 hash[DF_RE_HASH]; /* states + 1 */
+	u_int16_t		*pool;
+	size_t			 pool_len;
+	size_t			 pool_alloc;
+	struct df_re_work	 work;		/* For whoever holds the lock */
+};
+struct df_re {
+	struct df_re_nfa	*nfa;
+	u_int32_t		 nnfa;
+	u_int32_t		 nfa_alloc;
+	u_char			(*sets)[32];
+	u_int32_t		 nsets;
+	u_int8_t		 classes[256];	/* Byte to class */
+	u_char			 rep[256];	/* Class to a byte of it */
+	u_int32_t		 nclasses;
+	struct df_re_dfa	 fwd;		/* Anchored */
+	struct df_re_dfa	 rev;		/* Backwards, unanchored */
+};
+
+/*
+ * Dispatch index over the top level rules, so a file only gets tested
+ * against rules that can possibly match it. Plain equality tests at offset
+ * 0 are found through the first byte of the file, those at other offsets
+ * through a hash of (offset, width, leading value bytes), string and
+ * search tests through the automaton above. Equality tests left over,
+ * masked ones and those at offsets that didn't get a probe, are packed
+ * into lanes by offset and type where enough of them share one, so that a
+ * single load and compare finds which of them may match. Anything else
+ * (x, relations, indirect offsets...) is always tested.
+ *
+ * The top level rules are tested in the order of order[], which is db
+ * order unless a hit profile moved the common ones up past rules that
+ * could never match the same file. The rule lists hold positions in it,
+ * ascending.
+ */
+#define DF_INDEX_MAXPROBE	32
+#define DF_INDEX_MAXLANES	16	/* Groups of lanes */
+#define DF_LANES_MAX		64	/* Rules in a group */
+#define DF_LANES_MIN		4	/* ... or they're always tested */
+#define DF_LANES_PAD		8	/* Lanes compared at once, at most */
+struct df_lanes {
+	int64_t			 offset;
+	u_int32_t		 op;		/* Loaded as */
+	u_int32_t		 width;
+	u_int32_t		 n;
+	u_int32_t		*mask;		/* [DF_LANES_MAX], 0 past n */
+	u_int32_t		*value;		/* ... and 1, so none match */
+	u_int32_t		*rules;		/* Positions in order */
+};
+struct df_index {
+	u_int32_t		*order;		/* Top level rules */
+	u_int32_t		 norder;
+	u_int32_t		 byte0[257];	/* byte0_rules[byte0[c]..[c+1]] */
+	u_int32_t		*byte0_rules;
+	struct df_probe {
+		int64_t		 offset;
+		u_int32_t	 width;		/* Bytes of value keyed on */
+	}			 probes[DF_INDEX_MAXPROBE];
+	u_int32_t		 nprobes;
+	struct df_bucket {
+		u_int64_t	 key;		/* Probe number, value bytes */
+		u_int32_t	 start;		/* In bucket_rules */
+		u_int32_t	 count;		/* 0 if bucket unused */
+	}			*buckets;
+	u_int32_t		 nbuckets;	/* Power of 2 */
+	u_int32_t		*bucket_rules;
+	u_int32_t		*always;	/* Rules to always test */
+	u_int32_t		 nalways;
+	struct df_lanes		*lanes;		/* [DF_INDEX_MAXLANES] */
+	u_int32_t		 nlanes;
+	struct df_ac		*ac;		/* If there are literals */
+};
+
+/*
+ * One of the index rule lists being walked for a file.
+ */
+struct df_cursor {
+	const u_int32_t		*rules;
+	u_int32_t		 n;
+};
+
+/*
+ * Header of a compiled db image, <magic>.dfc. The image is the header,
+ * the rule array and the string table, all referenced by file offset so it
+ * can be used straight from a read only mapping. Everything is in the byte
+ * order of the host that wrote it, dh_magic tells which.
+ */
+#define DF_DB_SUFFIX	".dfc"
+#define DF_DB_MAGIC	0x64664442	/* "dfDB" */
+#define DF_DB_VERSION	4
+struct df_db_header {
+	u_int32_t		 dh_magic;
+	u_int32_t		 dh_version;
+	u_int32_t		 dh_rule_size;	/* sizeof(struct df_rule) */
+	u_int32_t		 dh_nrules;
+	u_int64_t		 dh_rules_off;
+	u_int64_t		 dh_strtab_off;
+	u_int64_t		 dh_strtab_len;
+	/* The text magic file this was compiled from */
+	int64_t			 dh_src_size;
+	int64_t			 dh_src_mtime;
+	int64_t			 dh_src_mtime_nsec;
+};
+
+/*
+ * A value read out of a file to be tested against a rule.
+ */
+struct df_value {
+	int64_t			 num;
+	double			 fnum;
+	const u_char		*str;		/* Where a string matched */
+	size_t			 slen;		/* ... and what's left of it */
+};
+
+/*
+ * A libdefile handle, opaque to library users. Everything but the per
+ * thread state is set up by df_load() and only read afterwards, so
+ * any number of threads can classify through the same handle.
+ *
+ * The one exception is db, which df_reload() swaps for a new one. A
+ * thread classifying notes the epoch it started in and drops it when
+ * done; the old db is freed once no thread is left in an epoch from
+ * before the swap.
+ */
+struct defile {
+	char			*magic_path;
+	int			 flags;		/* DF_* from defile.h */
+	size_t			 read_max;	/* Largest single read */
+	struct df_db		*db;
+	u_int64_t		 epoch;		/* Bumped as db is swapped */
+	pthread_mutex_t		 reload_lock;	/* One swap at a time */
+	pthread_mutex_t		 threads_lock;
+	LIST_HEAD(, df_thread)	 threads;	/* Everyone with a df_thread */
+	struct df_watch		*watch;		/* If df_watch() was called */
+	pthread_key_t		 key;		/* Per thread df_thread */
+	struct df_dedup		*dedup;		/* If df_dedup() was called */
+	struct df_profile	*profile;	/* If df_profile() was called */
+	struct df_budget	*budget;	/* If df_budget() was called */
+	u_int64_t		(*hits)[2];	/* Line, hits from df_order() */
+	size_t			 nhits;
+};
+
+/*
+ * Files that share their size and every byte the read plan asks for
+ * can't be told apart by the rules, so what was found for one is good
+ * for the others, unless the rules went looking elsewhere. This keeps
+ * the last so many results, keyed on a hash of those bytes. The matches
+ * are kept packed as a class and flags byte, then the description.
+ */
+#define DF_DEDUP_DATALEN	480
+struct df_dedup_entry {
+	u_int64_t			 key;
+	TAILQ_ENTRY(df_dedup_entry)	 lru;
+	LIST_ENTRY(df_dedup_entry)	 chain;
+	int				 used;
+	size_t				 len;		/* Of data */
+	char				 data[DF_DEDUP_DATALEN];
+};
+struct df_dedup {
+	pthread_mutex_t			 lock;
+	struct df_dedup_entry		*entries;
+	size_t				 nentries;
+	TAILQ_HEAD(df_dedup_lru, df_dedup_entry) lru;	/* Most recent first */
+	LIST_HEAD(, df_dedup_entry)	*buckets;
+	u_int32_t			 nbuckets;	/* Power of 2 */
+	struct df_dedup_stats		 stats;
+};
+
+/*
+ * What each rule cost, for df_profile(). Every thread counts into its
+ * own set, which stays on the handle after the thread is gone; the
+ * report adds them up.
+ */
+struct df_rule_prof {
+	u_int64_t		 evals;
+	u_int64_t		 matches;
+	u_int64_t		 bytes;		/* Asked of the source */
+	u_int64_t		 nsec;		/* Testing and describing */
+};
+struct df_prof_set {
+	LIST_ENTRY(df_prof_set)	 entry;
+	struct df_rule_prof	 rules[];	/* One per rule in the db */
+};
+struct df_profile {
+	pthread_mutex_t		 lock;
+	LIST_HEAD(, df_prof_set) sets;
+};
+
+/*
+ * What each thread classifying through a handle keeps between files.
+ */
+struct df_thread {
+	struct defile		*h;
+	LIST_ENTRY(df_thread)	 entry;
+	u_int64_t		 epoch;		/* Classifying since, or 0 */
+	struct df_source	*src;		/* Made on first use */
+	u_int64_t		 gen;		/* ... for the db of this gen */
+	struct df_matches	 matches;
+	struct df_prof_set	*prof;		/* If profiling, on first use */
+};
+
+/*
+ * Polls the magic file and its image for changes, and reloads when they
+ * do or when asked to.
+ */
+struct df_watch {
+	pthread_t		 thread;
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 cond;		/* To stop or reload */
+	int			 stop;
+	int			 reload;	/* Now, changed or not */
+	int			 secs;		/* Between looks */
+	struct stat		 sb[2];		/* Magic file and image */
+};
+
+/*
+ * Results kept from one run to the next (-c), a hash table in a file that
+ * is mapped by every process using it. Only one process at a time gets to
+ * write, the one holding an exclusive flock(2) on the file; the others
+ * just read. A slot is keyed on what a file can't change without stat(2)
+ * noticing and is checksummed, so a reader racing with the writer sees a
+ * miss rather than a torn entry. The checksum is seeded with a
+ * fingerprint of the magic db and of the options that change results,
+ * and the table is emptied when that changes.
+ */
+#define DF_CACHE_MAGIC		0x64664343	/* "dfCC" */
+#define DF_CACHE_VERSION	1
+#define DF_CACHE_NSLOTS		(1 << 18)
+#define DF_CACHE_PROBES		4
+#define DF_CACHE_DESCLEN	188		/* Slots of 256 bytes */
+struct df_cache_header {
+	u_int32_t		 ch_magic;
+	u_int32_t		 ch_version;
+	u_int32_t		 ch_nslots;
+	u_int32_t		 ch_slot_size;
+	u_int64_t		 ch_fingerprint;
+};
+struct df_cache_slot {
+	u_int64_t		 cs_sum;	/* 0 if empty */
+	u_int64_t		 cs_dev;
+	u_int64_t		 cs_ino;
+	int64_t			 cs_size;
+	int64_t			 cs_mtime;
+	int64_t			 cs_mtime_nsec;
+	int64_t			 cs_ctime;
+	int64_t			 cs_ctime_nsec;
+	u_int32_t		 cs_len;	/* Of cs_desc */
+	char			 cs_desc[DF_CACHE_DESCLEN];
+};
+struct df_cache {
+	int			 fd;
+	void			*map;
+	size_t			 maplen;
+	struct df_cache_slot	*slots;
+	u_int32_t		 nslots;
+	u_int64_t		 fingerprint;
+	int			 writer;
+	pthread_mutex_t		 lock;		/* Between our own writers */
+};
+
+extern int		 df_debug;
+extern struct df_state	 df_state;
+extern struct df_memfind_impl df_memfind_impls[];
+extern struct df_lanes_impl df_lanes_impls[];
+
+/* magic.c */
+void			*df_arena_alloc(struct df_arena *, size_t);
+void			*df_arena_calloc(struct df_arena *, size_t, size_t);
+char			*df_arena_strdup(struct df_arena *, const char *);
+void			 df_arena_reset(struct df_arena *);
+void			 df_arena_free(struct df_arena *);
+int			 lookup_mtype(struct df_parser *, char *);
+const char		*df_mtype_name(int);
+int			 df_mtype_op(int);
+struct df_db		*df_db_load(FILE *, int);
+int			 df_db_line(struct df_db *, struct df_parser *, char *,
+    u_int32_t *, int *);
+char			*df_db_token(char **);
+int			 df_db_add(struct df_db *, struct df_parser *,
+    u_int32_t *);
+void			 df_db_reserve(struct df_db *, off_t, size_t,
+    u_int32_t);
+void			 df_db_peek(struct df_db *, char *);
+void			 df_db_grow(struct df_db *);
+void			 df_db_regex(struct df_db *, u_int32_t, struct df_re *);
+void			 df_db_expand(struct df_db *, u_int32_t);
+int			 df_lazy_cmp(const void *, const void *);
+u_int32_t		 df_db_strtab_add(struct df_db *, const char *);
+u_int32_t		 df_db_strtab_addn(struct df_db *, const void *,
+    size_t);
+void			 df_db_free(struct df_db *);
+int			 df_db_write(struct df_db *, const char *,
+    struct stat *);
+struct df_db		*df_db_map(const char *, struct stat *);
+int			 df_db_compile(const char *);
+u_int64_t		 df_hash64(const void *, size_t, u_int64_t);
+u_int64_t		 df_db_fingerprint(const struct df_db *);
+int			 df_rule_exclusive(const struct df_rule *,
+    const struct df_rule *);
+void			 df_index_reorder(struct df_db *, u_int32_t *,
+    u_int32_t, const u_int64_t *);
+void			 df_db_index(struct df_db *, const u_int64_t *);
+int			 df_index_keyable(const struct df_rule *);
+int			 df_index_laneable(const struct df_rule *);
+void			 df_index_lanes(struct df_db *, const u_int32_t *,
+    u_int32_t);
+int			 df_index_pos_cmp(const void *, const void *);
+int			 df_index_probe_cmp(const void *, const void *);
+int			 df_index_key_cmp(const void *, const void *);
+const struct df_bucket	*df_index_lookup(const struct df_index *,
+    u_int64_t);
+size_t			 df_index_literal(const struct df_db *,
+    const struct df_rule *, u_char *);
+void			 df_ac_build(struct df_db *, const u_int32_t *,
+    u_int32_t);
+void			 df_ac_scan(const struct df_ac *, struct df_source *,
+    struct df_arena *, struct df_cursor *);
+void			 df_lanes_scan(const struct df_lanes *,
+    struct df_source *, struct df_arena *, struct df_cursor *);
+void			 df_db_plan(struct df_db *, size_t);
+int			 df_plan_cmp(const void *, const void *);
+struct df_source	*df_source_new(const struct df_readplan *);
+void			 df_source_free(void *);
+int			 df_source_read(struct df_source *,
+    const struct df_readplan *, int, int64_t);
+void			 df_source_mem(struct df_source *, const void *,
+    size_t);
+int			 df_source_iov(struct df_source *,
+    const struct iovec *, int);
+const u_char		*df_source_get(struct df_source *, int64_t, size_t);
+const u_char		*df_source_get_iov(struct df_source *, int64_t,
+    size_t);
+const u_char		*df_source_get_big(struct df_source *, int64_t,
+    size_t);
+size_t			 df_source_avail(struct df_source *, int64_t);
+size_t			 df_rule_bytes(const struct df_rule *, u_char *);
+size_t			 df_rule_span(const struct df_rule *);
+size_t			 df_mtype_size(int);
+int			 df_mtype_unsigned(int);
+int			 df_mtype_float(int);
+int64_t			 df_mtype_trunc(int, int64_t);
+void			 df_rule_rel(struct df_rule *);
+int64_t			 df_op_load(int, const u_char *);
+#define DF_OP_PROTO(name, type, raw, swap)				\
+int			 df_test_##name(const struct df_rule *,		\
+    const u_char *, struct df_value *);
+DF_INT_OPS(DF_OP_PROTO)
+DF_FLOAT_OPS(DF_OP_PROTO)
+int			 df_string_cmp(const struct df_rule *, const u_char *,
+    const u_char *, size_t);
+int64_t			 df_string_search(const struct df_rule *,
+    const u_char *, const u_char *, size_t);
+int			 df_test_string(const struct df_db *,
+    const struct df_rule *, struct df_source *, int64_t,
+    struct df_value *);
+int			 df_test_regex(const struct df_db *,
+    const struct df_rule *, struct df_source *, int64_t,
+    struct df_value *);
+int			 df_rule_test(const struct df_db *,
+    const struct df_rule *, struct df_source *, struct df_value *);
+void			 df_budget_start(struct df_source *,
+    const struct df_budget *);
+int			 df_budget_spent(struct df_source *,
+    const struct df_rule *);
+int			 df_budget_scan(struct df_source *, size_t);
+int			 df_rule_match(struct df_matches *, struct df_db *,
+    u_int32_t, struct df_source *);
+int			 df_rule_describe(struct df_matches *, struct df_db *,
+    const struct df_rule *, const struct df_value *);
+void			 df_string_print(const struct df_rule *,
+    const struct df_value *, char *, size_t);
+void			 df_magic_walk(struct df_matches *, struct df_db *,
+    struct df_source *);
+int			 df_check_mode(struct df_matches *, const struct stat *,
+    int);
+struct df_match		*df_match_add(struct df_matches *, enum match_class,
+    const char *, ...);
+int			 df_matches_print(struct df_matches *, char *, size_t);
+void			 df_matches_init(struct df_matches *);
+void			 df_matches_reset(struct df_matches *);
+void			 df_matches_free(struct df_matches *);
+int			 dp_prepare(struct df_parser *);
+int			 dp_prepare_moffset(struct df_parser *, const char *);
+int			 dp_prepare_mtype(struct df_parser *, char *);
+int			 dp_prepare_mstrmod(struct df_parser *, char *);
+int			 dp_prepare_mdata_numeric(struct df_parser *, char *);
+int			 dp_prepare_mdata_string(struct df_parser *, char *);
+
+/* cache.c */
+struct df_cache		*df_cache_open(const char *, u_int64_t);
+void			 df_cache_close(struct df_cache *);
+u_int64_t		 df_cache_slot_sum(const struct df_cache_slot *,
+    u_int64_t);
+int			 df_cache_key(const struct df_cache_slot *,
+    const struct stat *);
+int			 df_cache_lookup(struct df_cache *, const struct stat *,
+    char *, size_t);
+void			 df_cache_store(struct df_cache *, const struct stat *,
+    const char *);
+
+/* file.c */
+void			 df_state_init_magic(void);
+struct df_file		*df_next_file(struct df_file *);
+void			 df_done_file(struct df_file *);
+int			 df_check(struct df_file *);
+void			 df_print(struct df_file *);
+
+/* server.c */
+int			 df_serve(const char *, int);
+void			 df_serve_signal(int);
+void			 df_serve_loop(struct df_server *);
+void			 df_serve_wake(struct df_server *);
+void			*df_serve_worker(void *);
+void			 df_serve_check(struct df_file *, struct df_job *);
+void			 df_serve_mode(struct df_file *, struct df_job *);
+void			 df_client_accept(struct df_server *);
+int			 df_client_read(struct df_server *, struct df_client *);
+int			 df_client_parse(struct df_server *,
+    struct df_client *);
+void			 df_client_respond(struct df_client *, u_int32_t,
+    int, const char *);
+int			 df_client_write(struct df_client *);
+void			 df_client_close(struct df_server *,
+    struct df_client *);
+int			 df_ask(const char *);
+int			 df_ask_send(int, struct df_file *, u_int32_t);
+int			 df_ask_recv(int, struct df_file *);
+int			 df_readall(int, void *, size_t);
+
+/* search.c */
+int64_t			 df_memfind(const u_char *, size_t, size_t,
+    const u_char *, size_t);
+int64_t			 df_memfind_pick(const u_char *, size_t, size_t,
+    const u_char *, size_t);
+int			 df_cpu_flags(void);
+int64_t			 df_memfind_scalar(const u_char *, size_t, size_t,
+    const u_char *, size_t);
+int64_t			 df_memfind_sse2(const u_char *, size_t, size_t,
+    const u_char *, size_t);
+int64_t			 df_memfind_avx2(const u_char *, size_t, size_t,
+    const u_char *, size_t);
+u_int64_t		 df_lanes_eq(const u_int32_t *, const u_int32_t *,
+    u_int32_t, u_int32_t);
+u_int64_t		 df_lanes_pick(const u_int32_t *, const u_int32_t *,
+    u_int32_t, u_int32_t);
+u_int64_t		 df_lanes_scalar(const u_int32_t *, const u_int32_t *,
+    u_int32_t, u_int32_t);
+u_int64_t		 df_lanes_sse2(const u_int32_t *, const u_int32_t *,
+    u_int32_t, u_int32_t);
+u_int64_t		 df_lanes_avx2(const u_int32_t *, const u_int32_t *,
+    u_int32_t, u_int32_t);
+
+/* regex.c */
+struct df_re		*df_re_compile(const u_char *, size_t, int,
+    const char **);
+void			 df_re_free(struct df_re *);
+int			 df_re_exec(struct df_re *, const u_char *, size_t,
+    size_t *, size_t *);
+u_int32_t		 df_re_alt(struct df_re_parser *);
+u_int32_t		 df_re_cat(struct df_re_parser *);
+u_int32_t		 df_re_rep(struct df_re_parser *);
+u_int32_t		 df_re_count(struct df_re_parser *);
+u_int32_t		 df_re_atom(struct df_re_parser *);
+u_int32_t		 df_re_bracket(struct df_re_parser *);
+int			 df_re_bracket_char(struct df_re_parser *, u_char *);
+void			 df_re_fold(u_char *);
+void			 df_re_invert(u_char *);
+u_int32_t		 df_re_node(struct df_re_parser *, int, u_int32_t,
+    u_int32_t);
+u_int32_t		 df_re_toobig(struct df_re_parser *, u_int32_t);
+u_int32_t		 df_re_set(struct df_re_parser *);
+void			 df_re_classes(struct df_re *);
+u_int32_t		 df_re_nfa_add(struct df_re *, int, u_int32_t,
+    u_int32_t, u_int32_t);
+u_int32_t		 df_re_emit(struct df_re *, const struct df_re_parser *,
+    u_int32_t, u_int32_t, int);
+void			 df_re_dfa_init(struct df_re *, struct df_re_dfa *);
+void			 df_re_dfa_free(struct df_re_dfa *);
+void			 df_re_work_init(struct df_re *, struct df_re_work *);
+void			 df_re_work_free(struct df_re_work *);
+void			 df_re_closure(struct df_re *, struct df_re_work *,
+    u_int32_t, int, int, u_int16_t *, u_int32_t *);
+void			 df_re_gen(struct df_re *, struct df_re_work *);
+int			 df_re_flags(struct df_re *, struct df_re_work *,
+    const u_int16_t *, u_int32_t, int);
+int			 df_re_cmp(const void *, const void *);
+u_int32_t		 df_re_find(struct df_re_dfa *, const u_int16_t *,
+    u_int32_t, int, u_int32_t *);
+u_int32_t		 df_re_dfa_add(struct df_re *, struct df_re_dfa *,
+    u_int32_t, int);
+u_int32_t		 df_re_start(struct df_re *, struct df_re_dfa *, int);
+u_int32_t		 df_re_move(struct df_re *, struct df_re_work *,
+    const u_int16_t *, u_int32_t, int, int);
+u_int32_t		 df_re_step(struct df_re *, struct df_re_dfa *,
+    const u_int16_t *, u_int32_t, int, int);
+struct df_re_work	*df_re_off(struct df_re *, struct df_re_dfa *,
+    struct df_re_work *);
+int64_t			 df_re_scan(struct df_re *, struct df_re_dfa *,
+    const u_char *, size_t, int, int);
+
+/* defile.c */
+struct df_db		*df_load_db(struct defile *);
+struct df_thread	*df_thread_get(struct defile *);
+void			 df_thread_free(void *);
+struct df_source	*df_thread_source(struct defile *, struct df_db *);
+struct df_db		*df_enter(struct defile *, struct df_thread *);
+void			 df_leave(struct df_thread *);
+void			 df_synchronize(struct defile *, u_int64_t);
+void			*df_watch_main(void *);
+void			 df_watch_stat(struct defile *, struct stat *);
+int			 df_stat_same(const struct stat *, const struct stat *);
+void			 df_magic(struct defile *, struct df_db *,
+    struct df_matches *, struct df_source *);
+u_int64_t		 df_dedup_key(const struct df_source *, u_int64_t);
+int			 df_dedup_lookup(struct df_dedup *, u_int64_t,
+    struct df_matches *);
+void			 df_dedup_insert(struct df_dedup *, u_int64_t,
+    const struct df_match *);
+struct df_prof_set	*df_profile_get(struct defile *, struct df_db *);
+struct df_rule_prof	*df_profile_sum(struct defile *);
+
 #ifdef DEBUG
 #define DPRINTF(lvl, args...)						\
 	do {								\
 		if (df_debug >= lvl) {					\
+			flockfile(stderr);				\
 			fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
 			fprintf(stderr, args);				\
 			fprintf(stderr, "\n");				\
+			funlockfile(stderr);				\
 		}							\
 	} while(0);
 #else
@@ -0,0 +1,3502 @@
+/*
+ * Copyright (c) 2011, Edd Barrett <vext01@gmail.com>
+ * Copyright (c) 2011, Christiano F. Haesbaert <haesbaert@haesbaert.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <endian.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <util.h>
+
+#include "defile.h"
+#include "file.h"
+
+int		 df_debug;
+
+/* Only whole lines are comments in a magic file, patterns may have a # */
+const char	 df_db_delim[3] = { '\\', '\\', '\0' };
+
+struct {
+	int		 mt;
+	const char	*str;
+	/* a function to call to parse the magic test specification */
+	int		(*md_parser)(struct df_parser *, char *);
+	/* how to load and test a value of the type, see DF_INT_OPS */
+	int		 op;
+} mt_table[] = {
+	{ MT_UNKNOWN,	"unknown",	0, DF_OP_NONE },
+	{ MT_BYTE,	"byte",		dp_prepare_mdata_numeric, DF_OP_S8 },
+	{ MT_UBYTE,	"ubyte",	dp_prepare_mdata_numeric, DF_OP_U8 },
+	{ MT_SHORT,	"short",	dp_prepare_mdata_numeric, DF_OP_S16H },
+	{ MT_LONG,	"long",		dp_prepare_mdata_numeric, DF_OP_S32H },
+	{ MT_ULONG,	"ulong",	dp_prepare_mdata_numeric, DF_OP_U32H },
+	{ MT_QUAD,	"quad",		dp_prepare_mdata_numeric, DF_OP_S64H },
+	{ MT_FLOAT,	"float",	dp_prepare_mdata_numeric, DF_OP_F32H },
+	{ MT_DOUBLE,	"double",	dp_prepare_mdata_numeric, DF_OP_F64H },
+	{ MT_STRING,	"string",	dp_prepare_mdata_string, DF_OP_STRING },
+	{ MT_PSTRING,	"pstring",	0, DF_OP_NONE },
+	{ MT_DATE,	"date",		0, DF_OP_S32H },
+	{ MT_QDATE,	"qdate",	0, DF_OP_S64H },
+	{ MT_LDATE,	"ldate",	0, DF_OP_S32H },
+	{ MT_QLDATE,	"qldate",	0, DF_OP_S64H },
+	{ MT_BESHORT,	"beshort",	dp_prepare_mdata_numeric, DF_OP_S16BE },
+	{ MT_UBESHORT,	"ubeshort",	dp_prepare_mdata_numeric, DF_OP_U16BE },
+	{ MT_BELONG,	"belong",	dp_prepare_mdata_numeric, DF_OP_S32BE },
+	{ MT_UBELONG,	"ubelong",	dp_prepare_mdata_numeric, DF_OP_U32BE },
+	{ MT_BEQUAD,	"bequad",	dp_prepare_mdata_numeric, DF_OP_S64BE },
+	{ MT_BEFLOAT,	"befloat",	dp_prepare_mdata_numeric, DF_OP_F32BE },
+	{ MT_BEDOUBLE,	"bedouble",	dp_prepare_mdata_numeric, DF_OP_F64BE },
+	{ MT_BEDATE,	"bedate",	0, DF_OP_S32BE },
+	{ MT_BEQDATE,	"beqdate",	0, DF_OP_S64BE },
+	{ MT_BELDATE,	"beldate",	0, DF_OP_S32BE },
+	{ MT_BEQLDATE,	"beqldate",	0, DF_OP_S64BE },
+	{ MT_BESTRING16,"bestring16",	0, DF_OP_NONE },
+	{ MT_LESHORT,	"leshort",	dp_prepare_mdata_numeric, DF_OP_S16LE },
+	{ MT_ULESHORT,	"uleshort",	dp_prepare_mdata_numeric, DF_OP_U16LE },
+	{ MT_LELONG,	"lelong",	dp_prepare_mdata_numeric, DF_OP_S32LE },
+	{ MT_ULELONG,	"ulelong",	dp_prepare_mdata_numeric, DF_OP_U32LE },
+	{ MT_LEQUAD,	"lequad",	dp_prepare_mdata_numeric, DF_OP_S64LE },
+	{ MT_LEFLOAT,	"lefloat",	dp_prepare_mdata_numeric, DF_OP_F32LE },
+	{ MT_LEDOUBLE,	"ledouble",	dp_prepare_mdata_numeric, DF_OP_F64LE },
+	{ MT_LEDATE,	"ledate",	0, DF_OP_S32LE },
+	{ MT_LEQDATE,	"leqdate",	0, DF_OP_S64LE },
+	{ MT_LELDATE,	"leldate",	0, DF_OP_S32LE },
+	{ MT_LEQLDATE,	"leqldate",	0, DF_OP_S64LE },
+	{ MT_LESTRING16,"lestring16",	0, DF_OP_NONE },
+	{ MT_MELONG,	"melong",	dp_prepare_mdata_numeric, DF_OP_S32ME },
+	{ MT_MEDATE,	"medate",	dp_prepare_mdata_numeric, DF_OP_S32ME },
+	{ MT_MELDATE,	"meldate",	dp_prepare_mdata_numeric, DF_OP_S32ME },
+	{ MT_REGEX,	"regex",	dp_prepare_mdata_string, DF_OP_REGEX },
+	{ MT_SEARCH,	"search",	dp_prepare_mdata_string, DF_OP_SEARCH },
+	{ MT_DEFAULT,	"default",	0, DF_OP_NONE },
+	{ -1,		NULL,		0, DF_OP_NONE },
+};
+
+/*
+ * Get len bytes from arena a, adding a chunk at least as big as all the
+ * others together if the current one is full.
+ */
+void *
+df_arena_alloc(struct df_arena *a, size_t len)
+{
+	struct df_arena_chunk	*c = a->chunks;
+	size_t			 hdr = DF_ARENA_ALIGN(sizeof(*c)), size;
+	void			*p;
+
+	len = DF_ARENA_ALIGN(len);
+	if (c == NULL || c->size - c->used < len) {
+		size = MAX(MAX(DF_ARENA_CHUNK, a->total), len);
+		if (size > SIZE_MAX - hdr || (c = malloc(hdr + size)) == NULL)
+			err(1, "arena");
+		c->size = size;
+		c->used = 0;
+		c->next = a->chunks;
+		a->chunks = c;
+		a->total += size;
+	}
+	p = (u_char *)c + hdr + c->used;
+	c->used += len;
+
+	return (p);
+}
+
+void *
+df_arena_calloc(struct df_arena *a, size_t nmemb, size_t size)
+{
+	void	*p;
+
+	if (size != 0 && nmemb > SIZE_MAX / size)
+		errx(1, "arena: overflow");
+	p = df_arena_alloc(a, nmemb * size);
+	bzero(p, nmemb * size);
+
+	return (p);
+}
+
+char *
+df_arena_strdup(struct df_arena *a, const char *str)
+{
+	size_t	 len = strlen(str) + 1;
+
+	return (memcpy(df_arena_alloc(a, len), str, len));
+}
+
+/*
+ * Forget everything in a. If it took more than one chunk, swap them for
+ * one that holds as much, so next time around it won't.
+ */
+void
+df_arena_reset(struct df_arena *a)
+{
+	size_t	 total = a->total;
+
+	if (a->chunks == NULL)
+		return;
+	if (a->chunks->next == NULL) {
+		a->chunks->used = 0;
+		return;
+	}
+	df_arena_free(a);
+	(void)df_arena_alloc(a, total);
+	a->chunks->used = 0;
+}
+
+void
+df_arena_free(struct df_arena *a)
+{
+	struct df_arena_chunk	*c;
+
+	while ((c = a->chunks) != NULL) {
+		a->chunks = c->next;
+		free(c);
+	}
+	a->total = 0;
+}
+
+int
+lookup_mtype(struct df_parser *df, char *str)
+{
+	int i;
+
+	for (i = 0; mt_table[i].mt != -1; i++) {
+		if (strcmp(str, mt_table[i].str) == 0) {
+			df->mtype = mt_table[i].mt;
+			df->mdata_parser = mt_table[i].md_parser;
+			DPRINTF(3, "Found mtype: %s: %d %p", str, df->mtype, df->mdata_parser);
+			return (0);
+		}
+	}
+
+	df->mtype = MT_UNKNOWN;
+	DPRINTF(3, "Did not find mtype: %s", str);
+	return (-1);
+}
+
+/*
+ * The name magic files know mtype by.
+ */
+const char *
+df_mtype_name(int mtype)
+{
+	int i;
+
+	for (i = 0; mt_table[i].mt != -1; i++)
+		if (mt_table[i].mt == mtype)
+			return (mt_table[i].str);
+
+	return ("unknown");
+}
+
+/*
+ * The opcode that tests values of mtype.
+ */
+int
+df_mtype_op(int mtype)
+{
+	int i;
+
+	for (i = 0; mt_table[i].mt != -1; i++)
+		if (mt_table[i].mt == mtype)
+			return (mt_table[i].op);
+
+	return (DF_OP_NONE);
+}
+
+/*
+ * Parse the magic db into a compiled db, and close magic_file.
+ *
+ * If lazy, only the top level rules are compiled now. The continuation
+ * lines under each are counted, and their room in the rules and string
+ * table set aside, for df_db_expand() to fill in the first time the rule
+ * matches; magic_file is kept open until then. Files that only match a
+ * few rules, if any, never pay for the rest.
+ */
+struct df_db *
+df_db_load(FILE *magic_file, int lazy)
+{
+	size_t		 linelen, lineno, reserve = 0;
+	u_int32_t	 later = 0;
+	char		*line;
+	struct df_parser dp;
+	struct df_db	*db;
+	u_int32_t	 last[DF_MAXLEVEL];
+	off_t		 off;
+	int		 skip = -1, i;
+
+	if ((db = calloc(1, sizeof(*db))) == NULL)
+		err(1, "calloc");
+	pthread_mutex_init(&db->lazy_lock, NULL);
+	for (i = 0; i < DF_MAXLEVEL; i++)
+		last[i] = DF_RULE_NONE;
+	bzero(&dp, sizeof(dp));
+	/* Parser state */
+	dp.magic_file = magic_file;
+	dp.level      = -1;
+	dp.lineno     = 0;
+	/* Get a line */
+	while (!feof(magic_file)) {
+		off = ftello(magic_file);
+		lineno = dp.lineno;
+		if ((line = fparseln(magic_file, &linelen, &dp.lineno,
+		    df_db_delim, 0)) == NULL) {
+			if (ferror(magic_file)) {
+				warn("magic file");
+				fclose(magic_file);
+				df_db_free(db);
+				return (NULL);
+			} else
+				continue;
+		}
+		/* Continuations of a rule we kept wait for it to match */
+		if (lazy && line[strspn(line, " \t")] == '>' &&
+		    last[0] != DF_RULE_NONE) {
+			if (skip == -1) {
+				df_db_reserve(db, off, lineno, last[0]);
+				df_db_peek(db, line);
+				reserve += linelen + 1;
+				later++;
+			}
+			free(line);
+			continue;
+		}
+		df_db_line(db, &dp, line, last, &skip);
+		free(line);
+	}
+	DPRINTF(1, "compiled %u rules, %zu bytes of strings", db->nrules,
+	    db->strtab_len);
+
+	if (db->nlazy == 0) {
+		fclose(magic_file);
+		return (db);
+	}
+	/*
+	 * Room for all their descriptions, which are no longer than their
+	 * lines, so that the string table never moves under a reader.
+	 */
+	db->lazy_file = magic_file;
+	db->strtab_alloc = db->strtab_len + reserve;
+	if ((db->strtab = realloc(db->strtab, db->strtab_alloc)) == NULL)
+		err(1, "realloc");
+	DPRINTF(1, "%u rules under %u left for later", later, db->nlazy);
+
+	return (db);
+}
+
+/*
+ * Parse one line of the magic file into db. skip is the level whose
+ * continuations we're dropping, -1 if none.
+ */
+int
+df_db_line(struct df_db *db, struct df_parser *dp, char *line,
+    u_int32_t *last, int *skip)
+{
+	char		*p, **ap;
+
+	p	= line;
+	if (*p == 0 || line[strspn(line, " \t")] == '#')
+		return (0);
+	/* Break The Line !, Guano Apes rules */
+	for (ap = dp->argv; ap < &dp->argv[3] &&
+		 (*ap = df_db_token(&p)) != NULL;) {
+		if (**ap != 0)
+			ap++;
+	}
+	*ap	    = NULL;
+	/* Get the remainder of the line */
+	dp->argv[3] = p;
+	dp->argv[4] = NULL;
+	/* Convert to something meaningfull */
+	if (dp_prepare(dp) == -1) {
+		/* Continuations of a rule we dropped are meaningless */
+		if (!(dp->mflags & MF_MIME) &&
+		    (*skip == -1 || dp->mlevel <= *skip))
+			*skip = dp->mlevel;
+		return (-1);
+	}
+	if (*skip != -1 && dp->mlevel > *skip)
+		return (0);
+	*skip = -1;
+	DPRINTF(2, "%zd: %5s mlevel = %d moffset = %3lu %7s "
+	    "mtype = %d %12s",
+	    dp->lineno,
+	    dp->argv[0], dp->mlevel, dp->moffset,
+	    dp->argv[1], dp->mtype, 
+	    dp->argv[2]);
+	if (df_db_add(db, dp, last) == -1) {
+		*skip = dp->mlevel;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Like strsep(&p, " \t"), but for blanks escaped with a backslash, which
+ * are part of a string pattern.
+ */
+char *
+df_db_token(char **p)
+{
+	char		*s = *p, *e;
+
+	if (s == NULL)
+		return (NULL);
+	for (e = s; *e != 0 && *e != ' ' && *e != '\t'; e++)
+		if (*e == '\\' && e[1] != 0)
+			e++;
+	if (*e == 0)
+		*p = NULL;
+	else {
+		*e = 0;
+		*p = e + 1;
+	}
+
+	return (s);
+}
+
+/*
+ * Set aside a slot, and room for its description, for the continuation
+ * line of top level rule at off in the magic file, after lineno lines.
+ */
+void
+df_db_reserve(struct df_db *db, off_t off, size_t lineno, u_int32_t rule)
+{
+	struct df_lazy	*lz;
+
+	lz = db->nlazy > 0 ? &db->lazy[db->nlazy - 1] : NULL;
+	if (lz == NULL || lz->rule != rule) {
+		db->lazy = reallocarray(db->lazy, db->nlazy + 1,
+		    sizeof(*db->lazy));
+		if (db->lazy == NULL)
+			err(1, "reallocarray");
+		lz = &db->lazy[db->nlazy++];
+		lz->off = off;
+		lz->lineno = lineno;
+		lz->rule = rule;
+		lz->first = db->nrules;
+		lz->count = 0;
+		db->rules[rule].lazy = 1;
+	}
+	if (db->nrules == db->rules_alloc)
+		df_db_grow(db);
+	/* Unlinked until filled in, and so never tested */
+	bzero(&db->rules[db->nrules], sizeof(*db->rules));
+	db->rules[db->nrules].parent = DF_RULE_NONE;
+	db->rules[db->nrules].child = DF_RULE_NONE;
+	db->rules[db->nrules].next = DF_RULE_NONE;
+	db->nrules++;
+	lz->count++;
+}
+
+/*
+ * Note where a continuation line left for later will look in a file, if
+ * that is past the least the read plan reads anyway, so that df_db_plan()
+ * covers it as if it were loaded. The line is only looked at as far as
+ * its offset and type, and not a word is said if it's bad: that is for
+ * df_db_expand() to do. The pointer of an indirect offset is taken to be
+ * as wide as any.
+ */
+void
+df_db_peek(struct df_db *db, char *line)
+{
+	struct df_parser dp;
+	struct df_rule	 r;
+	char		*p = line, *argv[3], *cp, *ep, *mod;
+	size_t		 sz;
+	int		 n = 0;
+
+	while (n < 3 && (cp = df_db_token(&p)) != NULL)
+		if (*cp != 0)
+			argv[n++] = cp;
+	if (n < 2)
+		return;
+	bzero(&r, sizeof(r));
+	cp = argv[0] + strspn(argv[0], ">");
+	if (*cp == '(') {
+		r.mflags |= MF_INDIRECT;
+		r.itype = MT_LEDOUBLE;
+		cp++;
+	} else if (*cp == '-') {
+		r.mflags |= MF_FROMEND;
+		cp++;
+	}
+	errno = 0;
+	r.offset = strtoll(cp, &ep, strncmp(cp, "0x", 2) == 0 ? 16 : 10);
+	if (errno || ep == cp || r.offset < 0)
+		return;
+	if (r.mflags & MF_FROMEND)
+		r.offset = -r.offset;
+
+	bzero(&dp, sizeof(dp));
+	cp = argv[1];
+	if ((mod = strchr(cp, '&')) != NULL)
+		*mod = 0;
+	else if ((mod = strchr(cp, '/')) != NULL) {
+		*mod++ = 0;
+		if (dp_prepare_mstrmod(&dp, mod) == -1)
+			return;
+	}
+	if (lookup_mtype(&dp, cp) == -1)
+		return;
+	r.mtype = dp.mtype;
+	r.op = df_mtype_op(dp.mtype);
+	r.range = dp.mrange;
+	r.value.s.flags = dp.mstrflags;
+	/* Escapes only make the pattern shorter */
+	r.value.s.len = n == 3 ? strlen(argv[2]) : 0;
+
+	if (!(r.mflags & MF_FROMEND)) {
+		sz = r.mflags & MF_INDIRECT ? df_mtype_size(r.itype) :
+		    df_rule_span(&r);
+		if (r.offset + (int64_t)sz <= DF_HDRLEN)
+			return;
+	}
+	db->later = reallocarray(db->later, db->nlater + 1,
+	    sizeof(*db->later));
+	if (db->later == NULL)
+		err(1, "reallocarray");
+	db->later[db->nlater++] = r;
+}
+
+/*
+ * Compile the line just prepared in dp and hook it into the continuation
+ * tree. last[] holds the most recent rule seen on each level.
+ */
+int
+df_db_add(struct df_db *db, struct df_parser *dp, u_int32_t *last)
+{
+	struct df_rule	*r, *prev;
+	struct df_re	*re = NULL;
+	u_int32_t	 idx;
+	const char	*errstr;
+	char		*desc;
+	int		 i;
+
+	if (dp->mlevel >= DF_MAXLEVEL) {
+		warnx("too many levels at line %zd", dp->lineno);
+		return (-1);
+	}
+	if (dp->mlevel > 0 && last[dp->mlevel - 1] == DF_RULE_NONE) {
+		warnx("continuation without a parent at line %zd",
+		    dp->lineno);
+		return (-1);
+	}
+	/* Description is whatever is left, minus leading blanks */
+	desc = dp->argv[3] != NULL ? dp->argv[3] : "";
+	desc += strspn(desc, " \t");
+	/*
+	 * Expanding a lazy rule, the slots and the string table room kept
+	 * at load have to do: readers are using both. The line only won't
+	 * fit if the magic file was edited since.
+	 */
+	if (db->lazy_file != NULL && (db->fill == db->fill_end ||
+	    db->strtab_len + strlen(desc) + 1 +
+	    (DF_OP_ISSTRING(df_mtype_op(dp->mtype)) ? dp->mstrlen : 0) >
+	    db->strtab_alloc)) {
+		warnx("magic file changed under us at line %zd", dp->lineno);
+		return (-1);
+	}
+	if (dp->mtype == MT_REGEX && (re = df_re_compile(
+	    (const u_char *)dp->d_string,
+	    dp->mstrlen, dp->mstrflags & (DF_STR_LOWER | DF_STR_UPPER),
+	    &errstr)) == NULL) {
+		warnx("bad regex at line %zd: %s", dp->lineno, errstr);
+		return (-1);
+	}
+	if (db->lazy_file != NULL)
+		idx = db->fill++;
+	else {
+		if (db->nrules == db->rules_alloc)
+			df_db_grow(db);
+		idx = db->nrules++;
+	}
+	r = &db->rules[idx];
+	bzero(r, sizeof(*r));
+	r->offset     = dp->moffset;
+	if (dp->mflags & MF_FROMEND)
+		r->offset = -r->offset;
+	r->offset_adj = dp->moffset_adj;
+	r->mask	      = dp->mmask;
+	r->lineno     = dp->lineno;
+	r->test_flags = dp->test_flags;
+	r->level      = dp->mlevel;
+	r->mtype      = dp->mtype;
+	r->itype      = dp->moffset_itype;
+	r->mflags     = dp->mflags;
+	r->op	      = df_mtype_op(dp->mtype);
+	if (dp->mflags & MF_INDIRECT)
+		r->iop = df_mtype_op(dp->moffset_itype);
+	if (DF_OP_ISSTRING(r->op)) {
+		/* Both fit in the room kept for the line, checked above */
+		r->value.s.str = df_db_strtab_addn(db, dp->d_string,
+		    dp->mstrlen);
+		r->value.s.len = dp->mstrlen;
+		r->value.s.flags = dp->mstrflags;
+		r->range = dp->mrange;
+	} else if (df_mtype_float(dp->mtype))
+		r->value.d_float = dp->d_double;
+	else
+		r->value.d_num = df_mtype_trunc(dp->mtype, dp->d_quad);
+	df_rule_rel(r);
+	if (re != NULL)
+		df_db_regex(db, idx, re);
+	r->desc = df_db_strtab_add(db, desc);
+
+	/* Link into the tree */
+	r->child = r->next = DF_RULE_NONE;
+	r->parent = dp->mlevel > 0 ? last[dp->mlevel - 1] : DF_RULE_NONE;
+	if (last[dp->mlevel] != DF_RULE_NONE &&
+	    db->rules[last[dp->mlevel]].parent == r->parent) {
+		prev = &db->rules[last[dp->mlevel]];
+		prev->next = idx;
+	} else if (r->parent != DF_RULE_NONE)
+		db->rules[r->parent].child = idx;
+	last[dp->mlevel] = idx;
+	for (i = dp->mlevel + 1; i < DF_MAXLEVEL; i++)
+		last[i] = DF_RULE_NONE;
+
+	return (0);
+}
+
+/*
+ * Make room for more rules, and for their regexes if there are any.
+ */
+void
+df_db_grow(struct df_db *db)
+{
+	u_int32_t	 n = db->rules_alloc;
+
+	db->rules_alloc = n ? n * 2 : 256;
+	db->rules = reallocarray(db->rules, db->rules_alloc,
+	    sizeof(*db->rules));
+	if (db->rules == NULL)
+		err(1, "reallocarray");
+	if (db->re == NULL)
+		return;
+	if ((db->re = reallocarray(db->re, db->rules_alloc,
+	    sizeof(*db->re))) == NULL)
+		err(1, "reallocarray");
+	bzero(db->re + n, (db->rules_alloc - n) * sizeof(*db->re));
+}
+
+/*
+ * Keep the compiled pattern of regex rule idx. Rules don't move once
+ * loaded, nor does db->re, so that of a lazily loaded one can be added
+ * while others are being tested.
+ */
+void
+df_db_regex(struct df_db *db, u_int32_t idx, struct df_re *re)
+{
+	if (db->re == NULL && (db->re = calloc(MAX(db->rules_alloc,
+	    db->nrules), sizeof(*db->re))) == NULL)
+		err(1, "calloc");
+	db->re[idx] = re;
+}
+
+/*
+ * Compile the continuations of the lazily loaded top level rule idx into
+ * the slots kept for them, once. Then let readers see they're there.
+ */
+void
+df_db_expand(struct df_db *db, u_int32_t idx)
+{
+	struct df_rule	*r = &db->rules[idx];
+	struct df_lazy	 key, *lz;
+	struct df_parser dp;
+	u_int32_t	 last[DF_MAXLEVEL], n;
+	size_t		 linelen;
+	char		*line;
+	int		 skip = -1, i;
+
+	pthread_mutex_lock(&db->lazy_lock);
+	if (!r->lazy)
+		goto done;
+	key.rule = idx;
+	lz = bsearch(&key, db->lazy, db->nlazy, sizeof(*db->lazy),
+	    df_lazy_cmp);
+	if (lz == NULL || fseeko(db->lazy_file, lz->off, SEEK_SET) == -1) {
+		warn("magic file");
+		goto done;
+	}
+	for (i = 0; i < DF_MAXLEVEL; i++)
+		last[i] = DF_RULE_NONE;
+	last[0] = idx;
+	bzero(&dp, sizeof(dp));
+	dp.magic_file = db->lazy_file;
+	dp.level      = -1;
+	dp.lineno     = lz->lineno;
+	db->fill = lz->first;
+	db->fill_end = lz->first + lz->count;
+	/* What's between them is comments and mime, as it was at load */
+	for (n = 0; n < lz->count; ) {
+		if ((line = fparseln(db->lazy_file, &linelen, &dp.lineno,
+		    df_db_delim, 0)) == NULL) {
+			if (ferror(db->lazy_file) || feof(db->lazy_file)) {
+				warnx("magic file changed under us");
+				break;
+			}
+			continue;
+		}
+		if (line[strspn(line, " \t")] == '>') {
+			df_db_line(db, &dp, line, last, &skip);
+			n++;
+		}
+		free(line);
+	}
+	DPRINTF(2, "expanded rule at line %u into %u rules", r->lineno,
+	    db->fill - lz->first);
+	db->fill = db->fill_end = 0;
+done:
+	__atomic_store_n(&r->lazy, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&db->lazy_lock);
+}
+
+int
+df_lazy_cmp(const void *a, const void *b)
+{
+	const struct df_lazy	*la = a, *lb = b;
+
+	if (la->rule != lb->rule)
+		return (la->rule < lb->rule ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Copy a string into the db string table, return its offset there.
+ */
+u_int32_t
+df_db_strtab_add(struct df_db *db, const char *str)
+{
+	return (df_db_strtab_addn(db, str, strlen(str) + 1));
+}
+
+/*
+ * Copy len bytes into the db string table, return their offset there.
+ */
+u_int32_t
+df_db_strtab_addn(struct df_db *db, const void *str, size_t len)
+{
+	size_t		 off;
+
+	while (db->strtab_len + len > db->strtab_alloc) {
+		db->strtab_alloc = db->strtab_alloc ?
+		    db->strtab_alloc * 2 : 4096;
+		if ((db->strtab = realloc(db->strtab,
+		    db->strtab_alloc)) == NULL)
+			err(1, "realloc");
+	}
+	off = db->strtab_len;
+	memcpy(db->strtab + off, str, len);
+	db->strtab_len += len;
+
+	return ((u_int32_t)off);
+}
+
+void
+df_db_free(struct df_db *db)
+{
+	u_int32_t	 i;
+
+	if (db == NULL)
+		return;
+	df_arena_free(&db->arena);
+	if (db->re != NULL)
+		for (i = 0; i < db->nrules; i++)
+			df_re_free(db->re[i]);
+	free(db->re);
+	if (db->lazy_file != NULL)
+		fclose(db->lazy_file);
+	free(db->lazy);
+	free(db->later);
+	pthread_mutex_destroy(&db->lazy_lock);
+	if (db->map != NULL)
+		munmap(db->map, db->maplen);
+	else {
+		free(db->rules);
+		free(db->strtab);
+	}
+	free(db);
+}
+
+/*
+ * Write db out as an image that df_db_map() can use. src is the stat of
+ * the text magic file it came from. The image is written aside and renamed
+ * into place so that nobody maps a half written one.
+ */
+int
+df_db_write(struct df_db *db, const char *path, struct stat *src)
+{
+	struct df_db_header	 dh;
+	char			 tmp[MAXPATHLEN];
+	char			 pad[8];
+	size_t			 npad;
+	FILE			*f;
+	int			 fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXXXXXX", path) >=
+	    (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		warn("%s", path);
+		return (-1);
+	}
+	if ((fd = mkstemp(tmp)) == -1) {
+		warn("mkstemp: %s", tmp);
+		return (-1);
+	}
+	if ((f = fdopen(fd, "w")) == NULL) {
+		warn("fdopen: %s", tmp);
+		close(fd);
+		unlink(tmp);
+		return (-1);
+	}
+
+	bzero(&dh, sizeof(dh));
+	bzero(pad, sizeof(pad));
+	dh.dh_magic	    = DF_DB_MAGIC;
+	dh.dh_version	    = DF_DB_VERSION;
+	dh.dh_rule_size	    = sizeof(struct df_rule);
+	dh.dh_nrules	    = db->nrules;
+	dh.dh_rules_off	    = sizeof(dh);
+	dh.dh_strtab_off    = dh.dh_rules_off +
+	    (u_int64_t)db->nrules * sizeof(struct df_rule);
+	dh.dh_strtab_len    = db->strtab_len;
+	dh.dh_src_size	    = src->st_size;
+	dh.dh_src_mtime	    = src->st_mtim.tv_sec;
+	dh.dh_src_mtime_nsec = src->st_mtim.tv_nsec;
+	/* Keep the rules 8 byte aligned */
+	npad = (8 - sizeof(dh) % 8) % 8;
+	dh.dh_rules_off += npad;
+	dh.dh_strtab_off += npad;
+
+	if (fwrite(&dh, sizeof(dh), 1, f) != 1 ||
+	    fwrite(pad, 1, npad, f) != npad ||
+	    fwrite(db->rules, sizeof(struct df_rule), db->nrules, f) !=
+	    db->nrules ||
+	    fwrite(db->strtab, 1, db->strtab_len, f) != db->strtab_len) {
+		warn("write: %s", tmp);
+		goto fail;
+	}
+	if (fchmod(fd, 0444) == -1) {
+		warn("fchmod: %s", tmp);
+		goto fail;
+	}
+	if (fclose(f) == EOF) {
+		f = NULL;
+		warn("close: %s", tmp);
+		goto fail;
+	}
+	if (rename(tmp, path) == -1) {
+		warn("rename: %s", path);
+		unlink(tmp);
+		return (-1);
+	}
+
+	return (0);
+fail:
+	if (f != NULL)
+		fclose(f);
+	unlink(tmp);
+	return (-1);
+}
+
+/*
+ * Map the compiled image of magic file path, src being the stat of the
+ * latter. Returns NULL if there is no image or it can't be trusted, in
+ * which case the caller should fall back to the text file.
+ */
+struct df_db *
+df_db_map(const char *path, struct stat *src)
+{
+	struct df_db_header	 dh;
+	struct df_db		*db;
+	struct df_rule		*r;
+	struct df_re		*re;
+	struct stat		 sb;
+	const char		*errstr;
+	char			 img[MAXPATHLEN];
+	void			*map;
+	u_int32_t		 i;
+	int			 fd;
+
+	if (snprintf(img, sizeof(img), "%s%s", path, DF_DB_SUFFIX) >=
+	    (int)sizeof(img))
+		return (NULL);
+	if ((fd = open(img, O_RDONLY)) == -1)
+		return (NULL);
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(dh) ||
+	    (map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+	    MAP_FAILED) {
+		close(fd);
+		return (NULL);
+	}
+	close(fd);
+	memcpy(&dh, map, sizeof(dh));
+
+	if (dh.dh_magic != DF_DB_MAGIC) {
+		DPRINTF(1, "%s: bad magic or foreign byte order", img);
+		goto bad;
+	}
+	if (dh.dh_version != DF_DB_VERSION ||
+	    dh.dh_rule_size != sizeof(struct df_rule)) {
+		DPRINTF(1, "%s: version %u, want %u", img, dh.dh_version,
+		    DF_DB_VERSION);
+		goto bad;
+	}
+	if (dh.dh_src_size != src->st_size ||
+	    dh.dh_src_mtime != src->st_mtim.tv_sec ||
+	    dh.dh_src_mtime_nsec != src->st_mtim.tv_nsec) {
+		DPRINTF(1, "%s: stale, %s has changed", img, path);
+		goto bad;
+	}
+	if (dh.dh_rules_off % 8 != 0 ||
+	    dh.dh_rules_off + (u_int64_t)dh.dh_nrules *
+	    sizeof(struct df_rule) > dh.dh_strtab_off ||
+	    dh.dh_strtab_off + dh.dh_strtab_len != (u_int64_t)sb.st_size ||
+	    (dh.dh_strtab_len != 0 && ((char *)map)[sb.st_size - 1] != 0)) {
+		warnx("%s: corrupt image", img);
+		goto bad;
+	}
+
+	if ((db = calloc(1, sizeof(*db))) == NULL)
+		err(1, "calloc");
+	db->map	       = map;
+	db->maplen     = sb.st_size;
+	db->rules      = (struct df_rule *)((char *)map + dh.dh_rules_off);
+	db->nrules     = dh.dh_nrules;
+	db->strtab     = (char *)map + dh.dh_strtab_off;
+	db->strtab_len = dh.dh_strtab_len;
+	/* Don't let a damaged image send us wandering */
+	for (i = 0; i < db->nrules; i++) {
+		r = &db->rules[i];
+		if ((r->parent != DF_RULE_NONE && r->parent >= i) ||
+		    (r->child != DF_RULE_NONE &&
+		    (r->child <= i || r->child >= db->nrules)) ||
+		    (r->next != DF_RULE_NONE &&
+		    (r->next <= i || r->next >= db->nrules)) ||
+		    r->desc >= db->strtab_len || r->lazy ||
+		    r->op >= DF_OP_MAX || r->iop >= DF_OP_MAX ||
+		    (DF_OP_ISSTRING(r->op) && (u_int64_t)r->value.s.str +
+		    r->value.s.len > db->strtab_len)) {
+			warnx("%s: corrupt rule %u", img, i);
+			db->map = NULL;
+			free(db);
+			goto bad;
+		}
+	}
+	pthread_mutex_init(&db->lazy_lock, NULL);
+	/* The image only has the source of a regex */
+	for (i = 0; i < db->nrules; i++) {
+		r = &db->rules[i];
+		if (r->op != DF_OP_REGEX)
+			continue;
+		if ((re = df_re_compile((const u_char *)db->strtab +
+		    r->value.s.str, r->value.s.len,
+		    r->value.s.flags & (DF_STR_LOWER | DF_STR_UPPER),
+		    &errstr)) == NULL) {
+			warnx("%s: bad regex in rule %u: %s", img, i, errstr);
+			df_db_free(db);
+			return (NULL);
+		}
+		df_db_regex(db, i, re);
+	}
+	DPRINTF(1, "mapped %u rules from %s", db->nrules, img);
+
+	return (db);
+bad:
+	munmap(map, sb.st_size);
+	return (NULL);
+}
+
+/*
+ * Compile the text magic file at path into its image (-C).
+ */
+int
+df_db_compile(const char *path)
+{
+	struct df_db	*db;
+	struct stat	 sb;
+	FILE		*magic_file;
+	char		 img[MAXPATHLEN];
+	int		 ret;
+
+	if ((magic_file = fopen(path, "r")) == NULL) {
+		warn("%s", path);
+		return (-1);
+	}
+	if (fstat(fileno(magic_file), &sb) == -1) {
+		warn("fstat: %s", path);
+		fclose(magic_file);
+		return (-1);
+	}
+	if ((db = df_db_load(magic_file, 0)) == NULL)
+		return (-1);
+	if (snprintf(img, sizeof(img), "%s%s", path, DF_DB_SUFFIX) >=
+	    (int)sizeof(img)) {
+		errno = ENAMETOOLONG;
+		warn("%s", path);
+		df_db_free(db);
+		return (-1);
+	}
+	ret = df_db_write(db, img, &sb);
+	df_db_free(db);
+
+	return (ret);
+}
+
+/*
+ * XXH64, fast enough to hash every header we read.
+ */
+#define XXH_P1		0x9e3779b185ebca87ULL
+#define XXH_P2		0xc2b2ae3d27d4eb4fULL
+#define XXH_P3		0x165667b19e3779f9ULL
+#define XXH_P4		0x85ebca77c2b2ae63ULL
+#define XXH_P5		0x27d4eb2f165667c5ULL
+#define XXH_ROTL(x, r)	((x) << (r) | (x) >> (64 - (r)))
+#define XXH_ROUND(acc, in)						\
+	((acc) = XXH_ROTL((acc) + (in) * XXH_P2, 31) * XXH_P1)
+#define XXH_LE64(p)	((u_int64_t)XXH_LE32((p) + 4) << 32 | XXH_LE32(p))
+#define XXH_LE32(p)	((u_int32_t)(p)[3] << 24 | (u_int32_t)(p)[2] << 16 | \
+			    (u_int32_t)(p)[1] << 8 | (p)[0])
+
+u_int64_t
+df_hash64(const void *buf, size_t len, u_int64_t seed)
+{
+	const u_char	*p = buf, *end = p + len;
+	u_int64_t	 v[4], h, k;
+	int		 i;
+
+	if (len >= 32) {
+		v[0] = seed + XXH_P1 + XXH_P2;
+		v[1] = seed + XXH_P2;
+		v[2] = seed;
+		v[3] = seed - XXH_P1;
+		for (; end - p >= 32; p += 32)
+			for (i = 0; i < 4; i++)
+				XXH_ROUND(v[i], XXH_LE64(p + i * 8));
+		h = XXH_ROTL(v[0], 1) + XXH_ROTL(v[1], 7) +
+		    XXH_ROTL(v[2], 12) + XXH_ROTL(v[3], 18);
+		for (i = 0; i < 4; i++) {
+			k = 0;
+			XXH_ROUND(k, v[i]);
+			h = (h ^ k) * XXH_P1 + XXH_P4;
+		}
+	} else
+		h = seed + XXH_P5;
+	h += len;
+
+	for (; end - p >= 8; p += 8) {
+		k = 0;
+		XXH_ROUND(k, XXH_LE64(p));
+		h = XXH_ROTL(h ^ k, 27) * XXH_P1 + XXH_P4;
+	}
+	if (end - p >= 4) {
+		h = XXH_ROTL(h ^ XXH_LE32(p) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for (; p < end; p++)
+		h = XXH_ROTL(h ^ *p * XXH_P5, 11) * XXH_P1;
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+
+	return (h);
+}
+
+/*
+ * Something that changes whenever the rules in db do, however they were
+ * loaded, as long as it was whole: a lazily loaded db has rules yet to
+ * come.
+ */
+u_int64_t
+df_db_fingerprint(const struct df_db *db)
+{
+	u_int64_t	 h = 0;
+
+	h = df_hash64(&db->nrules, sizeof(db->nrules), h);
+	h = df_hash64(db->rules, db->nrules * sizeof(*db->rules), h);
+	h = df_hash64(db->strtab, db->strtab_len, h);
+
+	return (h);
+}
+
+/*
+ * Can r be found through the index? Only plain equality tests against a
+ * constant at a constant offset qualify.
+ */
+int
+df_index_keyable(const struct df_rule *r)
+{
+	if (r->mflags & (MF_INDIRECT | MF_MASK | MF_FROMEND))
+		return (0);
+	if ((r->test_flags & ~DF_TEST_PFX_EQ) != 0)
+		return (0);
+	if (df_mtype_float(r->mtype) || df_mtype_size(r->mtype) == 0)
+		return (0);
+
+	return (1);
+}
+
+/*
+ * Can r go in a lane? Equality tests against a constant at a constant
+ * offset can, masked or not, if their value fits in one.
+ */
+int
+df_index_laneable(const struct df_rule *r)
+{
+	size_t		 w;
+
+	if (r->mflags & (MF_INDIRECT | MF_FROMEND))
+		return (0);
+	if ((r->test_flags & ~DF_TEST_PFX_EQ) != 0)
+		return (0);
+	if (df_mtype_float(r->mtype))
+		return (0);
+	w = df_mtype_size(r->mtype);
+
+	return (w > 0 && w <= sizeof(u_int32_t));
+}
+
+/* Sort rule positions ascending */
+int
+df_index_pos_cmp(const void *a, const void *b)
+{
+	u_int32_t	 pa = *(const u_int32_t *)a, pb = *(const u_int32_t *)b;
+
+	return (pa < pb ? -1 : pa > pb);
+}
+
+/* Sort probes by descending number of rules */
+int
+df_index_probe_cmp(const void *a, const void *b)
+{
+	const u_int32_t	*pa = a, *pb = b;
+
+	/* [0] is the count, [1] the probe slot */
+	if (pa[0] != pb[0])
+		return (pa[0] < pb[0] ? 1 : -1);
+	return (pa[1] < pb[1] ? -1 : pa[1] > pb[1]);
+}
+
+/* Sort (key, rule) pairs by key, then rule */
+int
+df_index_key_cmp(const void *a, const void *b)
+{
+	const u_int64_t	*ka = a, *kb = b;
+
+	if (ka[0] != kb[0])
+		return (ka[0] < kb[0] ? -1 : 1);
+	return (ka[1] < kb[1] ? -1 : ka[1] > kb[1]);
+}
+
+#define DF_INDEX_HASH(k, n)	\
+	((u_int32_t)(((k) * 0x9e3779b97f4a7c15ULL) >> 32) & ((n) - 1))
+
+/*
+ * Can no file match both a and b? True of two plain equality tests that
+ * want different bytes in the same place.
+ */
+int
+df_rule_exclusive(const struct df_rule *a, const struct df_rule *b)
+{
+	u_char		 ba[8], bb[8];
+	int64_t		 off, end;
+	size_t		 wa, wb;
+
+	if (!df_index_keyable(a) || !df_index_keyable(b))
+		return (0);
+	wa = df_rule_bytes(a, ba);
+	wb = df_rule_bytes(b, bb);
+	off = MAX(a->offset, b->offset);
+	end = MIN(a->offset + (int64_t)wa, b->offset + (int64_t)wb);
+	for (; off < end; off++)
+		if (ba[off - a->offset] != bb[off - b->offset])
+			return (1);
+
+	return (0);
+}
+
+/*
+ * Move the top level rules in order[] that hits says match most often
+ * ahead of the rules before them, for as long as those could never have
+ * matched the same file. Which rule says something first about a file
+ * doesn't change, it just gets found sooner.
+ */
+void
+df_index_reorder(struct df_db *db, u_int32_t *order, u_int32_t n,
+    const u_int64_t *hits)
+{
+	u_int64_t	(*hot)[2];
+	u_char		*placed;
+	u_int32_t	 nhot = 0, idx, i, p, q;
+
+	if ((hot = calloc(n + 1, sizeof(*hot))) == NULL ||
+	    (placed = calloc(db->nrules, 1)) == NULL)
+		err(1, "calloc");
+	/* Hottest first, ties in db order */
+	for (i = 0; i < n; i++)
+		if (hits[order[i]] > 0) {
+			hot[nhot][0] = ~hits[order[i]];
+			hot[nhot++][1] = order[i];
+		}
+	qsort(hot, nhot, sizeof(*hot), df_index_key_cmp);
+
+	for (i = 0; i < nhot; i++) {
+		idx = hot[i][1];
+		for (p = 0; order[p] != idx; p++)
+			;
+		/* Never past a hotter one, it was put where it is */
+		for (q = p; q > 0 && !placed[order[q - 1]] &&
+		    df_rule_exclusive(&db->rules[order[q - 1]],
+		    &db->rules[idx]); q--)
+			;
+		memmove(order + q + 1, order + q, (p - q) * sizeof(*order));
+		order[q] = idx;
+		placed[idx] = 1;
+		DPRINTF(2, "order: line %u (%llu hits) from %u to %u",
+		    db->rules[idx].lineno, (unsigned long long)~hot[i][0], p,
+		    q);
+	}
+
+	free(hot);
+	free(placed);
+}
+
+/*
+ * Build the top level dispatch index of db, ordered by hits (the number
+ * of times each rule matched in some earlier run) if not NULL.
+ */
+void
+df_db_index(struct df_db *db, const u_int64_t *hits)
+{
+	struct df_index		*ix;
+	struct df_rule		*r;
+	struct df_probe		*probes = NULL;
+	struct df_bucket	*b;
+	u_int32_t		*pcount = NULL, (*order)[2] = NULL;
+	u_int64_t		(*keys)[2] = NULL;
+	u_int32_t		 fill[256];
+	u_int32_t		 nprobes = 0, nkeys = 0, nb0 = 0, idx, i, j;
+	u_int32_t		 vb, w, h, pos, *lits = NULL, nlits = 0;
+	u_int32_t		*spare = NULL, nspare = 0;
+	u_char			 bytes[8], key[DF_AC_KEYLEN];
+
+	ix = df_arena_calloc(&db->arena, 1, sizeof(*ix));
+	db->index = ix;
+	if (db->nrules == 0)
+		return;
+
+	/* The order the top level rules get tested in */
+	ix->order = df_arena_calloc(&db->arena, db->nrules,
+	    sizeof(*ix->order));
+	for (idx = 0; idx != DF_RULE_NONE; idx = db->rules[idx].next)
+		ix->order[ix->norder++] = idx;
+	if (hits != NULL)
+		df_index_reorder(db, ix->order, ix->norder, hits);
+
+	/* Count what goes where, gathering the distinct probes */
+	for (pos = 0; pos < ix->norder; pos++) {
+		r = &db->rules[ix->order[pos]];
+		if (!df_index_keyable(r))
+			continue;
+		(void)df_rule_bytes(r, bytes);
+		if (r->offset == 0) {
+			ix->byte0[bytes[0] + 1]++;
+			nb0++;
+			continue;
+		}
+		w = MIN(df_mtype_size(r->mtype), sizeof(vb));
+		for (i = 0; i < nprobes; i++)
+			if (probes[i].offset == r->offset &&
+			    probes[i].width == w)
+				break;
+		if (i == nprobes) {
+			probes = reallocarray(probes, nprobes + 1,
+			    sizeof(*probes));
+			pcount = reallocarray(pcount, nprobes + 1,
+			    sizeof(*pcount));
+			if (probes == NULL || pcount == NULL)
+				err(1, "reallocarray");
+			probes[i].offset = r->offset;
+			probes[i].width = w;
+			pcount[i] = 0;
+			nprobes++;
+		}
+		pcount[i]++;
+	}
+
+	/* Keep the busiest probes, the rest is tested unconditionally */
+	if (nprobes > 0) {
+		if ((order = calloc(nprobes, sizeof(*order))) == NULL)
+			err(1, "calloc");
+		for (i = 0; i < nprobes; i++) {
+			order[i][0] = pcount[i];
+			order[i][1] = i;
+		}
+		qsort(order, nprobes, sizeof(*order), df_index_probe_cmp);
+	}
+	for (i = 0; i < nprobes && i < DF_INDEX_MAXPROBE; i++) {
+		ix->probes[i] = probes[order[i][1]];
+		nkeys += order[i][0];
+	}
+	ix->nprobes = i;
+
+	/* Fill in the lists, all in test order */
+	for (i = 1; i < 257; i++)
+		ix->byte0[i] += ix->byte0[i - 1];
+	memcpy(fill, ix->byte0, sizeof(fill));
+	if ((keys = calloc(nkeys + 1, sizeof(*keys))) == NULL)
+		err(1, "calloc");
+	ix->byte0_rules = df_arena_calloc(&db->arena, nb0 + 1,
+	    sizeof(*ix->byte0_rules));
+	ix->bucket_rules = df_arena_calloc(&db->arena, nkeys + 1,
+	    sizeof(*ix->bucket_rules));
+	ix->always = df_arena_calloc(&db->arena, db->nrules,
+	    sizeof(*ix->always));
+	if ((lits = calloc(ix->norder, sizeof(*lits))) == NULL ||
+	    (spare = calloc(ix->norder, sizeof(*spare))) == NULL)
+		err(1, "calloc");
+	nkeys = 0;
+	for (pos = 0; pos < ix->norder; pos++) {
+		r = &db->rules[ix->order[pos]];
+		if (df_index_literal(db, r, key) > 0) {
+			lits[nlits++] = pos;
+			continue;
+		}
+		if (!df_index_keyable(r)) {
+			if (df_index_laneable(r))
+				spare[nspare++] = pos;
+			else
+				ix->always[ix->nalways++] = pos;
+			continue;
+		}
+		(void)df_rule_bytes(r, bytes);
+		if (r->offset == 0) {
+			ix->byte0_rules[fill[bytes[0]]++] = pos;
+			continue;
+		}
+		w = MIN(df_mtype_size(r->mtype), sizeof(vb));
+		for (i = 0; i < ix->nprobes; i++)
+			if (ix->probes[i].offset == r->offset &&
+			    ix->probes[i].width == w)
+				break;
+		if (i == ix->nprobes) {
+			if (df_index_laneable(r))
+				spare[nspare++] = pos;
+			else
+				ix->always[ix->nalways++] = pos;
+			continue;
+		}
+		vb = 0;
+		memcpy(&vb, bytes, w);
+		keys[nkeys][0] = (u_int64_t)i << 32 | vb;
+		keys[nkeys][1] = pos;
+		nkeys++;
+	}
+
+	/* Hash the probe keys, each bucket is a run of rules in order */
+	qsort(keys, nkeys, sizeof(*keys), df_index_key_cmp);
+	for (ix->nbuckets = 16; ix->nbuckets < nkeys * 2; ix->nbuckets *= 2)
+		;
+	ix->buckets = df_arena_calloc(&db->arena, ix->nbuckets,
+	    sizeof(*ix->buckets));
+	for (i = 0; i < nkeys; i = j) {
+		for (j = i; j < nkeys && keys[j][0] == keys[i][0]; j++)
+			ix->bucket_rules[j] = keys[j][1];
+		h = DF_INDEX_HASH(keys[i][0], ix->nbuckets);
+		while (ix->buckets[h].count != 0)
+			h = (h + 1) & (ix->nbuckets - 1);
+		b = &ix->buckets[h];
+		b->key = keys[i][0];
+		b->start = i;
+		b->count = j - i;
+	}
+	if (nlits > 0)
+		df_ac_build(db, lits, nlits);
+	df_index_lanes(db, spare, nspare);
+	DPRINTF(1, "index: %u at offset 0, %u in %u probes, %u literals, "
+	    "%u lanes, %u always", nb0, nkeys, ix->nprobes, nlits,
+	    ix->nlanes, ix->nalways);
+
+	free(probes);
+	free(pcount);
+	free(order);
+	free(keys);
+	free(lits);
+	free(spare);
+}
+
+/*
+ * Pack the n rules at the positions in spare into lanes, by offset and
+ * type, where enough of them share one to make that worth it. The most
+ * shared go first; whatever is left over is always tested.
+ */
+void
+df_index_lanes(struct df_db *db, const u_int32_t *spare, u_int32_t n)
+{
+	struct df_index		*ix = db->index;
+	struct df_rule		*r;
+	struct df_lanes		*g;
+	u_int64_t		(*keys)[2];
+	u_int32_t		(*runs)[2], nruns = 0, wmask, i, j, k, m;
+	size_t			 w;
+
+	ix->lanes = df_arena_calloc(&db->arena, DF_INDEX_MAXLANES,
+	    sizeof(*ix->lanes));
+	if ((keys = calloc(n + 1, sizeof(*keys))) == NULL ||
+	    (runs = calloc(n + 1, sizeof(*runs))) == NULL)
+		err(1, "calloc");
+	/* Offset, then type and position, so each kind is a run in order */
+	for (i = 0; i < n; i++) {
+		r = &db->rules[ix->order[spare[i]]];
+		keys[i][0] = r->offset;
+		keys[i][1] = (u_int64_t)r->op << 32 | spare[i];
+	}
+	qsort(keys, n, sizeof(*keys), df_index_key_cmp);
+	for (i = 0; i < n; i = j) {
+		for (j = i; j < n && keys[j][0] == keys[i][0] &&
+		    keys[j][1] >> 32 == keys[i][1] >> 32; j++)
+			;
+		runs[nruns][0] = j - i;
+		runs[nruns++][1] = i;
+	}
+	qsort(runs, nruns, sizeof(*runs), df_index_probe_cmp);
+
+	for (k = 0, g = NULL; k < nruns; k++) {
+		for (i = runs[k][1], j = 0; j < runs[k][0]; i++, j++) {
+			r = &db->rules[ix->order[(u_int32_t)keys[i][1]]];
+			w = df_mtype_size(r->mtype);
+			if (j % DF_LANES_MAX == 0)
+				g = runs[k][0] >= DF_LANES_MIN &&
+				    ix->nlanes < DF_INDEX_MAXLANES ?
+				    &ix->lanes[ix->nlanes++] : NULL;
+			if (g == NULL) {
+				ix->always[ix->nalways++] = keys[i][1];
+				continue;
+			}
+			if (g->n == 0) {
+				g->offset = r->offset;
+				g->op = r->op;
+				g->width = w;
+				g->mask = df_arena_calloc(&db->arena,
+				    DF_LANES_MAX, sizeof(*g->mask));
+				g->value = df_arena_calloc(&db->arena,
+				    DF_LANES_MAX, sizeof(*g->value));
+				g->rules = df_arena_calloc(&db->arena,
+				    DF_LANES_MAX, sizeof(*g->rules));
+				for (m = 0; m < DF_LANES_MAX; m++)
+					g->value[m] = 1;
+			}
+			wmask = w == sizeof(wmask) ? ~0U : (1U << (w * 8)) - 1;
+			g->mask[g->n] = r->mask & wmask;
+			g->value[g->n] = r->value.d_num & wmask;
+			g->rules[g->n++] = keys[i][1];
+		}
+	}
+	/* What didn't make it in came after the rest */
+	qsort(ix->always, ix->nalways, sizeof(*ix->always), df_index_pos_cmp);
+	for (k = 0; k < ix->nlanes; k++)
+		DPRINTF(2, "lanes: %u rules at offset %lld, op %u",
+		    ix->lanes[k].n, (long long)ix->lanes[k].offset,
+		    ix->lanes[k].op);
+
+	free(keys);
+	free(runs);
+}
+
+/*
+ * Load the value the rules in the lanes of g look at from src, and point
+ * l at the positions of those it may match, in order. What that takes
+ * comes out of arena a.
+ */
+void
+df_lanes_scan(const struct df_lanes *g, struct df_source *src,
+    struct df_arena *a, struct df_cursor *l)
+{
+	const u_char	*p;
+	u_int64_t	 bits;
+	u_int32_t	*found;
+
+	l->n = 0;
+	if ((p = df_source_get(src, g->offset, g->width)) == NULL)
+		return;
+	bits = df_lanes_eq(g->mask, g->value, roundup(g->n, DF_LANES_PAD),
+	    df_op_load(g->op, p));
+	if (bits == 0)
+		return;
+	found = df_arena_alloc(a, __builtin_popcountll(bits) * sizeof(*found));
+	for (; bits != 0; bits &= bits - 1)
+		found[l->n++] = g->rules[__builtin_ctzll(bits)];
+	l->rules = found;
+}
+
+const struct df_bucket *
+df_index_lookup(const struct df_index *ix, u_int64_t key)
+{
+	const struct df_bucket	*b;
+	u_int32_t		 h;
+
+	h = DF_INDEX_HASH(key, ix->nbuckets);
+	for (;;) {
+		b = &ix->buckets[h];
+		if (b->count == 0)
+			return (NULL);
+		if (b->key == key)
+			return (b);
+		h = (h + 1) & (ix->nbuckets - 1);
+	}
+}
+
+/*
+ * Can r be found through the automaton? If so, put what it is found by in
+ * key and return how many bytes that is, otherwise return 0. Only plain
+ * equality tests at a constant offset qualify, if what they look at is in
+ * the window every file gets read with.
+ */
+size_t
+df_index_literal(const struct df_db *db, const struct df_rule *r,
+    u_char *key)
+{
+	const u_char	*pat;
+	size_t		 n;
+
+	if (!DF_OP_ISSTRING(r->op) || r->op == DF_OP_REGEX ||
+	    (r->mflags & (MF_INDIRECT | MF_FROMEND)))
+		return (0);
+	if ((r->test_flags & ~DF_TEST_PFX_EQ) != 0)
+		return (0);
+	if (r->offset > DF_HDRLEN ||
+	    df_rule_span(r) > (size_t)(DF_HDRLEN - r->offset))
+		return (0);
+	pat = (const u_char *)db->strtab + r->value.s.str;
+	for (n = 0; n < r->value.s.len && n < DF_AC_KEYLEN; n++) {
+		if ((r->value.s.flags & (DF_STR_COMPACT | DF_STR_BLANKS)) &&
+		    isspace(pat[n]))
+			break;
+		key[n] = tolower(pat[n]);
+	}
+
+	return (n);
+}
+
+/*
+ * Build the automaton over the top level rules at the nlits positions in
+ * lits, all of which df_index_literal() takes.
+ */
+void
+df_ac_build(struct df_db *db, const u_int32_t *lits, u_int32_t nlits)
+{
+	struct df_ac		*ac;
+	struct df_ac_lit	*lit;
+	const struct df_rule	*r;
+	u_int32_t		*delta, *fail, *queue, *end, *fill;
+	u_int32_t		 nc, max = 1, k, s, t, a, qh = 0, qt = 0;
+	u_char			 key[DF_AC_KEYLEN];
+	size_t			 len, i;
+	int			 c, used[256];
+
+	ac = df_arena_calloc(&db->arena, 1, sizeof(*ac));
+	db->index->ac = ac;
+	ac->lits = df_arena_calloc(&db->arena, nlits, sizeof(*ac->lits));
+	ac->nlits = nlits;
+
+	/* A class for each byte the keys have, 0 for all the others */
+	bzero(used, sizeof(used));
+	for (k = 0; k < nlits; k++) {
+		lit = &ac->lits[k];
+		r = &db->rules[db->index->order[lits[k]]];
+		len = df_index_literal(db, r, key);
+		lit->pos = lits[k];
+		lit->len = len;
+		lit->lo = r->offset;
+		lit->hi = r->offset;
+		if (r->op == DF_OP_SEARCH && r->range > 0)
+			lit->hi += r->range - 1;
+		ac->end = MAX(ac->end, (size_t)lit->hi + len);
+		for (i = 0; i < len; i++)
+			used[key[i]] = 1;
+		max += len;
+	}
+	for (nc = 1, c = 0; c < 256; c++)
+		if (used[c])
+			used[c] = nc++;
+	for (c = 0; c < 256; c++)
+		ac->classes[c] = used[tolower(c)];
+	ac->nclasses = nc;
+
+	/* The trie of the keys, 0 for no edge as nothing goes to the root */
+	if ((delta = calloc((size_t)max * nc, sizeof(*delta))) == NULL ||
+	    (fail = calloc(max, sizeof(*fail))) == NULL ||
+	    (queue = calloc(max, sizeof(*queue))) == NULL ||
+	    (end = calloc(nlits, sizeof(*end))) == NULL ||
+	    (fill = calloc(max + 1, sizeof(*fill))) == NULL)
+		err(1, "calloc");
+	ac->nstates = 1;
+	for (k = 0; k < nlits; k++) {
+		len = df_index_literal(db,
+		    &db->rules[db->index->order[lits[k]]], key);
+		for (s = 0, i = 0; i < len; i++) {
+			a = ac->classes[key[i]];
+			if (delta[s * nc + a] == 0)
+				delta[s * nc + a] = ac->nstates++;
+			s = delta[s * nc + a];
+		}
+		end[k] = s;
+		fill[s + 1]++;
+	}
+
+	/*
+	 * Breadth first, fill in the missing edges with where the longest
+	 * suffix that is also in the trie goes, and work out which keys end
+	 * in each state: its own and those of that suffix.
+	 */
+	for (a = 0; a < nc; a++)
+		if ((t = delta[a]) != 0)
+			queue[qt++] = t;
+	while (qh < qt) {
+		s = queue[qh++];
+		for (a = 0; a < nc; a++) {
+			t = delta[s * nc + a];
+			if (t == 0)
+				delta[s * nc + a] = delta[fail[s] * nc + a];
+			else {
+				fail[t] = delta[fail[s] * nc + a];
+				queue[qt++] = t;
+			}
+		}
+	}
+	ac->delta = df_arena_calloc(&db->arena, (size_t)ac->nstates * nc,
+	    sizeof(*ac->delta));
+	memcpy(ac->delta, delta, (size_t)ac->nstates * nc * sizeof(*delta));
+	ac->out = df_arena_calloc(&db->arena, ac->nstates + 1,
+	    sizeof(*ac->out));
+	for (k = 0; k < qt; k++) {
+		s = queue[k];
+		fill[s + 1] += fill[fail[s] + 1];
+	}
+	for (s = 0; s < ac->nstates; s++)
+		ac->out[s + 1] = ac->out[s] + fill[s + 1];
+	ac->out_lits = df_arena_calloc(&db->arena, ac->out[ac->nstates] + 1,
+	    sizeof(*ac->out_lits));
+	memcpy(fill, ac->out, ac->nstates * sizeof(*fill));
+	for (k = 0; k < nlits; k++)
+		ac->out_lits[fill[end[k]]++] = k;
+	for (k = 0; k < qt; k++) {
+		s = queue[k];
+		for (t = ac->out[fail[s]]; t < ac->out[fail[s] + 1]; t++)
+			ac->out_lits[fill[s]++] = ac->out_lits[t];
+	}
+	DPRINTF(1, "automaton: %u literals, %u states, %u classes, scans "
+	    "%zu bytes", nlits, ac->nstates, nc, ac->end);
+
+	free(delta);
+	free(fail);
+	free(queue);
+	free(end);
+	free(fill);
+}
+
+/*
+ * Run the start of the file in src through the automaton, and point l at
+ * the positions of the rules it found, in order. What that takes comes
+ * out of arena a.
+ */
+void
+df_ac_scan(const struct df_ac *ac, struct df_source *src,
+    struct df_arena *a, struct df_cursor *l)
+{
+	const struct df_ac_lit	*lit;
+	const u_char		*buf;
+	u_int64_t		*seen;
+	u_int32_t		*found, s = 0, k, o;
+	size_t			 n, i, words = (ac->nlits + 63) / 64;
+	int64_t			 start;
+
+	seen = df_arena_calloc(a, words, sizeof(*seen));
+	found = df_arena_calloc(a, ac->nlits, sizeof(*found));
+	n = MIN(ac->end, (u_int64_t)src->size);
+	if ((buf = df_source_get(src, 0, n)) == NULL) {
+		/* Not all in one place, let the tests sort it out */
+		for (k = 0; k < ac->nlits; k++)
+			found[k] = ac->lits[k].pos;
+		l->rules = found;
+		l->n = ac->nlits;
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		s = ac->delta[s * ac->nclasses + ac->classes[buf[i]]];
+		for (o = ac->out[s]; o < ac->out[s + 1]; o++) {
+			k = ac->out_lits[o];
+			lit = &ac->lits[k];
+			start = (int64_t)(i + 1 - lit->len);
+			if (start >= lit->lo && start <= lit->hi)
+				seen[k / 64] |= 1ULL << (k % 64);
+		}
+	}
+	l->rules = found;
+	l->n = 0;
+	for (i = 0; i < words; i++)
+		for (; seen[i] != 0; seen[i] &= seen[i] - 1) {
+			k = i * 64 + __builtin_ctzll(seen[i]);
+			found[l->n++] = ac->lits[k].pos;
+		}
+}
+
+/* Sort extents by offset */
+int
+df_plan_cmp(const void *a, const void *b)
+{
+	const struct df_extent	*ea = a, *eb = b;
+
+	return (ea->off < eb->off ? -1 : ea->off > eb->off);
+}
+
+/*
+ * Work out what we need to read of a file for the rules in db, reading no
+ * more than max bytes in one go.
+ */
+void
+df_db_plan(struct df_db *db, size_t max)
+{
+	struct df_readplan	*plan;
+	struct df_extent	*ext = NULL, *cur;
+	struct df_rule		*r;
+	u_int32_t		 i, n = 0;
+	int64_t			 end;
+	size_t			 sz;
+
+	plan = df_arena_calloc(&db->arena, 1, sizeof(*plan));
+	db->plan = plan;
+	plan->max = max;
+	plan->window = MIN(DF_HDRLEN, max);
+
+	for (i = 0; i < db->nrules + db->nlater; i++) {
+		/* Lines left for later look where they will once loaded */
+		r = i < db->nrules ? &db->rules[i] :
+		    &db->later[i - db->nrules];
+		/* For indirect rules we can only plan the pointer */
+		if (r->mflags & MF_INDIRECT)
+			sz = df_mtype_size(r->itype);
+		else
+			sz = MIN(df_rule_span(r), max);
+		if (sz == 0)
+			sz = 1;
+		if (r->mflags & MF_FROMEND) {
+			plan->tail = MAX(plan->tail, (size_t)-r->offset);
+			continue;
+		}
+		end = r->offset + sz;
+		if (end <= (int64_t)max) {
+			plan->window = MAX(plan->window, (size_t)end);
+			continue;
+		}
+		if ((ext = reallocarray(ext, n + 1, sizeof(*ext))) == NULL)
+			err(1, "reallocarray");
+		ext[n].off = r->offset;
+		ext[n].len = sz;
+		ext[n].buf = NULL;
+		n++;
+	}
+	plan->tail = MIN(plan->tail, max);
+
+	/* Coalesce what's beyond the window */
+	if (n > 0)
+		qsort(ext, n, sizeof(*ext), df_plan_cmp);
+	for (i = 0; i < n; i++) {
+		cur = plan->nextents > 0 ?
+		    &plan->extents[plan->nextents - 1] : NULL;
+		if (cur != NULL &&
+		    ext[i].off <= cur->off + (int64_t)(cur->len + DF_PLAN_GAP) &&
+		    ext[i].off + ext[i].len - cur->off <= max) {
+			end = MAX(cur->off + (int64_t)cur->len,
+			    ext[i].off + (int64_t)ext[i].len);
+			cur->len = end - cur->off;
+			continue;
+		}
+		/* Past the limit, these will have to read for themselves */
+		if (plan->nextents == DF_PLAN_MAXEXTENTS) {
+			DPRINTF(1, "read plan: %u rules from offset %lld "
+			    "left out", n - i, (long long)ext[i].off);
+			break;
+		}
+		plan->extents[plan->nextents++] = ext[i];
+	}
+	free(ext);
+
+	plan->bufsize = plan->window + plan->tail + DF_NSPILL * DF_SPILLLEN;
+	for (i = 0; i < (u_int32_t)plan->nextents; i++)
+		plan->bufsize += plan->extents[i].len;
+	DPRINTF(1, "read plan: window %zu, tail %zu, %d extents, %zu bytes",
+	    plan->window, plan->tail, plan->nextents, plan->bufsize);
+}
+
+struct df_source *
+df_source_new(const struct df_readplan *plan)
+{
+	struct df_source	*src;
+
+	if ((src = calloc(1, sizeof(*src))) == NULL)
+		err(1, "calloc");
+	src->bufsize = plan->bufsize;
+	if ((src->buf = malloc(src->bufsize)) == NULL)
+		err(1, "malloc");
+	src->fd = -1;
+
+	return (src);
+}
+
+void
+df_source_free(void *arg)
+{
+	struct df_source	*src = arg;
+
+	if (src == NULL)
+		return;
+	free(src->buf);
+	free(src->big);
+	free(src);
+}
+
+/*
+ * Read the parts of the file at fd the plan asks for into src.
+ */
+int
+df_source_read(struct df_source *src, const struct df_readplan *plan,
+    int fd, int64_t size)
+{
+	struct df_extent	*e;
+	const struct df_extent	*pe;
+	u_char			*p = src->buf;
+	ssize_t			 n;
+	int			 i;
+
+	src->fd = fd;
+	src->size = size;
+	src->max = plan->max;
+	src->next = 0;
+	src->nspill = 0;
+	src->escaped = 0;
+	src->iov = NULL;
+
+	/* The window */
+	e = &src->ext[src->next++];
+	e->off = 0;
+	e->buf = p;
+	if ((n = pread(fd, p, MIN(plan->window, (size_t)size), 0)) == -1)
+		return (-1);
+	e->len = n;
+	p += plan->window;
+
+	/* Further in, if the file is that big */
+	for (i = 0; i < plan->nextents; i++) {
+		pe = &plan->extents[i];
+		if (pe->off >= size)
+			break;
+		e = &src->ext[src->next++];
+		e->off = pe->off;
+		e->buf = p;
+		if ((n = pread(fd, p, MIN(pe->len, (size_t)(size - pe->off)),
+		    pe->off)) == -1)
+			return (-1);
+		e->len = n;
+		p += pe->len;
+	}
+
+	/* The tail, unless the window already has it */
+	if (plan->tail > 0 && size > (int64_t)plan->window) {
+		e = &src->ext[src->next++];
+		e->off = MAX(size - (int64_t)plan->tail, (int64_t)plan->window);
+		e->buf = p;
+		if ((n = pread(fd, p, size - e->off, e->off)) == -1)
+			return (-1);
+		e->len = n;
+		p += plan->tail;
+	}
+
+	return (0);
+}
+
+/*
+ * Set up src over the len bytes at data, which are used in place.
+ */
+void
+df_source_mem(struct df_source *src, const void *data, size_t len)
+{
+	bzero(src, sizeof(*src));
+	src->fd = -1;
+	src->size = len;
+	src->ext[0].off = 0;
+	src->ext[0].len = len;
+	src->ext[0].buf = data;
+	src->next = 1;
+}
+
+/*
+ * Set up src over the concatenation of iovcnt buffers, used in place.
+ * The iovec array has to stay around for as long as src does.
+ */
+int
+df_source_iov(struct df_source *src, const struct iovec *iov, int iovcnt)
+{
+	int64_t		 size = 0;
+	int		 i;
+
+	if (iovcnt < 0)
+		return (-1);
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > INT64_MAX - (u_int64_t)size)
+			return (-1);
+		size += iov[i].iov_len;
+	}
+	if (iovcnt == 1) {
+		df_source_mem(src, iov[0].iov_base, iov[0].iov_len);
+		return (0);
+	}
+	bzero(src, sizeof(*src));
+	src->fd = -1;
+	src->size = size;
+	src->iov = iov;
+	src->iovcnt = iovcnt;
+
+	return (0);
+}
+
+/*
+ * Get len bytes at off from the caller's buffers. Tests mostly look at
+ * increasing offsets, so start from wherever the last one landed.
+ */
+const u_char *
+df_source_get_iov(struct df_source *src, int64_t off, size_t len)
+{
+	const struct iovec	*iov;
+	int64_t			 base = 0, start;
+	size_t			 got, n;
+	int			 i = 0;
+
+	if (off < 0 || (u_int64_t)off + len > (u_int64_t)src->size)
+		return (NULL);
+	if (off >= src->iovoff) {
+		i = src->iovidx;
+		base = src->iovoff;
+	}
+	for (; i < src->iovcnt; base += src->iov[i].iov_len, i++)
+		if (off < base + (int64_t)src->iov[i].iov_len)
+			break;
+	if (i == src->iovcnt)
+		return (NULL);
+	src->iovidx = i;
+	src->iovoff = base;
+
+	iov = &src->iov[i];
+	if ((u_int64_t)off + len <= (u_int64_t)base + iov->iov_len)
+		return ((const u_char *)iov->iov_base + (off - base));
+
+	/* Across a boundary, piece it together */
+	if (len > sizeof(src->gather))
+		return (NULL);
+	for (got = 0; got < len && i < src->iovcnt; i++) {
+		iov = &src->iov[i];
+		start = off + got - base;
+		n = MIN(len - got, iov->iov_len - start);
+		memcpy(src->gather + got, (const u_char *)iov->iov_base + start,
+		    n);
+		got += n;
+		base += iov->iov_len;
+	}
+
+	return (src->gather);
+}
+
+/*
+ * Read len bytes at off that are too many for a spill, as long as they
+ * are no more than the plan would read for one test.
+ */
+const u_char *
+df_source_get_big(struct df_source *src, int64_t off, size_t len)
+{
+	ssize_t		 n;
+
+	if (len > src->max || (u_int64_t)off + len > (u_int64_t)src->size)
+		return (NULL);
+	if (len > src->bigsize) {
+		free(src->big);
+		if ((src->big = malloc(len)) == NULL)
+			err(1, "malloc");
+		src->bigsize = len;
+	}
+	if ((n = pread(src->fd, src->big, len, off)) == -1 ||
+	    (size_t)n < len)
+		return (NULL);
+
+	return (src->big);
+}
+
+/*
+ * Get len bytes of the file at off, NULL if we can't have them.
+ */
+const u_char *
+df_source_get(struct df_source *src, int64_t off, size_t len)
+{
+	struct df_extent	*e;
+	u_char			*spill;
+	ssize_t			 n;
+	int			 i;
+
+	if (off < 0)
+		return (NULL);
+	src->nread += len;
+	if (src->iov != NULL)
+		return (df_source_get_iov(src, off, len));
+	for (i = 0; i < src->next; i++) {
+		e = &src->ext[i];
+		if (off >= e->off &&
+		    (u_int64_t)off + len <= (u_int64_t)e->off + e->len)
+			return (e->buf + (off - e->off));
+	}
+
+	/*
+	 * Not planned for, read a little around it if we still can. Either
+	 * way, what the rules find now depends on more than the plan read,
+	 * unless that was all of the file.
+	 */
+	if (off < src->size && src->ext[0].len < (u_int64_t)src->size)
+		src->escaped = 1;
+	if (src->fd == -1 || off >= src->size)
+		return (NULL);
+	if (len > DF_SPILLLEN / 2)
+		return (df_source_get_big(src, off, len));
+	/* Take over the oldest spill once they're all used */
+	i = src->nspill % DF_NSPILL;
+	if (src->nspill < DF_NSPILL) {
+		if (src->next == DF_MAXEXTENTS)
+			return (NULL);
+		src->spillext[i] = src->next++;
+	}
+	src->nspill++;
+	e = &src->ext[src->spillext[i]];
+	e->off = off - MIN(off, DF_SPILLLEN / 2);
+	spill = src->buf + src->bufsize - (i + 1) * DF_SPILLLEN;
+	e->buf = spill;
+	e->len = 0;
+	if ((n = pread(src->fd, spill, DF_SPILLLEN, e->off)) == -1)
+		return (NULL);
+	e->len = n;
+	if ((u_int64_t)off + len > (u_int64_t)e->off + e->len)
+		return (NULL);
+
+	return (e->buf + (off - e->off));
+}
+
+/*
+ * How many bytes from off on a test can have in one piece. Like file(1),
+ * which sees no further than the max it read from the start, but out
+ * where the plan read extents, or anywhere for a read of its own, a
+ * test can have up to max from its offset on.
+ */
+size_t
+df_source_avail(struct df_source *src, int64_t off)
+{
+	const struct df_extent	*e;
+	int64_t			 base = 0;
+	size_t			 n = 0;
+	int			 i;
+
+	if (off < 0 || off >= src->size)
+		return (0);
+	if (src->iov != NULL) {
+		for (i = 0; i < src->iovcnt; base += src->iov[i].iov_len, i++)
+			if (off < base + (int64_t)src->iov[i].iov_len)
+				return (base + src->iov[i].iov_len - off);
+		return (0);
+	}
+	for (i = 0; i < src->next; i++) {
+		e = &src->ext[i];
+		if (off >= e->off && off < e->off + (int64_t)e->len)
+			n = MAX(n, e->off + e->len - off);
+	}
+	if (src->fd != -1)
+		n = MAX(n, MIN((u_int64_t)(src->size - off),
+		    (u_int64_t)off < src->max ? src->max - off : src->max));
+
+	return (n);
+}
+
+/*
+ * Encode the test value of r the way it appears in a file.
+ * Returns its width, 0 if there isn't a fixed representation.
+ */
+size_t
+df_rule_bytes(const struct df_rule *r, u_char *out)
+{
+	u_int64_t	 v = r->value.d_num;
+	u_int16_t	 u16;
+	u_int32_t	 u32;
+	size_t		 sz, i;
+
+	if (df_mtype_float(r->mtype) || (sz = df_mtype_size(r->mtype)) == 0)
+		return (0);
+	switch (r->mtype) {
+	case MT_BYTE:
+	case MT_UBYTE:
+		out[0] = v;
+		break;
+	case MT_SHORT:
+		u16 = v;
+		memcpy(out, &u16, sizeof(u16));
+		break;
+	case MT_LONG:
+	case MT_ULONG:
+	case MT_DATE:
+	case MT_LDATE:
+		u32 = v;
+		memcpy(out, &u32, sizeof(u32));
+		break;
+	case MT_QUAD:
+	case MT_QDATE:
+	case MT_QLDATE:
+		memcpy(out, &v, sizeof(v));
+		break;
+	case MT_BESHORT:
+	case MT_UBESHORT:
+	case MT_BELONG:
+	case MT_UBELONG:
+	case MT_BEDATE:
+	case MT_BELDATE:
+	case MT_BEQUAD:
+	case MT_BEQDATE:
+	case MT_BEQLDATE:
+		for (i = 0; i < sz; i++)
+			out[i] = v >> (8 * (sz - 1 - i));
+		break;
+	case MT_MELONG:
+	case MT_MEDATE:
+	case MT_MELDATE:
+		out[0] = v >> 16;
+		out[1] = v >> 24;
+		out[2] = v;
+		out[3] = v >> 8;
+		break;
+	default:
+		/* Little endian */
+		for (i = 0; i < sz; i++)
+			out[i] = v >> (8 * i);
+		break;
+	}
+
+	return (sz);
+}
+
+/*
+ * How many bytes from its offset the test of r looks at, 0 if that
+ * isn't known. Strings take what there is of that near the end of file.
+ */
+size_t
+df_rule_span(const struct df_rule *r)
+{
+	size_t		 n;
+
+	if (!DF_OP_ISSTRING(r->op))
+		return (df_mtype_size(r->mtype));
+	/* A regex looks through its window, counted in lines or bytes */
+	if (r->op == DF_OP_REGEX) {
+		if (r->range == 0)
+			return (DF_RE_WINDOW);
+		n = r->value.s.flags & DF_STR_LINES ? DF_RE_LINELEN : 1;
+		return (MIN(r->range * n, DF_READMAX));
+	}
+	n = r->value.s.len;
+	if (r->op == DF_OP_SEARCH)
+		n = r->range + MAX(n, 1) - 1;
+	/* Loose blanks stretch a match, and whatever matched is printed */
+	if (r->value.s.flags & (DF_STR_COMPACT | DF_STR_BLANKS))
+		n += DF_STRMAX;
+
+	return (MAX(n, DF_STRMAX));
+}
+
+/*
+ * Width in bytes of the value a test type looks at, 0 if not numeric.
+ */
+size_t
+df_mtype_size(int mtype)
+{
+	switch (mtype) {
+	case MT_BYTE:
+	case MT_UBYTE:
+		return (1);
+	case MT_SHORT:
+	case MT_BESHORT:
+	case MT_UBESHORT:
+	case MT_LESHORT:
+	case MT_ULESHORT:
+		return (2);
+	case MT_LONG:
+	case MT_ULONG:
+	case MT_FLOAT:
+	case MT_DATE:
+	case MT_LDATE:
+	case MT_BELONG:
+	case MT_UBELONG:
+	case MT_BEFLOAT:
+	case MT_BEDATE:
+	case MT_BELDATE:
+	case MT_LELONG:
+	case MT_ULELONG:
+	case MT_LEFLOAT:
+	case MT_LEDATE:
+	case MT_LELDATE:
+	case MT_MELONG:
+	case MT_MEDATE:
+	case MT_MELDATE:
+		return (4);
+	case MT_QUAD:
+	case MT_DOUBLE:
+	case MT_QDATE:
+	case MT_QLDATE:
+	case MT_BEQUAD:
+	case MT_BEDOUBLE:
+	case MT_BEQDATE:
+	case MT_BEQLDATE:
+	case MT_LEQUAD:
+	case MT_LEDOUBLE:
+	case MT_LEQDATE:
+	case MT_LEQLDATE:
+		return (8);
+	default:
+		return (0);
+	}
+}
+
+int
+df_mtype_unsigned(int mtype)
+{
+	switch (mtype) {
+	case MT_UBYTE:
+	case MT_ULONG:
+	case MT_UBESHORT:
+	case MT_UBELONG:
+	case MT_ULESHORT:
+	case MT_ULELONG:
+		return (1);
+	default:
+		return (0);
+	}
+}
+
+int
+df_mtype_float(int mtype)
+{
+	switch (mtype) {
+	case MT_FLOAT:
+	case MT_DOUBLE:
+	case MT_BEFLOAT:
+	case MT_BEDOUBLE:
+	case MT_LEFLOAT:
+	case MT_LEDOUBLE:
+		return (1);
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Truncate v to the width of mtype, sign extending if the type is signed.
+ * Both the file data and the test data go through here so they compare.
+ */
+int64_t
+df_mtype_trunc(int mtype, int64_t v)
+{
+	size_t		 bits;
+
+	bits = df_mtype_size(mtype) * 8;
+	if (bits == 0 || bits == 64)
+		return (v);
+	if (df_mtype_unsigned(mtype))
+		return (v & ((1ULL << bits) - 1));
+
+	return ((int64_t)((u_int64_t)v << (64 - bits)) >> (64 - bits));
+}
+
+#define DF_OP_WIDTH(name, type, raw, swap)	[DF_OP_##name] = sizeof(raw),
+const u_int8_t	 df_op_width[DF_OP_MAX] = {
+	DF_INT_OPS(DF_OP_WIDTH)
+	DF_FLOAT_OPS(DF_OP_WIDTH)
+};
+
+/*
+ * Work out which outcomes of comparing the value in the file with that
+ * of r make r match, so the handlers don't have to go through the test
+ * flags. ~ is applied to the value here once and for all.
+ */
+void
+df_rule_rel(struct df_rule *r)
+{
+	u_int32_t	 tf = r->test_flags;
+
+	/* Where a string test keeps its range */
+	if (!DF_OP_ISSTRING(r->op) &&
+	    (!(r->mflags & MF_MASK) || (tf & DF_TEST_PFX_X)))
+		r->mask = ~0ULL;
+	if (tf & DF_TEST_PFX_X) {
+		r->rel = DF_REL_ANY;
+		return;
+	}
+	if (!df_mtype_float(r->mtype) && !DF_OP_ISSTRING(r->op)) {
+		if (tf & DF_TEST_PFX_BNEG)
+			r->value.d_num = df_mtype_trunc(r->mtype,
+			    ~r->value.d_num);
+		if (tf & DF_TEST_PFX_BSET) {
+			r->rel = DF_REL_AND | DF_REL_EQ;
+			return;
+		}
+		if (tf & DF_TEST_PFX_BCLR) {
+			r->rel = DF_REL_AND | DF_REL_LT | DF_REL_GT;
+			return;
+		}
+	}
+	if (tf & DF_TEST_PFX_LT)
+		r->rel = DF_REL_LT;
+	else if (tf & DF_TEST_PFX_GT)
+		r->rel = DF_REL_GT;
+	else if (tf & DF_TEST_PFX_NEG)
+		r->rel = DF_REL_LT | DF_REL_GT | DF_REL_UN;
+	else
+		r->rel = DF_REL_EQ;
+}
+
+/*
+ * The handlers, one per opcode. The value is loaded unaligned and put in
+ * host order, masked and cut to the width and signedness of its type by
+ * the cast, then compared once; the comparison picks the bit of rel that
+ * says whether that's a match.
+ */
+#define DF_INT_TEST(name, type, raw, swap)				\
+int									\
+df_test_##name(const struct df_rule *r, const u_char *p,		\
+    struct df_value *v)							\
+{									\
+	raw		 x;						\
+	int64_t		 n, c = r->value.d_num;				\
+									\
+	memcpy(&x, p, sizeof(x));					\
+	v->num = (type)(swap(x) & r->mask);				\
+	v->fnum = 0;							\
+	n = r->rel & DF_REL_AND ? v->num & c : v->num;			\
+									\
+	return ((r->rel >> ((n > c) - (n < c) + 1)) & 1);		\
+}
+DF_INT_OPS(DF_INT_TEST)
+
+#define DF_FLOAT_TEST(name, type, raw, swap)				\
+int									\
+df_test_##name(const struct df_rule *r, const u_char *p,		\
+    struct df_value *v)							\
+{									\
+	raw		 x;						\
+	type		 f;						\
+	double		 c = r->value.d_float;				\
+	int		 o;						\
+									\
+	memcpy(&x, p, sizeof(x));					\
+	x = swap(x);							\
+	memcpy(&f, &x, sizeof(f));					\
+	v->num = 0;							\
+	v->fnum = f;							\
+	o = (f < c) | (f == c) << 1 | (f > c) << 2;			\
+									\
+	return ((r->rel & (o != 0 ? o : DF_REL_UN)) != 0);		\
+}
+DF_FLOAT_OPS(DF_FLOAT_TEST)
+
+/*
+ * The value at p as an integer, for indirect offsets. Floating point
+ * values are cut to whole numbers, DF_OFF_BAD if they aren't any.
+ */
+int64_t
+df_op_load(int op, const u_char *p)
+{
+	switch (op) {
+#define DF_OP_LOAD(name, type, raw, swap)				\
+	case DF_OP_##name: {						\
+		raw	 x;						\
+									\
+		memcpy(&x, p, sizeof(x));				\
+		return ((type)swap(x));					\
+	}
+	DF_INT_OPS(DF_OP_LOAD)
+#define DF_OP_LOADF(name, type, raw, swap)				\
+	case DF_OP_##name: {						\
+		raw	 x;						\
+		type	 f;						\
+									\
+		memcpy(&x, p, sizeof(x));				\
+		x = swap(x);						\
+		memcpy(&f, &x, sizeof(f));				\
+		if (!(f > -DF_OFF_FMAX && f < DF_OFF_FMAX))		\
+			return (DF_OFF_BAD);				\
+		return ((int64_t)f);					\
+	}
+	DF_FLOAT_OPS(DF_OP_LOADF)
+	default:
+		return (DF_OFF_BAD);
+	}
+}
+
+/*
+ * Compare the pattern pat of string or search rule r with the n bytes at
+ * p, as the modifiers of r say. Returns less than, equal to or greater
+ * than 0 as the bytes are less than, match or are greater than it.
+ */
+int
+df_string_cmp(const struct df_rule *r, const u_char *pat, const u_char *p,
+    size_t n)
+{
+	const u_char	*end = p + n;
+	u_int8_t	 fl = r->value.s.flags;
+	size_t		 i;
+	int		 c;
+
+	for (i = 0; i < r->value.s.len; i++) {
+		c = pat[i];
+		if ((fl & (DF_STR_COMPACT | DF_STR_BLANKS)) && isspace(c)) {
+			if ((fl & DF_STR_COMPACT) && (p == end || !isspace(*p)))
+				return (p == end ? -1 : *p - c);
+			while (p < end && isspace(*p))
+				p++;
+			continue;
+		}
+		if (p == end)
+			return (-1);
+		if (*p != c &&
+		    !((fl & DF_STR_LOWER) && islower(c) && tolower(*p) == c) &&
+		    !((fl & DF_STR_UPPER) && isupper(c) && toupper(*p) == c))
+			return (*p - c);
+		p++;
+	}
+
+	return (0);
+}
+
+/*
+ * Look for the pattern pat of search rule r in the n bytes at p, starting
+ * no further in than its range. Returns where it was found, -1 if not.
+ */
+int64_t
+df_string_search(const struct df_rule *r, const u_char *pat,
+    const u_char *p, size_t n)
+{
+	const u_char	*q;
+	u_int8_t	 fl = r->value.s.flags;
+	size_t		 i, range = MIN(r->range, n);
+	int		 c, exact;
+
+	if (r->value.s.len == 0)
+		return (range > 0 ? 0 : -1);
+	if ((fl & (DF_STR_LOWER | DF_STR_UPPER | DF_STR_COMPACT |
+	    DF_STR_BLANKS)) == 0)
+		return (df_memfind(p, n, range, pat, r->value.s.len));
+	/* Skip to where the first byte is, if it can only match itself */
+	c = pat[0];
+	exact = !((fl & (DF_STR_LOWER | DF_STR_UPPER)) && isalpha(c)) &&
+	    !((fl & (DF_STR_COMPACT | DF_STR_BLANKS)) && isspace(c));
+	for (i = 0; i < range; i++) {
+		if (exact) {
+			if ((q = memchr(p + i, c, range - i)) == NULL)
+				return (-1);
+			i = q - p;
+		}
+		if (df_string_cmp(r, pat, p + i, n - i) == 0)
+			return (i);
+	}
+
+	return (-1);
+}
+
+/*
+ * Test string or search rule r at off in src, leaving v pointing at the
+ * string to print if it matches.
+ */
+int
+df_test_string(const struct df_db *db, const struct df_rule *r,
+    struct df_source *src, int64_t off, struct df_value *v)
+{
+	const u_char	*pat, *p;
+	int64_t		 at = 0;
+	size_t		 n;
+	int		 c = 0;
+
+	v->num = 0;
+	v->fnum = 0;
+	if (off < 0 || off >= src->size)
+		return (0);
+	n = MIN(df_rule_span(r), df_source_avail(src, off));
+	if (r->op == DF_OP_SEARCH && r->rel != DF_REL_ANY &&
+	    df_budget_scan(src, n) == -1)
+		return (0);
+	if ((p = df_source_get(src, off, n)) == NULL)
+		return (0);
+	pat = (const u_char *)db->strtab + r->value.s.str;
+	if (r->rel == DF_REL_ANY)
+		c = 0;
+	else if (r->op == DF_OP_SEARCH) {
+		/* Found is equal, anything else greater */
+		if ((at = df_string_search(r, pat, p, n)) == -1) {
+			at = 0;
+			c = 1;
+		}
+	} else
+		c = df_string_cmp(r, pat, p, n);
+	/* Like file(1), print the pattern if that is what was asked for */
+	if ((r->test_flags & (DF_TEST_PFX_LT | DF_TEST_PFX_GT |
+	    DF_TEST_PFX_X)) == 0) {
+		v->str = pat;
+		v->slen = r->value.s.len;
+	} else {
+		v->str = p + at;
+		v->slen = n - at;
+	}
+
+	return ((r->rel >> ((c > 0) - (c < 0) + 1)) & 1);
+}
+
+/*
+ * Test regex rule r at off in src, leaving v pointing at what it matched.
+ * A window of lines ends after the last of them, or where its bytes run
+ * out, whichever comes first.
+ */
+int
+df_test_regex(const struct df_db *db, const struct df_rule *r,
+    struct df_source *src, int64_t off, struct df_value *v)
+{
+	const u_char	*p, *q;
+	size_t		 n, so = 0, eo, lines;
+	int		 c = 0;
+
+	v->num = 0;
+	v->fnum = 0;
+	if (off < 0 || off >= src->size)
+		return (0);
+	n = MIN(df_rule_span(r), df_source_avail(src, off));
+	if (r->rel != DF_REL_ANY && df_budget_scan(src, n) == -1)
+		return (0);
+	if ((p = df_source_get(src, off, n)) == NULL)
+		return (0);
+	if ((r->value.s.flags & DF_STR_LINES) && r->range > 0) {
+		for (q = p, lines = r->range; lines > 0 &&
+		    (q = memchr(q, '\n', n - (q - p))) != NULL; lines--)
+			q++;
+		if (q != NULL)
+			n = q - p;
+	}
+	eo = n;
+	if (r->rel != DF_REL_ANY &&
+	    !df_re_exec(db->re[r - db->rules], p, n, &so, &eo)) {
+		so = eo = 0;
+		c = 1;
+	}
+	/* Like file(1), print the pattern if that is what was asked for */
+	if (r->test_flags & DF_TEST_PFX_NEG) {
+		v->str = (const u_char *)db->strtab + r->value.s.str;
+		v->slen = r->value.s.len;
+	} else {
+		v->str = p + so;
+		v->slen = eo - so;
+	}
+
+	return ((r->rel >> ((c > 0) - (c < 0) + 1)) & 1);
+}
+
+/*
+ * Run the test of a single rule against src, leave the value we looked at
+ * in v. Returns 1 on match.
+ */
+int
+df_rule_test(const struct df_db *db, const struct df_rule *r,
+    struct df_source *src, struct df_value *v)
+{
+	const u_char	*p;
+	int64_t		 off;
+
+	if (r->op == DF_OP_NONE)
+		return (0);
+	off = r->offset;
+	if (r->mflags & MF_FROMEND)
+		off += src->size;
+	if (r->mflags & MF_INDIRECT) {
+		if (r->iop == DF_OP_NONE || (p = df_source_get(src, off,
+		    df_op_width[r->iop])) == NULL)
+			return (0);
+		if ((off = df_op_load(r->iop, p)) == DF_OFF_BAD)
+			return (0);
+		off += r->offset_adj;
+	}
+	if (r->op == DF_OP_REGEX)
+		return (df_test_regex(db, r, src, off, v));
+	if (DF_OP_ISSTRING(r->op))
+		return (df_test_string(db, r, src, off, v));
+	if ((p = df_source_get(src, off, df_op_width[r->op])) == NULL)
+		return (0);
+
+	switch (r->op) {
+#define DF_OP_CASE(name, type, raw, swap)				\
+	case DF_OP_##name:						\
+		return (df_test_##name(r, p, v));
+	DF_INT_OPS(DF_OP_CASE)
+	DF_FLOAT_OPS(DF_OP_CASE)
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Start counting what testing src costs against b, NULL for no limits.
+ */
+void
+df_budget_start(struct df_source *src, const struct df_budget *b)
+{
+	struct timespec	 ts;
+
+	src->budget = b;
+	src->nrules = 0;
+	src->nscanned = 0;
+	src->deadline = 0;
+	src->depth = 0;
+	src->partial = 0;
+	if (b != NULL && b->usec > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		src->deadline = ts.tv_sec * 1000000000ULL + ts.tv_nsec +
+		    b->usec * 1000;
+	}
+}
+
+/*
+ * Whether src can't afford to test r. Once it can't, it's partial and
+ * can't afford any other rule either.
+ */
+int
+df_budget_spent(struct df_source *src, const struct df_rule *r)
+{
+	const struct df_budget	*b = src->budget;
+	struct timespec		 ts;
+
+	if (src->partial)
+		return (1);
+	if (b == NULL)
+		return (0);
+	if (b->rules > 0 && src->nrules >= b->rules)
+		goto spent;
+	if (b->depth > 0 && (r->mflags & MF_INDIRECT) &&
+	    src->depth >= b->depth)
+		goto spent;
+	if (src->deadline > 0 && src->nrules % DF_BUDGET_CLOCK == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		if (ts.tv_sec * 1000000000ULL + ts.tv_nsec >= src->deadline)
+			goto spent;
+	}
+
+	return (0);
+spent:
+	src->partial = 1;
+	return (1);
+}
+
+/*
+ * Count n bytes about to be searched against the budget of src. Returns
+ * -1 if there's not enough left, and the search shouldn't be done.
+ */
+int
+df_budget_scan(struct df_source *src, size_t n)
+{
+	const struct df_budget	*b = src->budget;
+
+	if (b != NULL && b->bytes > 0 && src->nscanned + n > b->bytes) {
+		src->partial = 1;
+		return (-1);
+	}
+	src->nscanned += n;
+
+	return (0);
+}
+
+/*
+ * Test rule idx and, if it matches, describe it and walk its
+ * continuations. Returns how many descriptions that produced.
+ */
+int
+df_rule_match(struct df_matches *matches, struct df_db *db, u_int32_t idx,
+    struct df_source *src)
+{
+	const struct df_rule	*r = &db->rules[idx];
+	struct df_rule_prof	*rp = NULL;
+	struct df_value		 v;
+	struct timespec		 t0, t1;
+	u_int64_t		 nread = 0;
+	u_int32_t		 c, ind = (r->mflags & MF_INDIRECT) != 0;
+	int			 n = 0, m;
+
+	if (df_budget_spent(src, r))
+		return (0);
+	src->nrules++;
+	if (src->prof != NULL) {
+		rp = &src->prof[idx];
+		nread = src->nread;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+	}
+	if ((m = df_rule_test(db, r, src, &v)))
+		n = df_rule_describe(matches, db, r, &v);
+	if (rp != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		rp->evals++;
+		rp->matches += m;
+		rp->bytes += src->nread - nread;
+		rp->nsec += (t1.tv_sec - t0.tv_sec) * 1000000000LL +
+		    t1.tv_nsec - t0.tv_nsec;
+	}
+	if (!m)
+		return (0);
+	if (__atomic_load_n(&r->lazy, __ATOMIC_ACQUIRE))
+		df_db_expand(db, idx);
+	src->depth += ind;
+	for (c = r->child; c != DF_RULE_NONE; c = db->rules[c].next)
+		n += df_rule_match(matches, db, c, src);
+	src->depth -= ind;
+
+	return (n);
+}
+
+/*
+ * Add the description of a matching rule to matches, substituting the value we
+ * tested into the first printf style conversion if it makes sense for it.
+ * Returns 0 if the rule has nothing to say.
+ */
+int
+df_rule_describe(struct df_matches *matches, struct df_db *db,
+    const struct df_rule *r, const struct df_value *v)
+{
+	struct df_match	*dm;
+	const char	*desc, *pct, *conv;
+	char		 fmt[32], out[256], str[DF_STRMAX * 4 + 1];
+	size_t		 n;
+	int		 nospace = 0;
+
+	desc = db->strtab + r->desc;
+	if (strncmp(desc, "\\b", 2) == 0) {
+		nospace = 1;
+		desc += 2;
+	}
+	if (*desc == 0)
+		return (0);
+
+	/* Find the first real conversion */
+	for (pct = strchr(desc, '%'); pct != NULL && pct[1] == '%';
+	    pct = strchr(pct + 2, '%'))
+		;
+	if (pct == NULL) {
+		dm = df_match_add(matches, MC_MAGIC, "%s", desc);
+		goto done;
+	}
+	conv = pct + 1 + strspn(pct + 1, "-#0 +0123456789.");
+	n = conv - pct;
+	if (n + 3 >= sizeof(fmt)) {
+		dm = df_match_add(matches, MC_MAGIC, "%s", desc);
+		goto done;
+	}
+	memcpy(fmt, pct, n);
+	conv += strspn(conv, "hlq");
+	if (strchr("diouxXc", *conv) != NULL && *conv != 0 &&
+	    !df_mtype_float(r->mtype) && !DF_OP_ISSTRING(r->op)) {
+		if (*conv == 'c')
+			fmt[n++] = 'c';
+		else {
+			fmt[n++] = 'l';
+			fmt[n++] = 'l';
+			fmt[n++] = *conv;
+		}
+		fmt[n] = 0;
+		if (*conv == 'c')
+			(void)snprintf(out, sizeof(out), fmt, (int)v->num);
+		else
+			(void)snprintf(out, sizeof(out), fmt,
+			    (long long)v->num);
+	} else if (strchr("eEfFgG", *conv) != NULL && *conv != 0 &&
+	    df_mtype_float(r->mtype)) {
+		fmt[n++] = *conv;
+		fmt[n] = 0;
+		(void)snprintf(out, sizeof(out), fmt, v->fnum);
+	} else if (*conv == 's' && DF_OP_ISSTRING(r->op)) {
+		df_string_print(r, v, str, sizeof(str));
+		fmt[n++] = 's';
+		fmt[n] = 0;
+		(void)snprintf(out, sizeof(out), fmt, str);
+	} else {
+		dm = df_match_add(matches, MC_MAGIC, "%s", desc);
+		goto done;
+	}
+	dm = df_match_add(matches, MC_MAGIC, "%.*s%s%s", (int)(pct - desc), desc,
+	    out, *conv != 0 ? conv + 1 : conv);
+done:
+	if (nospace)
+		dm->flags |= DM_NOSPACE;
+
+	return (1);
+}
+
+/*
+ * What a string or search rule matched, as far as the end of its line,
+ * into buf.
+ */
+void
+df_string_print(const struct df_rule *r, const struct df_value *v,
+    char *buf, size_t len)
+{
+	const u_char	*p = v->str, *end;
+	size_t		 n = 0;
+
+	for (end = p; end < v->str + v->slen; end++)
+		if (*end == '\0' || *end == '\n' || *end == '\r')
+			break;
+	if (r->value.s.flags & DF_STR_TRIM) {
+		while (p < end && isspace(*p))
+			p++;
+		while (end > p && isspace(end[-1]))
+			end--;
+	}
+	/* Unprintable bytes in octal, as file(1) does */
+	for (; p < end && n + 4 < len; p++) {
+		if (isprint(*p))
+			buf[n++] = *p;
+		else
+			n += snprintf(buf + n, len - n, "\\%03o", *p);
+	}
+	buf[n] = '\0';
+}
+
+/*
+ * Test the top level rules that may match buf, in the order the index
+ * has them, until one of them says something or the budget runs out.
+ */
+void
+df_magic_walk(struct df_matches *matches, struct df_db *db,
+    struct df_source *src)
+{
+	const struct df_index	*ix = db->index;
+	const struct df_probe	*p;
+	const struct df_bucket	*b;
+	struct df_cursor	 l[DF_INDEX_MAXPROBE + DF_INDEX_MAXLANES + 3];
+	const u_char		*buf;
+	u_int32_t		 idx, vb, i, nl = 0;
+	int			 best;
+
+	if (ix == NULL) {
+		for (idx = 0; idx != DF_RULE_NONE; idx = db->rules[idx].next)
+			if (df_rule_match(matches, db, idx, src) > 0 ||
+			    src->partial)
+				break;
+		return;
+	}
+
+	/* Gather the candidate lists */
+	l[nl].rules = ix->always;
+	l[nl++].n = ix->nalways;
+	if ((buf = df_source_get(src, 0, 1)) != NULL) {
+		l[nl].rules = ix->byte0_rules + ix->byte0[buf[0]];
+		l[nl++].n = ix->byte0[buf[0] + 1] - ix->byte0[buf[0]];
+	}
+	for (i = 0; i < ix->nprobes; i++) {
+		p = &ix->probes[i];
+		if ((buf = df_source_get(src, p->offset, p->width)) == NULL)
+			continue;
+		vb = 0;
+		memcpy(&vb, buf, p->width);
+		if ((b = df_index_lookup(ix, (u_int64_t)i << 32 | vb)) == NULL)
+			continue;
+		l[nl].rules = ix->bucket_rules + b->start;
+		l[nl++].n = b->count;
+	}
+	if (ix->ac != NULL)
+		df_ac_scan(ix->ac, src, &matches->arena, &l[nl++]);
+	for (i = 0; i < ix->nlanes; i++)
+		df_lanes_scan(&ix->lanes[i], src, &matches->arena, &l[nl++]);
+
+	/* And merge them back into the order they're tested in */
+	for (;;) {
+		best = -1;
+		for (i = 0; i < nl; i++)
+			if (l[i].n > 0 && (best == -1 ||
+			    l[i].rules[0] < l[best].rules[0]))
+				best = i;
+		if (best == -1)
+			break;
+		idx = ix->order[*l[best].rules++];
+		l[best].n--;
+		if (df_rule_match(matches, db, idx, src) > 0 || src->partial)
+			break;
+	}
+}
+
+/*
+ * Describe what the mode of a file says about it. Returns 1 if the file
+ * has contents worth testing magic against.
+ */
+int
+df_check_mode(struct df_matches *matches, const struct stat *sb, int flags)
+{
+	if (sb->st_mode & S_ISUID)
+		df_match_add(matches, MC_FS, "setuid");
+	if (sb->st_mode & S_ISGID)
+		df_match_add(matches, MC_FS, "setgid");
+	if (sb->st_mode & S_ISVTX)
+		df_match_add(matches, MC_FS, "sticky");
+	if (S_ISDIR(sb->st_mode)) {
+		df_match_add(matches, MC_FS, "directory");
+		return (0);
+	}
+	if (flags & DF_NOSPECIAL)
+		goto ordinary;
+	if (S_ISCHR(sb->st_mode)) {
+		df_match_add(matches, MC_FS, "character special");
+		return (0);
+	}
+	if (S_ISBLK(sb->st_mode)) {
+		df_match_add(matches, MC_FS, "block special");
+		return (0);
+	}
+	if (S_ISFIFO(sb->st_mode)) {
+		df_match_add(matches, MC_FS, "fifo (named pipe)");
+		return (0);
+	}
+	/* TODO DOOR ? */
+	if (S_ISSOCK(sb->st_mode)) {
+		df_match_add(matches, MC_FS, "socket");
+		return (0);
+	}
+ordinary:
+	if (sb->st_size == 0) {
+		df_match_add(matches, MC_FS, "empty");
+		return (0);
+	}
+
+	return (1);
+}
+
+/*
+ * Builds and adds a match at the end of matches. Overlong descriptions
+ * are truncated.
+ */
+struct df_match *
+df_match_add(struct df_matches *matches, enum match_class mc,
+    const char *desc, ...)
+{
+	struct df_match *dm;
+	char		 buf[DF_DESCLEN];
+	va_list		 ap;
+
+	va_start(ap, desc);
+	(void)vsnprintf(buf, sizeof(buf), desc, ap);
+	va_end(ap);
+	dm = df_arena_calloc(&matches->arena, 1, sizeof(*dm));
+	dm->class = mc;
+	dm->desc = df_arena_strdup(&matches->arena, buf);
+	TAILQ_INSERT_TAIL(&matches->list, dm, entry);
+
+	return (dm);
+}
+
+/*
+ * Join the descriptions in matches into buf. Returns -1 if it didn't fit,
+ * in which case buf holds as much as did.
+ */
+int
+df_matches_print(struct df_matches *matches, char *buf, size_t len)
+{
+	struct df_match	*dm;
+	size_t		 n = 0;
+
+	if (len > 0)
+		buf[0] = 0;
+	TAILQ_FOREACH(dm, &matches->list, entry) {
+		if (dm != TAILQ_FIRST(&matches->list) &&
+		    !(dm->flags & DM_NOSPACE))
+			n = strlcat(buf, " ", len);
+		n = strlcat(buf, dm->desc, len);
+	}
+
+	return (n >= len ? -1 : 0);
+}
+
+void
+df_matches_init(struct df_matches *matches)
+{
+	TAILQ_INIT(&matches->list);
+	bzero(&matches->arena, sizeof(matches->arena));
+	matches->partial = 0;
+}
+
+/*
+ * Empty matches for the next file, keeping the memory.
+ */
+void
+df_matches_reset(struct df_matches *matches)
+{
+	TAILQ_INIT(&matches->list);
+	matches->partial = 0;
+	df_arena_reset(&matches->arena);
+}
+
+void
+df_matches_free(struct df_matches *matches)
+{
+	TAILQ_INIT(&matches->list);
+	df_arena_free(&matches->arena);
+}
+
+/*
+ * Parse magic offset field.
+ * Eg. '0', '>>>>>(78.l+23)', '>3', ...
+ */
+int
+dp_prepare_moffset(struct df_parser *dp, const char *s)
+{
+	char *end = NULL, *ep;
+	const char *cp;
+	const char *errstr = NULL;
+
+	cp = s;
+	if (cp == NULL)
+		goto errorinv;
+	/* Check for mimes, skip for now */
+	if (*cp == '!') {
+		dp->mflags |= MF_MIME;
+		return (0);
+	}
+	/*
+	 * Check for an indirect offset, we're parsing something like:
+	 * (0x3c.l)
+	 * (( x [.[bslBSL]][+-][ y ])
+	 */
+	/* XXX indirect offsets will modify the string, it should not. */
+	if (*cp == '(') {
+		if ((end = strchr(cp, ')')) == NULL) {
+			warnx("Unclosed paren at line %zd", dp->lineno);
+			return (-1);
+		}
+		*end = 0;	/* terminate */
+		dp->mflags |= MF_INDIRECT;
+		cp++;		/* Jump over ( */
+		/* cp now points to the 0 in (0x3c.l) */
+		/* If type not specified, assume long */
+		if ((end = strchr(cp, '.')) == NULL) {
+			dp->moffset_itype = MT_LONG;
+			if ((end = strpbrk(cp, "+-")) == NULL)
+				end = strchr(cp, 0);
+		} else {
+			/* Terminate at dot */
+			*end++ = 0;
+			/* end now points over the dot */
+			switch (*end) {
+			case 'c':
+			case 'b':
+			case 'C':
+			case 'B':
+				dp->moffset_itype = MT_BYTE;
+				break;
+			case 'h':
+			case 's':
+				dp->moffset_itype = MT_LESHORT;
+				break;
+			case 'l':
+				dp->moffset_itype = MT_LELONG;
+				break;
+			case 'S':
+				dp->moffset_itype = MT_BESHORT;
+				break;
+			case 'L':
+				dp->moffset_itype = MT_BELONG;
+				break;
+			case 'e':
+			case 'f':
+			case 'g':
+				dp->moffset_itype = MT_LEDOUBLE;
+				break;
+			case 'E':
+			case 'F':
+			case 'G':
+				dp->moffset_itype = MT_BEDOUBLE;
+				break;
+			default:
+				warnx("indirect offset type `%c' "
+				    "invalid at line %zd", *end, dp->lineno);
+				return (-1);
+				break; /* NOTREACHED */
+			}
+			end++;
+		}
+		/* end should be where `)' was or at `+' or `-' */
+		switch (*end) {
+		case 0:
+			break;
+		case '-':
+		case '+':
+			errno = 0;
+			dp->moffset_adj = strtoll(end + 1, &ep, 0);
+			if (errno || ep == end + 1 || *ep != 0)
+				goto errorinv;
+			if (*end == '-')
+				dp->moffset_adj = -dp->moffset_adj;
+			*end = 0;
+			break;
+		default:
+			goto errorinv;
+			break; /* NOTREACHED */
+		}
+	}
+	if (cp == NULL)
+		goto errorinv;
+	/* Negative offsets count from the end of the file */
+	if (*cp == '-' && !(dp->mflags & MF_INDIRECT)) {
+		dp->mflags |= MF_FROMEND;
+		cp++;
+	}
+	/* Try hex */
+	if (strlen(cp) > 1 && cp[0] == '0' && cp[1] == 'x') {
+		errno = 0;
+		dp->moffset = strtoll(cp, &ep, 16);
+		if (errno || *ep != 0) {
+			warn("dp_prepare_moffset: strtoll: %s "
+			    "line %zd", cp, dp->lineno);
+			return (-1);
+		}
+		return (0);
+	}
+	dp->moffset = (unsigned long)strtonum(cp, 0,
+	    LLONG_MAX, &errstr);
+	if (errstr) {
+		warn("dp_prepare_moffset: strtonum %s at line %zd",
+		    cp, dp->lineno);
+		return (-1);
+	}
+
+	return (0);
+
+errorinv:
+	warnx("dp_prepare_moffset: Invalid offset at line %zd",
+	    dp->lineno);
+
+	return (-1);
+}
+
+/*
+ * Bake dp into something usable.
+ */
+int
+dp_prepare(struct df_parser *dp)
+{
+	char			*cp;
+
+	/* Reset */
+	dp->mlevel	  = 0;
+	dp->moffset	  = 0;
+	dp->moffset_itype = 0;
+	dp->moffset_adj	  = 0;
+	dp->mflags	  = 0;
+	dp->mrange	  = 0;
+	dp->mstrflags	  = 0;
+	dp->mstrlen	  = 0;
+	dp->mtype	  = MT_UNKNOWN;
+	dp->mmask	  = 0;
+	dp->d_quad	  = 0;	/* the longest type in the union */
+	dp->test_flags	  = 0;
+	dp->mdata_parser = 0;
+	/* First analyze level and offset */
+	cp = dp->argv[0];
+	if (*cp == '>') {
+		/* Count the > */
+		while (cp && *cp == '>') {
+			dp->mlevel++;
+			cp++;
+		}
+	}
+	/* cp now should point to the start of the offset */
+	if (dp_prepare_moffset(dp, cp) == -1)
+		return (-1);
+	/* We ignore mimes for now */
+	if (dp->mflags & MF_MIME) {
+		DPRINTF(1, "%zd: mime ignored", dp->lineno);
+		goto ignore;
+	}
+	/* Second, analyze test type */
+	if (dp_prepare_mtype(dp, dp->argv[1]) == -1)
+		return (-1);
+	/* Now test data */
+	if (dp->mdata_parser == NULL) {
+		warn("%s: no mdata parser for mtype: %d", __func__, dp->mtype);
+		return (-1);
+	}
+	if (dp->mdata_parser(dp, dp->argv[2]) == -1)
+		return (-1);
+	
+	return (0);
+ignore:
+	return (-1);
+}
+
+/*
+ * Parse the test type field
+ * Eg. 'lelong', 'byte', 'leshort&0x0001', ...
+ */
+int
+dp_prepare_mtype(struct df_parser *dp, char *cp)
+{
+	char			*mask, *mod;
+	const char		*errstr = NULL;
+
+	/* Split mask and test type first */
+	cp   = dp->argv[1];
+	mask = strchr(cp, '&');
+	if (mask != NULL) {
+		*mask++ = 0;
+		errno  = 0;
+		errstr = NULL;
+		if (strlen(mask) > 1 && mask[0] == '0' && mask[1] == 'x') {
+			/* Hexa */
+			dp->mmask = strtoll(mask, NULL, 16);
+			if (errno)
+				goto badmask;
+		} else if (strlen(mask) > 1 && mask[0] == '0') {
+			/* Octa */
+			dp->mmask = strtoll(mask, NULL, 8);
+			if (errno)
+				goto badmask;
+		} else {
+			/* Decimal */
+			dp->mmask = strtonum(mask, 0, LLONG_MAX, &errstr);
+			if (errstr)
+				goto badmask;
+		}
+		dp->mflags |= MF_MASK;
+	}
+	/* If no &, check for modifier / as in string/, search/ or regex/ */
+	if (mask == NULL &&
+	    (strncmp(cp, "string", 6) == 0 ||
+	    strncmp(cp, "search", 6) == 0 ||
+	    strncmp(cp, "regex", 5) == 0)) {
+		mod = strchr(cp, '/');
+		if (mod != NULL) {
+			if (mod[1] == 0)
+				goto badmod;
+			*mod++ = 0;
+			if (dp_prepare_mstrmod(dp, mod) == -1)
+				goto badmod;
+		}
+	}
+	/* Convert the string to something meaningful and decide upon a test handler */
+	if ((lookup_mtype(dp, cp) == -1) || (dp->mtype == MT_UNKNOWN)) {
+		warnx("dp_prepare: Uknown magic type %s at line %zd", cp, dp->lineno);
+		return (-1);
+	}
+
+	return (0);
+
+badmod:
+	warn("dp_prepare: bad mod %s at line %zd", mod, dp->lineno);
+	return (-1);
+badmask:
+	warn("dp_prepare: bad mask %s at line %zd", mask, dp->lineno);
+	return (-1);
+}
+
+/*
+ * Parse the modifiers of a string, search or regex test, the part of the
+ * type after the first /. A number is the range of a search or the window
+ * of a regex, letters are DF_STR_* flags and may follow the number:
+ * string/cW, search/4096, search/4096/c, regex/100l...
+ */
+int
+dp_prepare_mstrmod(struct df_parser *dp, char *cp)
+{
+	char		*mod, *end;
+
+	while ((mod = strsep(&cp, "/")) != NULL) {
+		if (isdigit((u_char)*mod)) {
+			errno = 0;
+			dp->mrange = strtoull(mod, &end, 0);
+			if (errno || dp->mrange > DF_READMAX)
+				return (-1);
+			if (*end == 0)
+				continue;
+			mod = end;
+		}
+		if (*mod == 0)
+			return (-1);
+		for (; *mod != 0; mod++) {
+			switch (*mod) {
+			case 'c':
+				dp->mstrflags |= DF_STR_LOWER;
+				break;
+			case 'C':
+				dp->mstrflags |= DF_STR_UPPER;
+				break;
+			case 'W':
+				dp->mstrflags |= DF_STR_COMPACT;
+				break;
+			case 'w':
+				dp->mstrflags |= DF_STR_BLANKS;
+				break;
+			case 'T':
+				dp->mstrflags |= DF_STR_TRIM;
+				break;
+			case 'l':
+				dp->mstrflags |= DF_STR_LINES;
+				break;
+			case 's':
+			case 'b':
+			case 't':
+				break;
+			default:
+				return (-1);
+			}
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Parse a string magic data field, decoding its escapes in place
+ * Eg. 'MZ', '\177ELF', '!<arch>', '\x89PNG\r\n', 'x'
+ */
+int
+dp_prepare_mdata_string(struct df_parser *df, char *cp)
+{
+	char		*out;
+	int		 i, c;
+
+	if (cp == NULL) {
+		warnx("%s: null magic data at line %zd", __func__,
+		    df->lineno);
+		return (-1);
+	}
+	if (df->mflags & MF_MASK) {
+		warnx("%s: mask on a string at line %zd", __func__,
+		    df->lineno);
+		return (-1);
+	}
+	/* A search that doesn't say how far looks in one place only */
+	if (df->mtype == MT_SEARCH && df->mrange == 0)
+		df->mrange = 1;
+	/* Only a regex counts in lines, and it can't ignore blanks */
+	if (df->mtype == MT_REGEX ?
+	    (df->mstrflags & (DF_STR_COMPACT | DF_STR_BLANKS)) != 0 :
+	    (df->mstrflags & DF_STR_LINES) != 0) {
+		warnx("%s: bad modifier at line %zd", __func__, df->lineno);
+		return (-1);
+	}
+	DPRINTF(2, "Parse string magic data: %s", cp);
+
+	if (strcmp(cp, "x") == 0) {
+		df->test_flags |= DF_TEST_PFX_X;
+		df->d_string = cp;
+		return (0);
+	}
+	switch (*cp) {
+	case '=':
+		df->test_flags |= DF_TEST_PFX_EQ;
+		cp++;
+		break;
+	case '<':
+		df->test_flags |= DF_TEST_PFX_LT;
+		cp++;
+		break;
+	case '>':
+		df->test_flags |= DF_TEST_PFX_GT;
+		cp++;
+		break;
+	case '!':
+		df->test_flags |= DF_TEST_PFX_NEG;
+		cp++;
+		break;
+	}
+	/* A regex matches or doesn't, it has no order */
+	if (df->mtype == MT_REGEX &&
+	    (df->test_flags & (DF_TEST_PFX_LT | DF_TEST_PFX_GT))) {
+		warnx("%s: ordered regex at line %zd", __func__, df->lineno);
+		return (-1);
+	}
+
+	df->d_string = out = cp;
+	while (*cp != 0) {
+		if (*cp != '\\') {
+			*out++ = *cp++;
+			continue;
+		}
+		switch (*++cp) {
+		case 0:
+			goto bad;
+		case 'a':
+			*out++ = '\a';
+			break;
+		case 'b':
+			*out++ = '\b';
+			break;
+		case 'f':
+			*out++ = '\f';
+			break;
+		case 'n':
+			*out++ = '\n';
+			break;
+		case 'r':
+			*out++ = '\r';
+			break;
+		case 't':
+			*out++ = '\t';
+			break;
+		case 'v':
+			*out++ = '\v';
+			break;
+		case 'x':
+			/* Up to two hex digits */
+			if (!isxdigit((u_char)cp[1]))
+				goto bad;
+			for (i = 0, c = 0; i < 2 && isxdigit((u_char)cp[1]);
+			    i++) {
+				cp++;
+				c = c * 16 + (isdigit((u_char)*cp) ? *cp - '0' :
+				    tolower((u_char)*cp) - 'a' + 10);
+			}
+			*out++ = c;
+			break;
+		case '0': case '1': case '2': case '3':
+		case '4': case '5': case '6': case '7':
+			/* Up to three octal digits */
+			for (i = 0, c = 0; i < 3 && *cp >= '0' && *cp <= '7';
+			    i++)
+				c = c * 8 + *cp++ - '0';
+			*out++ = c;
+			cp--;
+			break;
+		default:
+			*out++ = *cp;
+			break;
+		}
+		cp++;
+	}
+	df->mstrlen = out - df->d_string;
+	if (df->mstrlen > DF_STRMAX)
+		goto bad;
+
+	return (0);
+bad:
+	warnx("%s: bad string at line %zd", __func__, df->lineno);
+	return (-1);
+}
+
+/*
+ * Parse a numeric magic data field
+ * Eg. '>0', '0407', '0x84500526'
+ */
+int
+dp_prepare_mdata_numeric(struct df_parser *df, char *cp)
+{
+	char			*special = "=<>&^~x!";
+	char			*end;
+	int			 ret = -1;
+
+	if (cp == NULL) {
+		warn("%s: null magic data", __func__); /* XXX why does this happen? */
+		return (-1);
+	}
+
+	DPRINTF(2, "Parse numerical magic data: %s", cp);
+
+	/* continue until we have parsed all special prefixes */
+	while (strspn(cp, special)) {
+		DPRINTF(2, "Found numerical speical prefix: %c", *cp);
+		switch (*cp) {
+		case '=':
+			df->test_flags |= DF_TEST_PFX_EQ;
+			break;
+		case '<':
+			df->test_flags |= DF_TEST_PFX_LT;
+			break;
+		case '>':
+			df->test_flags |= DF_TEST_PFX_GT;
+			break;
+		case '&':
+			df->test_flags |= DF_TEST_PFX_BSET;
+			break;
+		case '^':
+			df->test_flags |= DF_TEST_PFX_BCLR;
+			break;
+		case '~':
+			df->test_flags |= DF_TEST_PFX_BNEG;
+			break;
+		case 'x':
+			df->test_flags |= DF_TEST_PFX_X;
+			break;
+		case '!':
+			df->test_flags |= DF_TEST_PFX_NEG;
+			break;
+		default:
+			/* should not happen */
+			warn("%s: unknown special prefix: %c", __func__, *cp);
+		};
+		cp++;
+	}
+
+	/* XXX check for incompatible flag combos */
+	/* EQ + LT */
+	/* EQ + GT */
+	/* GT + LT */
+	/* SET + CLR */
+
+	/* Nothing to store for `x', it matches anything */
+	if (df->test_flags & DF_TEST_PFX_X)
+		return (0);
+
+	/*
+	 * Test data is kept in host order, it's the value read from the
+	 * file that gets converted according to the type endianness.
+	 */
+	errno = 0;
+	if (df_mtype_float(df->mtype))
+		df->d_double = strtod(cp, &end);
+	else
+		df->d_quad = (int64_t)strtoull(cp, &end, 0);
+	if (errno || end == cp || *end != 0) {
+		warnx("%s: bad numeric value %s at line %zd", __func__, cp,
+		    df->lineno);
+		return (-1);
+	}
+
+	ret = 0;
+
+	return (ret);
+}
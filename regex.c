@@ -0,0 +1,1013 @@
+/*
+ * Copyright (c) 2011, Edd Barrett <vext01@gmail.com>
+ * Copyright (c) 2011, Christiano F. Haesbaert <haesbaert@haesbaert.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Regular expressions of regex tests, extended POSIX syntax with the
+ * REG_NEWLINE semantics file(1) uses: . and [^...] don't match a newline,
+ * ^ and $ match at the start and end of any line of the window.
+ *
+ * A pattern is parsed into a tree once, when its rule is compiled, and
+ * made into an NFA. Matching runs that as a DFA whose states are made the
+ * first time a file needs them and kept, up to DF_RE_MAXDFA of them, so
+ * every byte of a file costs at most one pass over the NFA whatever the
+ * pattern; there is no backtracking. Back references, which can't be
+ * matched that way, are refused.
+ *
+ * Like regexec(3) we want the leftmost of the longest matches. The
+ * reversed pattern is run from the end of the window to its start, which
+ * finds where the leftmost match starts, then the pattern from there
+ * finds where the longest ends. Files that don't match take just the
+ * first pass.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defile.h"
+#include "file.h"
+
+#define DF_RE_ISSET(set, b)	((set)[(b) >> 3] & (1 << ((b) & 7)))
+#define DF_RE_ADD(set, b)	((set)[(b) >> 3] |= (1 << ((b) & 7)))
+#define DF_RE_DEL(set, b)	((set)[(b) >> 3] &= ~(1 << ((b) & 7)))
+#define DF_RE_PUSH(w, sp, s)						\
+	do {								\
+		if ((w)->mark[s] != (w)->gen) {				\
+			(w)->mark[s] = (w)->gen;			\
+			(w)->stack[(sp)++] = (s);			\
+		}							\
+	} while (0)
+
+struct {
+	const char	*name;
+	int		(*is)(int);
+} df_re_ctypes[] = {
+	{ "alnum",	isalnum },
+	{ "alpha",	isalpha },
+	{ "blank",	isblank },
+	{ "cntrl",	iscntrl },
+	{ "digit",	isdigit },
+	{ "graph",	isgraph },
+	{ "lower",	islower },
+	{ "print",	isprint },
+	{ "punct",	ispunct },
+	{ "space",	isspace },
+	{ "upper",	isupper },
+	{ "xdigit",	isxdigit },
+	{ NULL,		NULL }
+};
+
+/*
+ * Compile the len bytes of pat, matching either case of a letter if
+ * icase. Returns NULL, and why in errstr, if it isn't a pattern we take.
+ */
+struct df_re *
+df_re_compile(const u_char *pat, size_t len, int icase, const char **errstr)
+{
+	struct df_re_parser	 rp;
+	struct df_re		*re;
+	u_int32_t		 root, match, any, loop;
+
+	bzero(&rp, sizeof(rp));
+	rp.p = pat;
+	rp.end = pat + len;
+	rp.icase = icase;
+	if ((re = calloc(1, sizeof(*re))) == NULL)
+		err(1, "calloc");
+	if ((root = df_re_alt(&rp)) != DF_RE_ERR && rp.p < rp.end)
+		rp.err = "unmatched )";
+	if (rp.err != NULL)
+		goto bad;
+	/* What the reversed pattern skips to find where it can start */
+	any = df_re_set(&rp);
+	memset(rp.sets[any], 0xff, sizeof(rp.sets[any]));
+	re->sets = rp.sets;
+	re->nsets = rp.nsets;
+	rp.sets = NULL;
+	df_re_classes(re);
+
+	if ((match = df_re_nfa_add(re, DF_RE_MATCH, 0, 0, 0)) == DF_RE_ERR ||
+	    (re->fwd.root = df_re_emit(re, &rp, root, match, 0)) ==
+	    DF_RE_ERR ||
+	    (root = df_re_emit(re, &rp, root, match, 1)) == DF_RE_ERR ||
+	    (loop = df_re_nfa_add(re, DF_RE_SPLIT, 0, 0, root)) ==
+	    DF_RE_ERR ||
+	    (any = df_re_nfa_add(re, DF_RE_SET, any, loop, 0)) ==
+	    DF_RE_ERR) {
+		rp.err = "too big";
+		goto bad;
+	}
+	re->nfa[loop].out = any;
+	re->rev.root = loop;
+	df_re_dfa_init(re, &re->fwd);
+	df_re_dfa_init(re, &re->rev);
+	free(rp.ast);
+	DPRINTF(2, "regex: %u nodes, %u NFA states, %u classes", rp.nast,
+	    re->nnfa, re->nclasses);
+
+	return (re);
+bad:
+	*errstr = rp.err;
+	free(rp.ast);
+	free(rp.sets);
+	free(re->sets);
+	free(re->nfa);
+	free(re);
+	return (NULL);
+}
+
+void
+df_re_free(struct df_re *re)
+{
+	if (re == NULL)
+		return;
+	df_re_dfa_free(&re->fwd);
+	df_re_dfa_free(&re->rev);
+	free(re->nfa);
+	free(re->sets);
+	free(re);
+}
+
+/*
+ * Find the leftmost longest match of re in the n bytes at p. Returns 1
+ * and where it starts and ends in so and eo if there's one, 0 if not.
+ */
+int
+df_re_exec(struct df_re *re, const u_char *p, size_t n, size_t *so,
+    size_t *eo)
+{
+	int64_t		 k;
+	size_t		 s;
+
+	if ((k = df_re_scan(re, &re->rev, p, n, 1, 1)) == -1)
+		return (0);
+	s = n - k;
+	if ((k = df_re_scan(re, &re->fwd, p + s, n - s, 0,
+	    s == 0 || p[s - 1] == '\n')) == -1)
+		return (0);
+	*so = s;
+	*eo = s + k;
+
+	return (1);
+}
+
+/*
+ * alternation: concatenation ('|' concatenation)*
+ */
+u_int32_t
+df_re_alt(struct df_re_parser *rp)
+{
+	u_int32_t	 l, r;
+
+	if ((l = df_re_cat(rp)) == DF_RE_ERR)
+		return (DF_RE_ERR);
+	while (rp->p < rp->end && *rp->p == '|') {
+		rp->p++;
+		if ((r = df_re_cat(rp)) == DF_RE_ERR)
+			return (DF_RE_ERR);
+		l = df_re_node(rp, DF_RE_ALT, l, r);
+	}
+
+	return (df_re_toobig(rp, l));
+}
+
+/*
+ * concatenation: repetition*
+ */
+u_int32_t
+df_re_cat(struct df_re_parser *rp)
+{
+	u_int32_t	 l = DF_RE_ERR, r;
+
+	while (rp->p < rp->end && *rp->p != '|' && *rp->p != ')') {
+		if ((r = df_re_rep(rp)) == DF_RE_ERR)
+			return (DF_RE_ERR);
+		l = l == DF_RE_ERR ? r : df_re_node(rp, DF_RE_CAT, l, r);
+	}
+
+	return (l == DF_RE_ERR ? df_re_node(rp, DF_RE_EMPTY, 0, 0) : l);
+}
+
+/*
+ * repetition: atom ('*' | '+' | '?' | '{' m [',' [n]] '}')*
+ */
+u_int32_t
+df_re_rep(struct df_re_parser *rp)
+{
+	u_int32_t	 a, min, max;
+
+	if ((a = df_re_atom(rp)) == DF_RE_ERR)
+		return (DF_RE_ERR);
+	while (rp->p < rp->end) {
+		switch (*rp->p) {
+		case '*':
+			min = 0;
+			max = DF_RE_INF;
+			break;
+		case '+':
+			min = 1;
+			max = DF_RE_INF;
+			break;
+		case '?':
+			min = 0;
+			max = 1;
+			break;
+		case '{':
+			/* Not a count, a literal { */
+			if (rp->p + 1 == rp->end || !isdigit(rp->p[1]))
+				return (a);
+			rp->p++;
+			min = max = df_re_count(rp);
+			if (rp->p < rp->end && *rp->p == ',') {
+				rp->p++;
+				max = DF_RE_INF;
+				if (rp->p < rp->end && isdigit(*rp->p))
+					max = df_re_count(rp);
+			}
+			if (rp->p == rp->end || *rp->p != '}' ||
+			    min > DF_RE_MAXREP ||
+			    (max != DF_RE_INF && (max > DF_RE_MAXREP ||
+			    max < min))) {
+				rp->err = "bad {m,n}";
+				return (DF_RE_ERR);
+			}
+			break;
+		default:
+			return (a);
+		}
+		rp->p++;
+		a = df_re_node(rp, DF_RE_REP, a, 0);
+		rp->ast[a].min = min;
+		rp->ast[a].max = max;
+		/* Counts multiply, so stop before they get out of hand */
+		rp->ast[a].cost = MIN(rp->ast[rp->ast[a].a].cost *
+		    MAX(max == DF_RE_INF ? min : max, 1) + 1,
+		    DF_RE_MAXNFA + 1);
+		if (df_re_toobig(rp, a) == DF_RE_ERR)
+			return (DF_RE_ERR);
+	}
+
+	return (a);
+}
+
+/*
+ * The decimal number at rp->p, more than DF_RE_MAXREP if it's too big.
+ */
+u_int32_t
+df_re_count(struct df_re_parser *rp)
+{
+	u_int32_t	 n = 0;
+
+	for (; rp->p < rp->end && isdigit(*rp->p); rp->p++)
+		if (n <= DF_RE_MAXREP)
+			n = n * 10 + *rp->p - '0';
+
+	return (n);
+}
+
+/*
+ * atom: '(' alternation ')' | '[' bracket | '.' | '^' | '$' | '\' c | c
+ */
+u_int32_t
+df_re_atom(struct df_re_parser *rp)
+{
+	u_int32_t	 a, s;
+	int		 c, i;
+
+	switch (c = *rp->p++) {
+	case '(':
+		if (++rp->depth > DF_RE_MAXDEPTH) {
+			rp->err = "too deeply nested";
+			return (DF_RE_ERR);
+		}
+		if ((a = df_re_alt(rp)) == DF_RE_ERR)
+			return (DF_RE_ERR);
+		if (rp->p == rp->end || *rp->p != ')') {
+			rp->err = "unmatched (";
+			return (DF_RE_ERR);
+		}
+		rp->p++;
+		rp->depth--;
+		return (a);
+	case '[':
+		return (df_re_bracket(rp));
+	case '^':
+		return (df_re_node(rp, DF_RE_BOL, 0, 0));
+	case '$':
+		return (df_re_node(rp, DF_RE_EOL, 0, 0));
+	case '*':
+	case '+':
+	case '?':
+		rp->err = "nothing to repeat";
+		return (DF_RE_ERR);
+	case '.':
+		s = df_re_set(rp);
+		memset(rp->sets[s], 0xff, sizeof(rp->sets[s]));
+		DF_RE_DEL(rp->sets[s], '\n');
+		return (df_re_node(rp, DF_RE_SET, s, 0));
+	case '\\':
+		if (rp->p == rp->end) {
+			rp->err = "trailing \\";
+			return (DF_RE_ERR);
+		}
+		c = *rp->p++;
+		if (isdigit(c)) {
+			rp->err = "back references not supported";
+			return (DF_RE_ERR);
+		}
+		if (strchr("<>bB`'", c) != NULL) {
+			rp->err = "word boundaries not supported";
+			return (DF_RE_ERR);
+		}
+		/* What GNU regex has for [[:alnum:]_], [[:space:]] */
+		if (c == 'w' || c == 'W' || c == 's' || c == 'S') {
+			s = df_re_set(rp);
+			for (i = 0; i < 256; i++)
+				if (tolower(c) == 'w' ?
+				    isalnum(i) || i == '_' : isspace(i))
+					DF_RE_ADD(rp->sets[s], i);
+			if (isupper(c))
+				df_re_invert(rp->sets[s]);
+			return (df_re_node(rp, DF_RE_SET, s, 0));
+		}
+		break;
+	}
+
+	s = df_re_set(rp);
+	DF_RE_ADD(rp->sets[s], c);
+	if (rp->icase)
+		df_re_fold(rp->sets[s]);
+
+	return (df_re_node(rp, DF_RE_SET, s, 0));
+}
+
+/*
+ * bracket: '^'? ']'? (c | c '-' c | '[:' class ':]' | '[.' c '.]' |
+ *	'[=' c '=]')* ']'
+ */
+u_int32_t
+df_re_bracket(struct df_re_parser *rp)
+{
+	u_int32_t	 s = df_re_set(rp);
+	u_char		*set = rp->sets[s];
+	int		 neg = 0, lo, hi, i, b;
+
+	if (rp->p < rp->end && *rp->p == '^') {
+		neg = 1;
+		rp->p++;
+	}
+	for (i = 0; rp->p < rp->end && (*rp->p != ']' || i == 0); i++) {
+		if ((lo = df_re_bracket_char(rp, set)) == -1)
+			return (DF_RE_ERR);
+		if (lo == -2)
+			continue;
+		hi = lo;
+		if (rp->end - rp->p >= 2 && rp->p[0] == '-' &&
+		    rp->p[1] != ']') {
+			rp->p++;
+			if ((hi = df_re_bracket_char(rp, set)) == -1)
+				return (DF_RE_ERR);
+			if (hi < lo) {
+				rp->err = "bad range";
+				return (DF_RE_ERR);
+			}
+		}
+		for (b = lo; b <= hi; b++)
+			DF_RE_ADD(set, b);
+	}
+	if (rp->p == rp->end) {
+		rp->err = "unmatched [";
+		return (DF_RE_ERR);
+	}
+	rp->p++;
+	if (rp->icase)
+		df_re_fold(set);
+	if (neg) {
+		df_re_invert(set);
+		DF_RE_DEL(set, '\n');
+	}
+
+	return (df_re_node(rp, DF_RE_SET, s, 0));
+}
+
+/*
+ * One member of a bracket expression. Returns it if a byte, -2 if a
+ * class, which is added to set, -1 on error.
+ */
+int
+df_re_bracket_char(struct df_re_parser *rp, u_char *set)
+{
+	const u_char	*name, *e;
+	size_t		 len;
+	int		 kind, i, b;
+
+	if (rp->end - rp->p < 2 || rp->p[0] != '[' ||
+	    (rp->p[1] != ':' && rp->p[1] != '.' && rp->p[1] != '='))
+		return (*rp->p++);
+	kind = rp->p[1];
+	name = rp->p + 2;
+	for (e = name; e + 1 < rp->end && (e[0] != kind || e[1] != ']'); e++)
+		;
+	if (e + 1 >= rp->end) {
+		rp->err = "unmatched [";
+		return (-1);
+	}
+	rp->p = e + 2;
+	len = e - name;
+	if (kind != ':') {
+		/* Only single characters, we have no collating elements */
+		if (len != 1) {
+			rp->err = "bad collating element";
+			return (-1);
+		}
+		return (name[0]);
+	}
+	for (i = 0; df_re_ctypes[i].name != NULL; i++)
+		if (strlen(df_re_ctypes[i].name) == len &&
+		    memcmp(df_re_ctypes[i].name, name, len) == 0)
+			break;
+	if (df_re_ctypes[i].name == NULL) {
+		rp->err = "bad character class";
+		return (-1);
+	}
+	for (b = 0; b < 256; b++)
+		if (df_re_ctypes[i].is(b))
+			DF_RE_ADD(set, b);
+
+	return (-2);
+}
+
+/*
+ * Make set match either case of the letters it has.
+ */
+void
+df_re_fold(u_char *set)
+{
+	int	 b;
+
+	for (b = 0; b < 256; b++)
+		if (DF_RE_ISSET(set, b) && isalpha(b)) {
+			DF_RE_ADD(set, tolower(b));
+			DF_RE_ADD(set, toupper(b));
+		}
+}
+
+void
+df_re_invert(u_char *set)
+{
+	int	 i;
+
+	for (i = 0; i < 32; i++)
+		set[i] = ~set[i];
+}
+
+u_int32_t
+df_re_node(struct df_re_parser *rp, int type, u_int32_t a, u_int32_t b)
+{
+	struct df_re_ast	*n;
+
+	if (rp->nast == rp->ast_alloc) {
+		rp->ast_alloc = rp->ast_alloc ? rp->ast_alloc * 2 : 64;
+		if ((rp->ast = reallocarray(rp->ast, rp->ast_alloc,
+		    sizeof(*rp->ast))) == NULL)
+			err(1, "reallocarray");
+	}
+	n = &rp->ast[rp->nast];
+	n->type = type;
+	n->min = n->max = 0;
+	n->a = a;
+	n->b = b;
+	if (type == DF_RE_CAT || type == DF_RE_ALT)
+		n->cost = MIN(rp->ast[a].cost + rp->ast[b].cost + 1,
+		    DF_RE_MAXNFA + 1);
+	else
+		n->cost = 1;
+
+	return (rp->nast++);
+}
+
+/*
+ * Refuse the tree at a if it would make more NFA states than we allow.
+ */
+u_int32_t
+df_re_toobig(struct df_re_parser *rp, u_int32_t a)
+{
+	if (a == DF_RE_ERR || rp->ast[a].cost <= DF_RE_MAXNFA)
+		return (a);
+	rp->err = "too big";
+
+	return (DF_RE_ERR);
+}
+
+/*
+ * A new empty byte set, the last one in rp->sets.
+ */
+u_int32_t
+df_re_set(struct df_re_parser *rp)
+{
+	if (rp->nsets == rp->sets_alloc) {
+		rp->sets_alloc = rp->sets_alloc ? rp->sets_alloc * 2 : 16;
+		if ((rp->sets = reallocarray(rp->sets, rp->sets_alloc,
+		    sizeof(*rp->sets))) == NULL)
+			err(1, "reallocarray");
+	}
+	bzero(rp->sets[rp->nsets], sizeof(rp->sets[rp->nsets]));
+
+	return (rp->nsets++);
+}
+
+/*
+ * Split the bytes into classes that no set, nor the newline that ^ and $
+ * care about, tells apart, and note a byte of each.
+ */
+void
+df_re_classes(struct df_re *re)
+{
+	int16_t		 remap[256][2];
+	u_int32_t	 s;
+	int		 b, in, n = 1;
+
+	bzero(re->classes, sizeof(re->classes));
+	for (s = 0; s <= re->nsets; s++) {
+		memset(remap, 0xff, sizeof(remap));
+		for (n = 0, b = 0; b < 256; b++) {
+			in = s == re->nsets ? b == '\n' :
+			    DF_RE_ISSET(re->sets[s], b) != 0;
+			if (remap[re->classes[b]][in] == -1)
+				remap[re->classes[b]][in] = n++;
+			re->classes[b] = remap[re->classes[b]][in];
+		}
+	}
+	re->nclasses = n;
+	for (b = 255; b >= 0; b--)
+		re->rep[re->classes[b]] = b;
+}
+
+/*
+ * Add an NFA state, DF_RE_ERR if there are too many.
+ */
+u_int32_t
+df_re_nfa_add(struct df_re *re, int type, u_int32_t set, u_int32_t out,
+    u_int32_t out1)
+{
+	struct df_re_nfa	*n;
+
+	if (re->nnfa == DF_RE_MAXNFA)
+		return (DF_RE_ERR);
+	if (re->nnfa == re->nfa_alloc) {
+		re->nfa_alloc = re->nfa_alloc ? re->nfa_alloc * 2 : 64;
+		if ((re->nfa = reallocarray(re->nfa, re->nfa_alloc,
+		    sizeof(*re->nfa))) == NULL)
+			err(1, "reallocarray");
+	}
+	n = &re->nfa[re->nnfa];
+	n->type = type;
+	n->set = set;
+	n->out = out;
+	n->out1 = out1;
+
+	return (re->nnfa++);
+}
+
+/*
+ * Make NFA states for the tree at a, reversed if rev, that go on to next
+ * once it matched. Returns the first of them.
+ */
+u_int32_t
+df_re_emit(struct df_re *re, const struct df_re_parser *rp, u_int32_t a,
+    u_int32_t next, int rev)
+{
+	const struct df_re_ast	*n = &rp->ast[a];
+	u_int32_t		 s, t, i;
+
+	if (next == DF_RE_ERR)
+		return (DF_RE_ERR);
+	switch (n->type) {
+	case DF_RE_EMPTY:
+		return (next);
+	case DF_RE_SET:
+		return (df_re_nfa_add(re, DF_RE_SET, n->a, next, 0));
+	case DF_RE_BOL:
+	case DF_RE_EOL:
+		/* Backwards, the start of a line is where it ends */
+		return (df_re_nfa_add(re, (n->type == DF_RE_BOL) != rev ?
+		    DF_RE_BOL : DF_RE_EOL, 0, next, 0));
+	case DF_RE_CAT:
+		if (rev)
+			return (df_re_emit(re, rp, n->b,
+			    df_re_emit(re, rp, n->a, next, rev), rev));
+		return (df_re_emit(re, rp, n->a,
+		    df_re_emit(re, rp, n->b, next, rev), rev));
+	case DF_RE_ALT:
+		if ((s = df_re_emit(re, rp, n->a, next, rev)) == DF_RE_ERR ||
+		    (t = df_re_emit(re, rp, n->b, next, rev)) == DF_RE_ERR)
+			return (DF_RE_ERR);
+		return (df_re_nfa_add(re, DF_RE_SPLIT, 0, s, t));
+	case DF_RE_REP:
+		s = next;
+		if (n->max == DF_RE_INF) {
+			/* A loop back to before it, or on */
+			if ((s = df_re_nfa_add(re, DF_RE_SPLIT, 0, 0,
+			    next)) == DF_RE_ERR ||
+			    (t = df_re_emit(re, rp, n->a, s, rev)) ==
+			    DF_RE_ERR)
+				return (DF_RE_ERR);
+			re->nfa[s].out = t;
+		} else {
+			/* Each of those after the first min may be skipped */
+			for (i = n->min; i < n->max && s != DF_RE_ERR; i++)
+				if ((t = df_re_emit(re, rp, n->a, s, rev)) ==
+				    DF_RE_ERR ||
+				    (s = df_re_nfa_add(re, DF_RE_SPLIT, 0, t,
+				    next)) == DF_RE_ERR)
+					return (DF_RE_ERR);
+		}
+		for (i = 0; i < n->min && s != DF_RE_ERR; i++)
+			s = df_re_emit(re, rp, n->a, s, rev);
+		return (s);
+	default:
+		return (DF_RE_ERR);
+	}
+}
+
+void
+df_re_dfa_init(struct df_re *re, struct df_re_dfa *d)
+{
+	pthread_mutex_init(&d->lock, NULL);
+	/* Mostly never touched, so left to calloc to be cheap about */
+	if ((d->delta = calloc(DF_RE_MAXDFA * re->nclasses,
+	    sizeof(*d->delta))) == NULL ||
+	    (d->states = calloc(DF_RE_MAXDFA, sizeof(*d->states))) == NULL)
+		err(1, "calloc");
+	df_re_work_init(re, &d->work);
+}
+
+void
+df_re_dfa_free(struct df_re_dfa *d)
+{
+	pthread_mutex_destroy(&d->lock);
+	free(d->delta);
+	free(d->states);
+	free(d->pool);
+	df_re_work_free(&d->work);
+}
+
+void
+df_re_work_init(struct df_re *re, struct df_re_work *w)
+{
+	bzero(w, sizeof(*w));
+	if ((w->mark = calloc(re->nnfa, sizeof(*w->mark))) == NULL ||
+	    (w->cur = calloc(re->nnfa, sizeof(*w->cur))) == NULL ||
+	    (w->next = calloc(re->nnfa, sizeof(*w->next))) == NULL ||
+	    (w->mid = calloc(re->nnfa, sizeof(*w->mid))) == NULL ||
+	    (w->stack = calloc(re->nnfa, sizeof(*w->stack))) == NULL)
+		err(1, "calloc");
+}
+
+void
+df_re_work_free(struct df_re_work *w)
+{
+	free(w->mark);
+	free(w->cur);
+	free(w->next);
+	free(w->mid);
+	free(w->stack);
+}
+
+/*
+ * Add NFA state s, and those it leads to without reading a byte, to the
+ * n states at out, given whether we're at the start and at the end of a
+ * line. An end of line we can't know yet is kept for the next byte to
+ * decide. w->gen is bumped for each new set.
+ */
+void
+df_re_closure(struct df_re *re, struct df_re_work *w, u_int32_t s, int bol,
+    int eol, u_int16_t *out, u_int32_t *n)
+{
+	const struct df_re_nfa	*ns;
+	u_int32_t		 sp = 0;
+
+	DF_RE_PUSH(w, sp, s);
+	while (sp > 0) {
+		s = w->stack[--sp];
+		ns = &re->nfa[s];
+		switch (ns->type) {
+		case DF_RE_SPLIT:
+			DF_RE_PUSH(w, sp, ns->out1);
+			DF_RE_PUSH(w, sp, ns->out);
+			break;
+		case DF_RE_BOL:
+			if (bol)
+				DF_RE_PUSH(w, sp, ns->out);
+			break;
+		case DF_RE_EOL:
+			if (eol)
+				DF_RE_PUSH(w, sp, ns->out);
+			else
+				out[(*n)++] = s;
+			break;
+		default:
+			out[(*n)++] = s;
+			break;
+		}
+	}
+}
+
+/*
+ * Start a new set of NFA states.
+ */
+void
+df_re_gen(struct df_re *re, struct df_re_work *w)
+{
+	if (++w->gen == 0) {
+		bzero(w->mark, re->nnfa * sizeof(*w->mark));
+		w->gen = 1;
+	}
+}
+
+/*
+ * The DF_RE_D* flags of the n NFA states at set.
+ */
+int
+df_re_flags(struct df_re *re, struct df_re_work *w, const u_int16_t *set,
+    u_int32_t n, int bol)
+{
+	u_int32_t	 i, m = 0;
+	int		 flags = bol ? DF_RE_DBOL : 0, eol = 0;
+
+	if (n == 0)
+		return (flags | DF_RE_DDEAD);
+	for (i = 0; i < n; i++) {
+		if (re->nfa[set[i]].type == DF_RE_MATCH)
+			flags |= DF_RE_DMATCH | DF_RE_DEOLMATCH;
+		if (re->nfa[set[i]].type == DF_RE_EOL)
+			eol = 1;
+	}
+	if ((flags & DF_RE_DMATCH) || !eol)
+		return (flags);
+	/* Whether it has matched if a line ends here */
+	df_re_gen(re, w);
+	for (i = 0; i < n; i++)
+		df_re_closure(re, w, set[i], bol, 1, w->mid, &m);
+	for (i = 0; i < m; i++)
+		if (re->nfa[w->mid[i]].type == DF_RE_MATCH)
+			return (flags | DF_RE_DEOLMATCH);
+
+	return (flags);
+}
+
+int
+df_re_cmp(const void *a, const void *b)
+{
+	return (*(const u_int16_t *)a - *(const u_int16_t *)b);
+}
+
+/*
+ * The DFA state for the n NFA states at set, sorted, DF_RE_NONE if there
+ * isn't one yet; where it would go in d->hash in slot, if not NULL. Takes
+ * d->lock held, or d full, as then nothing in it changes any more.
+ */
+u_int32_t
+df_re_find(struct df_re_dfa *d, const u_int16_t *set, u_int32_t n, int bol,
+    u_int32_t *slot)
+{
+	const struct df_re_dstate	*st;
+	u_int32_t			 h = bol, i, k;
+
+	for (i = 0; i < n; i++)
+		h = (h ^ set[i]) * 16777619;
+	for (i = h & (DF_RE_HASH - 1); (k = d->hash[i]) != 0;
+	    i = (i + 1) & (DF_RE_HASH - 1)) {
+		st = &d->states[k - 1];
+		if (st->len == n && !(st->flags & DF_RE_DBOL) == !bol &&
+		    memcmp(d->pool + st->set, set, n * sizeof(*set)) == 0)
+			return (k - 1);
+	}
+	if (slot != NULL)
+		*slot = i;
+
+	return (DF_RE_NONE);
+}
+
+/*
+ * Make the n NFA states in d->work.next, sorted, the current set: return
+ * the DFA state for them, adding it if it's new and there's room. If there
+ * isn't, return DF_RE_NONE with them copied to d->work.cur and their flags
+ * in d->work.curflags. Called with d->lock held.
+ */
+u_int32_t
+df_re_dfa_add(struct df_re *re, struct df_re_dfa *d, u_int32_t n, int bol)
+{
+	struct df_re_work	*w = &d->work;
+	struct df_re_dstate	*st;
+	u_int32_t		 i, k;
+
+	if ((k = df_re_find(d, w->next, n, bol, &i)) != DF_RE_NONE)
+		return (k);
+	if (d->nstates == DF_RE_MAXDFA) {
+		memcpy(w->cur, w->next, n * sizeof(*w->next));
+		w->ncur = n;
+		w->curflags = df_re_flags(re, w, w->cur, n, bol);
+		return (DF_RE_NONE);
+	}
+	while (d->pool_len + n > d->pool_alloc) {
+		d->pool_alloc = d->pool_alloc ? d->pool_alloc * 2 : 1024;
+		if ((d->pool = reallocarray(d->pool, d->pool_alloc,
+		    sizeof(*d->pool))) == NULL)
+			err(1, "reallocarray");
+	}
+	st = &d->states[d->nstates];
+	st->set = d->pool_len;
+	st->len = n;
+	memcpy(d->pool + st->set, w->next, n * sizeof(*w->next));
+	d->pool_len += n;
+	st->flags = df_re_flags(re, w, d->pool + st->set, n, bol);
+	d->hash[i] = ++d->nstates;
+
+	return (d->nstates - 1);
+}
+
+/*
+ * The state d starts in, at the start of a line if bol. See above for
+ * DF_RE_NONE. Called with d->lock held.
+ */
+u_int32_t
+df_re_start(struct df_re *re, struct df_re_dfa *d, int bol)
+{
+	u_int32_t	 n = 0, s;
+
+	if ((s = d->start[bol]) != 0)
+		return (s - 1);
+	df_re_gen(re, &d->work);
+	df_re_closure(re, &d->work, d->root, bol, 0, d->work.next, &n);
+	qsort(d->work.next, n, sizeof(*d->work.next), df_re_cmp);
+	if ((s = df_re_dfa_add(re, d, n, bol)) != DF_RE_NONE)
+		__atomic_store_n(&d->start[bol], s + 1, __ATOMIC_RELEASE);
+
+	return (s);
+}
+
+/*
+ * Work out in w->next, sorted, the NFA states the n at set go to on a
+ * byte of class c. Returns how many there are.
+ */
+u_int32_t
+df_re_move(struct df_re *re, struct df_re_work *w, const u_int16_t *set,
+    u_int32_t n, int bol, int c)
+{
+	const struct df_re_nfa	*ns;
+	const u_int16_t		*in = set;
+	u_int32_t		 i, m = 0;
+	int			 b = re->rep[c], nl = b == '\n';
+
+	/* A newline first lets through the ends of line waiting for it */
+	if (nl) {
+		df_re_gen(re, w);
+		for (i = 0; i < n; i++)
+			df_re_closure(re, w, set[i], bol, 1, w->mid, &m);
+		in = w->mid;
+		n = m;
+	}
+	df_re_gen(re, w);
+	for (i = 0, m = 0; i < n; i++) {
+		ns = &re->nfa[in[i]];
+		if (ns->type == DF_RE_SET && DF_RE_ISSET(re->sets[ns->set], b))
+			df_re_closure(re, w, ns->out, nl, 0, w->next, &m);
+	}
+	qsort(w->next, m, sizeof(*w->next), df_re_cmp);
+
+	return (m);
+}
+
+/*
+ * Where d goes from the n NFA states at set on a byte of class c. See
+ * above for DF_RE_NONE. Called with d->lock held.
+ */
+u_int32_t
+df_re_step(struct df_re *re, struct df_re_dfa *d, const u_int16_t *set,
+    u_int32_t n, int bol, int c)
+{
+	return (df_re_dfa_add(re, d, df_re_move(re, &d->work, set, n, bol, c),
+	    re->rep[c] == '\n'));
+}
+
+/*
+ * Take over the set of NFA states d->work.cur, which has no DFA state, to
+ * go on from without d->lock: into w, or new scratch if w is NULL. Called
+ * with d->lock held.
+ */
+struct df_re_work *
+df_re_off(struct df_re *re, struct df_re_dfa *d, struct df_re_work *w)
+{
+	if (w == NULL) {
+		if ((w = malloc(sizeof(*w))) == NULL)
+			err(1, "malloc");
+		df_re_work_init(re, w);
+	}
+	memcpy(w->cur, d->work.cur, d->work.ncur * sizeof(*w->cur));
+	w->ncur = d->work.ncur;
+	w->curflags = d->work.curflags;
+
+	return (w);
+}
+
+/*
+ * Run d over the n bytes at p, backwards if rev, starting at the start of
+ * a line if bol. Returns the most bytes after which it had matched, -1 if
+ * it never did.
+ */
+int64_t
+df_re_scan(struct df_re *re, struct df_re_dfa *d, const u_char *p,
+    size_t n, int rev, int bol)
+{
+	const struct df_re_dstate	*st;
+	struct df_re_work		*w = NULL;
+	int64_t				 last = -1;
+	size_t				 k;
+	u_int32_t			 s, t, m, nc = re->nclasses;
+	u_int16_t			*set;
+	int				 c, x, flags, nl;
+
+	if ((s = __atomic_load_n(&d->start[bol], __ATOMIC_ACQUIRE)) != 0)
+		s--;
+	else {
+		pthread_mutex_lock(&d->lock);
+		if ((s = df_re_start(re, d, bol)) == DF_RE_NONE)
+			w = df_re_off(re, d, w);
+		pthread_mutex_unlock(&d->lock);
+	}
+	for (k = 0; ; k++) {
+		x = k == n ? -1 : rev ? p[n - 1 - k] : p[k];
+		flags = s == DF_RE_NONE ? w->curflags : d->states[s].flags;
+		if ((flags & DF_RE_DMATCH) || ((flags & DF_RE_DEOLMATCH) &&
+		    (x == -1 || x == '\n')))
+			last = k;
+		if (x == -1 || (flags & DF_RE_DDEAD))
+			break;
+		c = re->classes[x];
+		if (s != DF_RE_NONE && (t = __atomic_load_n(&d->delta[s * nc +
+		    c], __ATOMIC_ACQUIRE)) != 0) {
+			s = t - 1;
+			continue;
+		}
+		/*
+		 * Off the map, d is full and so no longer changes: work out
+		 * where we go in our own scratch, without the lock, and look
+		 * whether that gets us back on.
+		 */
+		if (s == DF_RE_NONE) {
+			m = df_re_move(re, w, w->cur, w->ncur,
+			    w->curflags & DF_RE_DBOL, c);
+			nl = re->rep[c] == '\n';
+			if ((s = df_re_find(d, w->next, m, nl, NULL)) ==
+			    DF_RE_NONE) {
+				set = w->cur;
+				w->cur = w->next;
+				w->next = set;
+				w->ncur = m;
+				w->curflags = df_re_flags(re, w, w->cur, m, nl);
+			}
+			continue;
+		}
+		/* Not been this way yet */
+		pthread_mutex_lock(&d->lock);
+		st = &d->states[s];
+		t = df_re_step(re, d, d->pool + st->set, st->len,
+		    st->flags & DF_RE_DBOL, c);
+		if (t != DF_RE_NONE)
+			__atomic_store_n(&d->delta[s * nc + c], t + 1,
+			    __ATOMIC_RELEASE);
+		else
+			w = df_re_off(re, d, w);
+		pthread_mutex_unlock(&d->lock);
+		s = t;
+	}
+	if (w != NULL) {
+		df_re_work_free(w);
+		free(w);
+	}
+
+	return (last);
+}
@@ -0,0 +1,488 @@
+/*
+ * Copyright (c) 2011, Edd Barrett <vext01@gmail.com>
+ * Copyright (c) 2011, Christiano F. Haesbaert <haesbaert@haesbaert.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Behaviour checks for what the tests of a magic file are built on: the
+ * regex matcher against regexec(3), the vector ways of finding a search
+ * pattern and of comparing lanes against the plain C ones, and files
+ * classified through the index against testing every rule in turn. What
+ * doesn't agree goes to stderr and makes the exit status 1.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defile.h"
+#include "file.h"
+
+/* Subjects made up for each pattern, and the threads sharing them */
+#define TEST_SUBJECTS	2000
+#define TEST_SUBJLEN	300
+#define TEST_THREADS	4
+
+/* Buffers searched, every size up to this and a few past */
+#define TEST_BUFMAX	160
+#define TEST_EDGE	80	/* Patterns this near an end of bigger ones */
+#define TEST_PATMAX	40
+
+/* Values compared against each set of lanes */
+#define TEST_VALUES	10000
+
+struct test_regex {
+	const char	*pat;
+	int		 icase;
+	const char	*alpha;		/* Subjects are made of these */
+	struct df_re	*re;
+	regex_t		 rx;
+};
+
+void __dead	 usage(void);
+u_int64_t	 test_rand(u_int64_t *);
+int		 test_regex_one(struct test_regex *, const char *, size_t);
+void		*test_regex_thread(void *);
+void		 test_regex(void);
+void		 test_memfind_one(const struct df_memfind_impl *,
+		    const u_char *, size_t, size_t, const u_char *, size_t);
+void		 test_memfind_size(const struct df_memfind_impl *, size_t,
+		    const u_char *, size_t, u_int64_t *);
+void		 test_memfind(void);
+void		 test_lanes(void);
+int		 test_classify(struct defile *, const char *, const u_char *,
+		    size_t, char *, size_t);
+void		 test_magic(const char *, int, char **);
+
+extern char	*__progname;
+
+/*
+ * The patterns, with the bytes it takes to match them and a few more.
+ * The first blows the DFA past DF_RE_MAXDFA states, so most of its
+ * subjects are matched off the states that were kept.
+ */
+struct test_regex test_regexes[] = {
+	{ "(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)", 0,
+	    "aaaabbbbc\n" },
+	{ "(ab|a)(bc|c)?",		0,	"aabbcc\n" },
+	{ "a*ab*",			0,	"aab\n" },
+	{ "x[0-9]+y|q(a|b)*",		0,	"xy01qab\n" },
+	{ "^ab+c$",			0,	"abbc\n" },
+	{ "^$",				0,	"a\n" },
+	{ "$",				0,	"ab\n" },
+	{ "b$|^a",			0,	"aabb\n" },
+	{ "[^a\n]+",			0,	"aab \n" },
+	{ "a.c",			0,	"abc\n" },
+	{ "(a|ab)(c|bcd)(d*)",		0,	"abcd\n" },
+	{ "a{2,3}b{0,1}",		0,	"aab\n" },
+	{ "key=[a-z]*;",		0,	"key=ab;\n" },
+	{ "[[:digit:]]+\\.[0-9]*",	0,	"12.a\n" },
+	{ "heLLo|WORLD",		1,	"hHeElLoOwWrRdD\n" },
+	{ "[a-c]x",			1,	"aBcXx\n" },
+	{ NULL,				0,	NULL }
+};
+
+/* A few chosen to start and end at the edges */
+const char *test_subjects[] = {
+	"", "\n", "a", "ab", "abc\n", "\nabc", "abbc", "ab\nabbc\n",
+	"aaaaaaaaaaaaaaaaaaaaaaab", "xy x0y q", "key=;key=abc;",
+	"12.34", "HELLO, world", "Hello\nWorld\n", "AXbx", NULL
+};
+
+/* Pattern lengths, around the widths of the vectors */
+size_t	test_patlens[] = { 1, 2, 3, 4, 15, 16, 17, 31, 32, 33, TEST_PATMAX, 0 };
+size_t	test_bigbufs[] = { 255, 256, 257, 1000, 4096, 0 };
+
+int		 test_failed;
+pthread_mutex_t	 test_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void __dead
+usage(void)
+{
+	fprintf(stderr, "usage: %s regex | memfind | lanes\n"
+	    "       %s magic magic-file file ...\n", __progname, __progname);
+	exit(1);
+}
+
+/*
+ * splitmix64, so that every run tests the same things.
+ */
+u_int64_t
+test_rand(u_int64_t *state)
+{
+	u_int64_t	 z;
+
+	z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+	return (z ^ (z >> 31));
+}
+
+/*
+ * Match the n bytes at s, which have a NUL after them, both ways and
+ * return 0 if the answers are the same.
+ */
+int
+test_regex_one(struct test_regex *t, const char *s, size_t n)
+{
+	regmatch_t	 m;
+	size_t		 so, eo;
+	int		 a, b;
+
+	a = regexec(&t->rx, s, 1, &m, 0) == 0;
+	b = df_re_exec(t->re, (const u_char *)s, n, &so, &eo);
+	if (a == b && (a == 0 ||
+	    ((size_t)m.rm_so == so && (size_t)m.rm_eo == eo)))
+		return (0);
+
+	pthread_mutex_lock(&test_lock);
+	test_failed = 1;
+	fprintf(stderr, "regex \"%s\"%s on \"", t->pat,
+	    t->icase ? " (icase)" : "");
+	fwrite(s, 1, n, stderr);
+	fprintf(stderr, "\": regexec ");
+	if (a)
+		fprintf(stderr, "%lld-%lld", (long long)m.rm_so,
+		    (long long)m.rm_eo);
+	else
+		fprintf(stderr, "none");
+	fprintf(stderr, ", df_re_exec ");
+	if (b)
+		fprintf(stderr, "%zu-%zu\n", so, eo);
+	else
+		fprintf(stderr, "none\n");
+	pthread_mutex_unlock(&test_lock);
+
+	return (-1);
+}
+
+/*
+ * Match every pattern against subjects made up of its bytes, each thread
+ * its own. They share the DFAs, as the threads of file(1) do.
+ */
+void *
+test_regex_thread(void *arg)
+{
+	struct test_regex	*t;
+	u_int64_t		 seed = (u_int64_t)(uintptr_t)arg;
+	char			 s[TEST_SUBJLEN + 1];
+	size_t			 n, k, na;
+	int			 i;
+
+	for (i = 0; i < TEST_SUBJECTS; i++) {
+		for (t = test_regexes; t->pat != NULL; t++) {
+			na = strlen(t->alpha);
+			n = test_rand(&seed) % (TEST_SUBJLEN + 1);
+			for (k = 0; k < n; k++)
+				s[k] = t->alpha[test_rand(&seed) % na];
+			s[n] = '\0';
+			test_regex_one(t, s, n);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Every pattern on the chosen subjects first, then on made up ones from
+ * several threads at once.
+ */
+void
+test_regex(void)
+{
+	struct test_regex	*t;
+	pthread_t		 th[TEST_THREADS];
+	const char		*errstr, **s;
+	uintptr_t		 i;
+
+	for (t = test_regexes; t->pat != NULL; t++) {
+		t->re = df_re_compile((const u_char *)t->pat, strlen(t->pat),
+		    t->icase, &errstr);
+		if (t->re == NULL)
+			errx(1, "%s: %s", t->pat, errstr);
+		if (regcomp(&t->rx, t->pat, REG_EXTENDED | REG_NEWLINE |
+		    (t->icase ? REG_ICASE : 0)) != 0)
+			errx(1, "%s: regcomp failed", t->pat);
+		for (s = test_subjects; *s != NULL; s++)
+			test_regex_one(t, *s, strlen(*s));
+	}
+
+	for (i = 0; i < TEST_THREADS; i++)
+		if ((errno = pthread_create(&th[i], NULL, test_regex_thread,
+		    (void *)(i + 1))) != 0)
+			err(1, "pthread_create");
+	for (i = 0; i < TEST_THREADS; i++)
+		pthread_join(th[i], NULL);
+
+	for (t = test_regexes; t->pat != NULL; t++) {
+		df_re_free(t->re);
+		regfree(&t->rx);
+	}
+}
+
+/*
+ * Search the n bytes at p with mi and with the scalar version, which have
+ * to find the same.
+ */
+void
+test_memfind_one(const struct df_memfind_impl *mi, const u_char *p,
+    size_t n, size_t range, const u_char *pat, size_t len)
+{
+	int64_t		 a, b;
+
+	a = df_memfind_scalar(p, n, range, pat, len);
+	b = mi->fn(p, n, range, pat, len);
+	if (a == b)
+		return;
+
+	test_failed = 1;
+	fprintf(stderr, "memfind %s: %zu bytes, range %zu, pattern of %zu: "
+	    "scalar %lld, %s %lld\n", mi->name, n, range, len, (long long)a,
+	    mi->name, (long long)b);
+}
+
+/*
+ * Search buffers of n bytes for the len bytes at pat with mi, with the
+ * pattern at each place in them up to TEST_EDGE from either end, or
+ * nowhere, and ranges that end just before it, just after its start and
+ * past the end. The buffers are made of the bytes of the pattern and a
+ * NUL, so that its first and last bytes are often the right distance
+ * apart, and are allocated to the byte, at any alignment, so that reading
+ * past their end can be caught.
+ */
+void
+test_memfind_size(const struct df_memfind_impl *mi, size_t n,
+    const u_char *pat, size_t len, u_int64_t *seed)
+{
+	u_char		*buf, *p;
+	size_t		 at, k, shift;
+
+	shift = test_rand(seed) % 32;
+	if ((buf = malloc(n + shift)) == NULL)
+		err(1, "malloc");
+	p = buf + shift;
+	for (at = 0; at <= n; at++) {
+		if (at == TEST_EDGE && n > 2 * TEST_EDGE)
+			at = n - TEST_EDGE;
+		for (k = 0; k < n; k++)
+			p[k] = "abab"[test_rand(seed) % 5];
+		if (at + len <= n)
+			memcpy(p + at, pat, len);
+		test_memfind_one(mi, p, n, at, pat, len);
+		test_memfind_one(mi, p, n, at + 1, pat, len);
+		test_memfind_one(mi, p, n, SIZE_MAX, pat, len);
+	}
+	free(buf);
+}
+
+/*
+ * Every way of searching this CPU can do, on buffers of every size up to
+ * TEST_BUFMAX and a few bigger, for patterns around the widths of the
+ * vectors.
+ */
+void
+test_memfind(void)
+{
+	struct df_memfind_impl	*mi;
+	u_int64_t		 seed = 1;
+	u_char			 pat[TEST_PATMAX];
+	size_t			 len, n, i, k;
+	int			 cpu = df_cpu_flags();
+
+	for (mi = df_memfind_impls; mi->name != NULL; mi++) {
+		if ((mi->cpu & cpu) != mi->cpu || mi->fn == df_memfind_scalar)
+			continue;
+		for (i = 0; (len = test_patlens[i]) != 0; i++) {
+			for (k = 0; k < len; k++)
+				pat[k] = "ab"[test_rand(&seed) % 2];
+			pat[0] = 'a';
+			pat[len - 1] = 'b';
+			for (n = 0; n <= TEST_BUFMAX; n++)
+				test_memfind_size(mi, n, pat, len, &seed);
+			for (k = 0; (n = test_bigbufs[k]) != 0; k++)
+				test_memfind_size(mi, n, pat, len, &seed);
+		}
+	}
+}
+
+/*
+ * Every way of comparing lanes this CPU can do against the scalar one,
+ * for each number of lanes that can be asked for. The masks are random
+ * or have a byte or none of their bits set, the values may have bits the
+ * masks don't, as padding does, and half the values compared pass one of
+ * the lanes.
+ */
+void
+test_lanes(void)
+{
+	struct df_lanes_impl	*li;
+	u_int32_t		 mask[DF_LANES_MAX], value[DF_LANES_MAX];
+	u_int32_t		 n, i, x;
+	u_int64_t		 seed = 1, a, b;
+	int			 cpu = df_cpu_flags(), k;
+
+	for (li = df_lanes_impls; li->name != NULL; li++) {
+		if ((li->cpu & cpu) != li->cpu || li->fn == df_lanes_scalar)
+			continue;
+		for (n = DF_LANES_PAD; n <= DF_LANES_MAX; n += DF_LANES_PAD) {
+			for (i = 0; i < n; i++) {
+				switch (test_rand(&seed) % 4) {
+				case 0:
+					mask[i] = 0;
+					break;
+				case 1:
+					mask[i] = 0xffU << (i % 4 * 8);
+					break;
+				default:
+					mask[i] = test_rand(&seed);
+					break;
+				}
+				value[i] = test_rand(&seed);
+				if (test_rand(&seed) % 8 != 0)
+					value[i] &= mask[i];
+			}
+			for (k = 0; k < TEST_VALUES; k++) {
+				x = test_rand(&seed);
+				if (k % 2 == 0) {
+					i = test_rand(&seed) % n;
+					x = (x & ~mask[i]) | value[i];
+				}
+				a = df_lanes_scalar(mask, value, n, x);
+				b = li->fn(mask, value, n, x);
+				if (a == b)
+					continue;
+				test_failed = 1;
+				fprintf(stderr, "lanes %s: %u lanes, "
+				    "value %#x: scalar %#llx, %s %#llx\n",
+				    li->name, n, x, (unsigned long long)a,
+				    li->name, (unsigned long long)b);
+			}
+		}
+	}
+}
+
+/*
+ * Classify the len bytes at data through the index into buf, then again
+ * by testing every top level rule in turn. Returns 0 if both say the
+ * same.
+ */
+int
+test_classify(struct defile *h, const char *name, const u_char *data,
+    size_t len, char *buf, size_t buflen)
+{
+	struct df_index	*ix = h->db->index;
+	char		 all[BUFSIZ];
+	int		 ret;
+
+	if (df_classify_buffer(h, data, len, buf, buflen) == -1)
+		err(1, "%s", name);
+	/* What df_magic_walk() does without one */
+	h->db->index = NULL;
+	ret = df_classify_buffer(h, data, len, all, sizeof(all));
+	h->db->index = ix;
+	if (ret == -1)
+		err(1, "%s", name);
+	if (strcmp(buf, all) == 0)
+		return (0);
+
+	test_failed = 1;
+	fprintf(stderr, "%s, %zu bytes: index \"%s\", every rule \"%s\"\n",
+	    name, len, buf, all);
+	return (-1);
+}
+
+/*
+ * Classify each file, and every part of it from its start, through the
+ * index and without, which have to agree. What the whole file is goes to
+ * stdout, to be compared with what it should be.
+ */
+void
+test_magic(const char *magic, int argc, char **argv)
+{
+	struct defile	*h;
+	struct stat	 sb;
+	u_char		*data;
+	char		 buf[BUFSIZ], fdbuf[BUFSIZ];
+	size_t		 len;
+	ssize_t		 n;
+	int		 i, fd;
+
+	if ((h = df_open_db(magic, 0)) == NULL)
+		err(1, "df_open_db");
+	if (df_load(h) == -1)
+		err(1, "%s", magic);
+
+	for (i = 0; i < argc; i++) {
+		if ((fd = open(argv[i], O_RDONLY)) == -1 ||
+		    fstat(fd, &sb) == -1)
+			err(1, "%s", argv[i]);
+		len = sb.st_size;
+		if ((data = malloc(len + 1)) == NULL)
+			err(1, "malloc");
+		if ((n = read(fd, data, len)) == -1)
+			err(1, "%s", argv[i]);
+		if ((size_t)n != len)
+			errx(1, "%s: short read", argv[i]);
+		for (n = 0; (size_t)n < len; n++)
+			test_classify(h, argv[i], data, n, buf, sizeof(buf));
+		test_classify(h, argv[i], data, len, buf, sizeof(buf));
+
+		/* And the way file(1) reads it */
+		if (lseek(fd, 0, SEEK_SET) == -1)
+			err(1, "%s", argv[i]);
+		if (df_classify_fd(h, fd, fdbuf, sizeof(fdbuf)) == -1)
+			err(1, "%s", argv[i]);
+		if (strcmp(buf, fdbuf) != 0) {
+			test_failed = 1;
+			fprintf(stderr, "%s: in memory \"%s\", read \"%s\"\n",
+			    argv[i], buf, fdbuf);
+		}
+		printf("%s: %s\n", argv[i], buf);
+		free(data);
+		close(fd);
+	}
+
+	df_close_db(h);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2)
+		usage();
+	if (strcmp(argv[1], "regex") == 0 && argc == 2)
+		test_regex();
+	else if (strcmp(argv[1], "memfind") == 0 && argc == 2)
+		test_memfind();
+	else if (strcmp(argv[1], "lanes") == 0 && argc == 2)
+		test_lanes();
+	else if (strcmp(argv[1], "magic") == 0 && argc > 3)
+		test_magic(argv[2], argc - 3, argv + 3);
+	else
+		usage();
+
+	return (test_failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2011, Edd Barrett <vext01@gmail.com>
+ * Copyright (c) 2011, Christiano F. Haesbaert <haesbaert@haesbaert.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Finding a pattern in the range of a search test. The vector versions
+ * compare a block of starting places at once against the first byte of
+ * the pattern, and the same block shifted by its length less one against
+ * its last, and only look further where both agree. Which one is used is
+ * worked out from what the CPU can do the first time it's needed.
+ *
+ * Comparing a value against the lanes of the index is done the same way,
+ * a block of lanes at a time.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "defile.h"
+#include "file.h"
+
+struct df_memfind_impl df_memfind_impls[] = {
+#if defined(__i386__) || defined(__x86_64__)
+	{ "avx2",	df_memfind_avx2,	DF_CPU_AVX2 },
+	{ "sse2",	df_memfind_sse2,	DF_CPU_SSE2 },
+#endif
+	{ "scalar",	df_memfind_scalar,	0 },
+	{ NULL,		NULL,			0 }
+};
+
+struct df_lanes_impl df_lanes_impls[] = {
+#if defined(__i386__) || defined(__x86_64__)
+	{ "avx2",	df_lanes_avx2,		DF_CPU_AVX2 },
+	{ "sse2",	df_lanes_sse2,		DF_CPU_SSE2 },
+#endif
+	{ "scalar",	df_lanes_scalar,	0 },
+	{ NULL,		NULL,			0 }
+};
+
+/* Picks one of the above the first time through */
+df_memfind_fn	 df_memfind_best = df_memfind_pick;
+df_lanes_fn	 df_lanes_best = df_lanes_pick;
+
+/*
+ * Where the len bytes of pat first are in the n bytes at p, starting at
+ * one of the first range places. Returns that offset, -1 if none.
+ */
+int64_t
+df_memfind(const u_char *p, size_t n, size_t range, const u_char *pat,
+    size_t len)
+{
+	return (__atomic_load_n(&df_memfind_best, __ATOMIC_RELAXED)(p, n,
+	    range, pat, len));
+}
+
+int64_t
+df_memfind_pick(const u_char *p, size_t n, size_t range, const u_char *pat,
+    size_t len)
+{
+	struct df_memfind_impl	*mi;
+	int			 cpu = df_cpu_flags();
+
+	for (mi = df_memfind_impls; (mi->cpu & cpu) != mi->cpu; mi++)
+		;
+	DPRINTF(1, "searching with %s", mi->name);
+	__atomic_store_n(&df_memfind_best, mi->fn, __ATOMIC_RELAXED);
+
+	return (mi->fn(p, n, range, pat, len));
+}
+
+/*
+ * Which of the first n lanes want x, as a bit each: lane i does if x under
+ * mask[i] is value[i]. n is a multiple of DF_LANES_PAD up to 64.
+ */
+u_int64_t
+df_lanes_eq(const u_int32_t *mask, const u_int32_t *value, u_int32_t n,
+    u_int32_t x)
+{
+	return (__atomic_load_n(&df_lanes_best, __ATOMIC_RELAXED)(mask,
+	    value, n, x));
+}
+
+u_int64_t
+df_lanes_pick(const u_int32_t *mask, const u_int32_t *value, u_int32_t n,
+    u_int32_t x)
+{
+	struct df_lanes_impl	*li;
+	int			 cpu = df_cpu_flags();
+
+	for (li = df_lanes_impls; (li->cpu & cpu) != li->cpu; li++)
+		;
+	DPRINTF(1, "comparing lanes with %s", li->name);
+	__atomic_store_n(&df_lanes_best, li->fn, __ATOMIC_RELAXED);
+
+	return (li->fn(mask, value, n, x));
+}
+
+/*
+ * The DF_CPU_* features of the CPU we're on.
+ */
+int
+df_cpu_flags(void)
+{
+	int	 flags = 0;
+
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		flags |= DF_CPU_SSE2;
+	if (__builtin_cpu_supports("avx2"))
+		flags |= DF_CPU_AVX2;
+#endif
+
+	return (flags);
+}
+
+int64_t
+df_memfind_scalar(const u_char *p, size_t n, size_t range,
+    const u_char *pat, size_t len)
+{
+	const u_char	*q;
+	size_t		 i, starts;
+
+	if (len == 0 || len > n)
+		return (-1);
+	starts = MIN(range, n - len + 1);
+	for (i = 0; i < starts; i++) {
+		if ((q = memchr(p + i, pat[0], starts - i)) == NULL)
+			return (-1);
+		i = q - p;
+		if (memcmp(q + 1, pat + 1, len - 1) == 0)
+			return (i);
+	}
+
+	return (-1);
+}
+
+u_int64_t
+df_lanes_scalar(const u_int32_t *mask, const u_int32_t *value, u_int32_t n,
+    u_int32_t x)
+{
+	u_int64_t	 bits = 0;
+	u_int32_t	 i;
+
+	for (i = 0; i < n; i++)
+		bits |= (u_int64_t)((x & mask[i]) == value[i]) << i;
+
+	return (bits);
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+/*
+ * The vector versions stop short of the last block, which is left to the
+ * scalar one so that no load goes past the n bytes.
+ */
+#define DF_MEMFIND_VEC(name, target, vec, width, set1, loadu, cmpeq, and, \
+    movemask)								\
+__attribute__((__target__(target))) int64_t				\
+df_memfind_##name(const u_char *p, size_t n, size_t range,		\
+    const u_char *pat, size_t len)					\
+{									\
+	vec		 first, last, a, b;				\
+	u_int32_t	 m;						\
+	size_t		 i, j, starts;					\
+	int64_t		 r;						\
+									\
+	if (len == 0 || len > n)					\
+		return (-1);						\
+	starts = MIN(range, n - len + 1);				\
+	first = set1(pat[0]);						\
+	last = set1(pat[len - 1]);					\
+	for (i = 0; i + (width) <= starts; i += (width)) {		\
+		a = loadu((const vec *)(p + i));			\
+		b = loadu((const vec *)(p + i + len - 1));		\
+		m = movemask(and(cmpeq(a, first), cmpeq(b, last)));	\
+		for (; m != 0; m &= m - 1) {				\
+			j = i + __builtin_ctz(m);			\
+			if (len <= 2 ||					\
+			    memcmp(p + j + 1, pat + 1, len - 2) == 0)	\
+				return (j);				\
+		}							\
+	}								\
+	if ((r = df_memfind_scalar(p + i, n - i, starts - i, pat,	\
+	    len)) == -1)						\
+		return (-1);						\
+									\
+	return (i + r);							\
+}
+DF_MEMFIND_VEC(sse2, "sse2", __m128i, 16, _mm_set1_epi8, _mm_loadu_si128,
+    _mm_cmpeq_epi8, _mm_and_si128, _mm_movemask_epi8)
+DF_MEMFIND_VEC(avx2, "avx2", __m256i, 32, _mm256_set1_epi8,
+    _mm256_loadu_si256, _mm256_cmpeq_epi8, _mm256_and_si256,
+    _mm256_movemask_epi8)
+
+/* A bit for each 32 bit lane, from the sign bits of the floats there */
+#define DF_MOVEMASK_SSE2(v)	_mm_movemask_ps(_mm_castsi128_ps(v))
+#define DF_MOVEMASK_AVX2(v)	_mm256_movemask_ps(_mm256_castsi256_ps(v))
+
+#define DF_LANES_VEC(name, target, vec, width, set1, loadu, cmpeq, and,	\
+    movemask)								\
+__attribute__((__target__(target))) u_int64_t				\
+df_lanes_##name(const u_int32_t *mask, const u_int32_t *value,		\
+    u_int32_t n, u_int32_t x)						\
+{									\
+	vec		 xv = set1((int)x), m, v;			\
+	u_int64_t	 bits = 0;					\
+	u_int32_t	 i;						\
+									\
+	for (i = 0; i < n; i += (width)) {				\
+		m = loadu((const vec *)(mask + i));			\
+		v = loadu((const vec *)(value + i));			\
+		bits |= (u_int64_t)movemask(cmpeq(and(xv, m), v)) << i;	\
+	}								\
+									\
+	return (bits);							\
+}
+DF_LANES_VEC(sse2, "sse2", __m128i, 4, _mm_set1_epi32, _mm_loadu_si128,
+    _mm_cmpeq_epi32, _mm_and_si128, DF_MOVEMASK_SSE2)
+DF_LANES_VEC(avx2, "avx2", __m256i, 8, _mm256_set1_epi32,
+    _mm256_loadu_si256, _mm256_cmpeq_epi32, _mm256_and_si256,
+    DF_MOVEMASK_AVX2)
+#endif
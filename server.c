@@ -0,0 +1,726 @@
+/*
+ * Copyright (c) 2011, Edd Barrett <vext01@gmail.com>
+ * Copyright (c) 2011, Christiano F. Haesbaert <haesbaert@haesbaert.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defile.h"
+#include "file.h"
+
+/* Seconds between looks at the magic file for changes */
+#define DF_SERVE_WATCH	5
+
+volatile sig_atomic_t	 df_serve_quit, df_serve_hup;
+int			 df_serve_wakefd = -1;
+
+/*
+ * Serve classification requests on the Unix socket at path, with jobs
+ * threads doing the checking, until told to stop. SIGHUP reloads the
+ * magic file, as does changing it, unless results are kept with -c: those
+ * are only good for the rules they were found with.
+ */
+int
+df_serve(const char *path, int jobs)
+{
+	struct df_server	 s;
+	struct sockaddr_un	 sun;
+	struct df_client	*c;
+	int			 error, i;
+
+	bzero(&s, sizeof(s));
+	bzero(&sun, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		warn("%s", path);
+		return (-1);
+	}
+	if ((s.fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	/* A socket left behind by an earlier run would be in the way */
+	if (unlink(path) == -1 && errno != ENOENT) {
+		warn("%s", path);
+		close(s.fd);
+		return (-1);
+	}
+	if (bind(s.fd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+	    listen(s.fd, SOMAXCONN) == -1) {
+		warn("%s", path);
+		close(s.fd);
+		return (-1);
+	}
+	if (pipe(s.wake) == -1)
+		err(1, "pipe");
+	for (i = 0; i < 2; i++)
+		if (fcntl(s.wake[i], F_SETFL, O_NONBLOCK) == -1)
+			err(1, "fcntl");
+	if (fcntl(s.fd, F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+	df_serve_wakefd = s.wake[1];
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, df_serve_signal);
+	signal(SIGINT, df_serve_signal);
+	signal(SIGTERM, df_serve_signal);
+	if (df_state.cache == NULL && !df_state.profile &&
+	    df_state.lib->db != NULL &&
+	    df_watch(df_state.lib, DF_SERVE_WATCH) == -1)
+		warn("df_watch");
+
+	TAILQ_INIT(&s.clients);
+	TAILQ_INIT(&s.jobs);
+	TAILQ_INIT(&s.done);
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.cond, NULL);
+	if ((s.threads = calloc(jobs, sizeof(*s.threads))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < jobs; i++) {
+		if ((error = pthread_create(&s.threads[i], NULL,
+		    df_serve_worker, &s)) != 0)
+			errc(1, error, "pthread_create");
+		s.nthreads++;
+	}
+	DPRINTF(1, "serving on %s with %d workers", path, jobs);
+
+	df_serve_loop(&s);
+
+	pthread_mutex_lock(&s.lock);
+	s.quit = 1;
+	pthread_cond_broadcast(&s.cond);
+	pthread_mutex_unlock(&s.lock);
+	for (i = 0; i < s.nthreads; i++)
+		pthread_join(s.threads[i], NULL);
+	/* Whatever was still being answered is dropped */
+	df_serve_wake(&s);
+	while ((c = TAILQ_FIRST(&s.clients)) != NULL)
+		df_client_close(&s, c);
+	unlink(path);
+	close(s.fd);
+	close(s.wake[0]);
+	close(s.wake[1]);
+	free(s.threads);
+
+	return (0);
+}
+
+void
+df_serve_signal(int sig)
+{
+	int	 saved_errno = errno;
+
+	if (sig == SIGHUP)
+		df_serve_hup = 1;
+	else
+		df_serve_quit = 1;
+	(void)write(df_serve_wakefd, "", 1);
+	errno = saved_errno;
+}
+
+/*
+ * Take new clients and requests, and hand answers back, until a signal
+ * says to stop.
+ */
+void
+df_serve_loop(struct df_server *s)
+{
+	struct pollfd		*pfd = NULL;
+	struct df_client	**pc = NULL, *c, *next;
+	size_t			 npfd = 0;
+	int			 i, n;
+
+	while (!df_serve_quit) {
+		if (npfd < (size_t)s->nclients + 2) {
+			npfd = s->nclients + 2;
+			if ((pfd = reallocarray(pfd, npfd, sizeof(*pfd))) ==
+			    NULL || (pc = reallocarray(pc, npfd,
+			    sizeof(*pc))) == NULL)
+				err(1, "reallocarray");
+		}
+		pfd[0].fd = s->wake[0];
+		pfd[0].events = POLLIN;
+		pfd[1].fd = s->nclients < DF_SERVER_MAXCLIENTS ? s->fd : -1;
+		pfd[1].events = POLLIN;
+		n = 2;
+		TAILQ_FOREACH(c, &s->clients, entry) {
+			/* Hung up, nothing to send it until its jobs are in */
+			if (c->eof && c->outoff == c->outlen)
+				continue;
+			pfd[n].fd = c->fd;
+			pfd[n].events = 0;
+			if (!c->eof && c->inflight < DF_CLIENT_MAXINFLIGHT &&
+			    c->outlen - c->outoff < DF_CLIENT_MAXOUT)
+				pfd[n].events |= POLLIN;
+			if (c->outoff < c->outlen)
+				pfd[n].events |= POLLOUT;
+			pc[n++] = c;
+		}
+		if (poll(pfd, n, INFTIM) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+
+		if (pfd[0].revents & POLLIN)
+			df_serve_wake(s);
+		if (pfd[1].revents & POLLIN)
+			df_client_accept(s);
+		for (i = 2; i < n; i++) {
+			c = pc[i];
+			if (pfd[i].revents & (POLLIN | POLLHUP) &&
+			    df_client_read(s, c) == -1) {
+				df_client_close(s, c);
+				continue;
+			}
+			if (pfd[i].revents & POLLOUT &&
+			    df_client_write(c) == -1) {
+				df_client_close(s, c);
+				continue;
+			}
+			if (pfd[i].revents & (POLLERR | POLLNVAL))
+				df_client_close(s, c);
+		}
+		/* Those done talking go once they've had all their answers */
+		TAILQ_FOREACH_SAFE(c, &s->clients, entry, next)
+			if (c->eof && c->inflight == 0 &&
+			    c->outoff == c->outlen)
+				df_client_close(s, c);
+	}
+	free(pfd);
+	free(pc);
+}
+
+/*
+ * The workers or a signal poked us: hand out the answers that are ready,
+ * and reload if asked to.
+ */
+void
+df_serve_wake(struct df_server *s)
+{
+	struct df_job	*j;
+	char		 buf[64];
+
+	while (read(s->wake[0], buf, sizeof(buf)) > 0)
+		;
+	if (df_serve_hup) {
+		df_serve_hup = 0;
+		if (df_state.cache != NULL)
+			warnx("not reloading %s, results are kept with -c",
+			    df_state.magic_path);
+		/* Not here, answers would wait for the parse */
+		else if (df_watch_reload(df_state.lib) == -1)
+			warn("reload %s", df_state.magic_path);
+	}
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		if ((j = TAILQ_FIRST(&s->done)) != NULL)
+			TAILQ_REMOVE(&s->done, j, entry);
+		pthread_mutex_unlock(&s->lock);
+		if (j == NULL)
+			break;
+		j->client->inflight--;
+		if (!j->client->dead)
+			df_client_respond(j->client, j->id, j->error, j->desc);
+		else if (j->client->inflight == 0)
+			free(j->client);
+		free(j->path);
+		free(j->desc);
+		free(j);
+	}
+}
+
+void *
+df_serve_worker(void *arg)
+{
+	struct df_server	*s = arg;
+	struct df_job		*j;
+	struct df_file		 df;
+
+	bzero(&df, sizeof(df));
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		while (TAILQ_EMPTY(&s->jobs) && !s->quit)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if ((j = TAILQ_FIRST(&s->jobs)) == NULL) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		TAILQ_REMOVE(&s->jobs, j, entry);
+		pthread_mutex_unlock(&s->lock);
+
+		df_serve_check(&df, j);
+		pthread_mutex_lock(&s->lock);
+		TAILQ_INSERT_TAIL(&s->done, j, entry);
+		pthread_mutex_unlock(&s->lock);
+		(void)write(s->wake[1], "", 1);
+	}
+	df_arena_free(&df.arena);
+
+	return (NULL);
+}
+
+/*
+ * Check what j asks about, using df as scratch. A descriptor passed to us
+ * is checked the way stdin would be, without a name to go by. Only
+ * ordinary files are read: a client could hand us a pipe or name a fifo
+ * that nobody ever writes to, so anything else is answered from its
+ * stat.
+ */
+void
+df_serve_check(struct df_file *df, struct df_job *j)
+{
+	df_arena_reset(&df->arena);
+	df->fd = j->fd;
+	df->flags = j->fd != -1 ? DFF_STDIN : 0;
+	df->filename = j->path != NULL ? j->path : "(descriptor)";
+	df->name = df->filename;
+	df->dir = NULL;
+	df->desc = NULL;
+	df->prefetch = DFP_NONE;
+	if ((j->fd != -1 ? fstat(j->fd, &df->sb) : fstatat(AT_FDCWD,
+	    j->path, &df->sb, AT_SYMLINK_NOFOLLOW)) == -1) {
+		j->error = errno;
+		goto done;
+	}
+	if (j->fd != -1 && !S_ISREG(df->sb.st_mode)) {
+		df_serve_mode(df, j);
+		goto done;
+	}
+	df->flags |= DFF_STATED;
+	errno = 0;
+	if (df_check(df) == -1)
+		j->error = errno != 0 ? errno : EIO;
+	else if (df->desc != NULL && (j->desc = strdup(df->desc)) == NULL)
+		err(1, "strdup");
+done:
+	if (j->fd != -1)
+		close(j->fd);
+	j->fd = -1;
+}
+
+/*
+ * Answer j from the stat of what it passed us alone.
+ */
+void
+df_serve_mode(struct df_file *df, struct df_job *j)
+{
+	struct df_matches	*matches = &df_thread_get(df_state.lib)->matches;
+	char			 buf[BUFSIZ];
+
+	(void)df_check_mode(matches, &df->sb, df_state.lib->flags);
+	if (!TAILQ_EMPTY(&matches->list)) {
+		(void)df_matches_print(matches, buf, sizeof(buf));
+		if ((j->desc = strdup(buf)) == NULL)
+			err(1, "strdup");
+	}
+	df_matches_reset(matches);
+}
+
+void
+df_client_accept(struct df_server *s)
+{
+	struct df_client	*c;
+	int			 fd;
+
+	if ((fd = accept(s->fd, NULL, NULL)) == -1) {
+		if (errno != EWOULDBLOCK && errno != EINTR &&
+		    errno != ECONNABORTED)
+			warn("accept");
+		return;
+	}
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+		warn("fcntl");
+		close(fd);
+		return;
+	}
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		err(1, "calloc");
+	c->fd = fd;
+	TAILQ_INSERT_TAIL(&s->clients, c, entry);
+	s->nclients++;
+}
+
+/*
+ * Read what c has sent, along with any descriptors, and queue the
+ * requests in it. Returns -1 if c should be dropped.
+ */
+int
+df_client_read(struct df_server *s, struct df_client *c)
+{
+	struct msghdr	 msg;
+	struct cmsghdr	*cmsg;
+	struct iovec	 iov;
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(sizeof(int) *
+				    DF_CLIENT_MAXFDS)];
+	}		 cmsgbuf;
+	ssize_t		 n;
+	int		*fds, nfds, i, bad = 0;
+
+	bzero(&msg, sizeof(msg));
+	iov.iov_base = c->in + c->inlen;
+	iov.iov_len = sizeof(c->in) - c->inlen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+	if ((n = recvmsg(c->fd, &msg, 0)) == -1)
+		return (errno == EAGAIN || errno == EINTR ? 0 : -1);
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		fds = (int *)CMSG_DATA(cmsg);
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < nfds; i++) {
+			if (c->nfds == DF_CLIENT_MAXFDS) {
+				close(fds[i]);
+				bad = 1;
+			} else
+				c->fds[c->nfds++] = fds[i];
+		}
+	}
+	if (bad || (msg.msg_flags & MSG_CTRUNC))
+		return (-1);
+	if (n == 0) {
+		c->eof = 1;
+		return (c->inlen > 0 ? -1 : 0);
+	}
+	c->inlen += n;
+
+	return (df_client_parse(s, c));
+}
+
+/*
+ * Queue the whole requests at the start of c->in. Returns -1 if c isn't
+ * making sense.
+ */
+int
+df_client_parse(struct df_server *s, struct df_client *c)
+{
+	struct df_req	 req;
+	struct df_job	*j;
+	size_t		 off = 0;
+
+	while (c->inlen - off >= sizeof(req)) {
+		memcpy(&req, c->in + off, sizeof(req));
+		if (req.len >= MAXPATHLEN ||
+		    (req.type == DF_REQ_PATH && req.len == 0) ||
+		    (req.type == DF_REQ_FD && req.len != 0) ||
+		    (req.type != DF_REQ_PATH && req.type != DF_REQ_FD))
+			return (-1);
+		if (c->inlen - off < sizeof(req) + req.len)
+			break;
+		off += sizeof(req);
+		if (req.type == DF_REQ_FD && c->nfds == 0) {
+			df_client_respond(c, req.id, EBADMSG, NULL);
+			continue;
+		}
+		if ((j = calloc(1, sizeof(*j))) == NULL)
+			err(1, "calloc");
+		j->client = c;
+		j->id = req.id;
+		j->fd = -1;
+		if (req.type == DF_REQ_FD) {
+			j->fd = c->fds[0];
+			memmove(c->fds, c->fds + 1,
+			    --c->nfds * sizeof(*c->fds));
+		} else if ((j->path = strndup((char *)c->in + off,
+		    req.len)) == NULL)
+			err(1, "strndup");
+		off += req.len;
+		c->inflight++;
+		pthread_mutex_lock(&s->lock);
+		TAILQ_INSERT_TAIL(&s->jobs, j, entry);
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+	memmove(c->in, c->in + off, c->inlen - off);
+	c->inlen -= off;
+
+	return (0);
+}
+
+/*
+ * Queue the answer to request id for c.
+ */
+void
+df_client_respond(struct df_client *c, u_int32_t id, int error,
+    const char *desc)
+{
+	struct df_resp	 resp;
+	size_t		 len = desc != NULL ? strlen(desc) : 0;
+
+	resp.len = len;
+	resp.id = id;
+	resp.error = error;
+	/* What was sent makes room, so that out only grows with the unsent */
+	if (c->outoff > 0) {
+		memmove(c->out, c->out + c->outoff, c->outlen - c->outoff);
+		c->outlen -= c->outoff;
+		c->outoff = 0;
+	}
+	while (c->outlen + sizeof(resp) + len > c->outsize) {
+		c->outsize = c->outsize ? c->outsize * 2 : 4096;
+		if ((c->out = realloc(c->out, c->outsize)) == NULL)
+			err(1, "realloc");
+	}
+	memcpy(c->out + c->outlen, &resp, sizeof(resp));
+	memcpy(c->out + c->outlen + sizeof(resp), desc, len);
+	c->outlen += sizeof(resp) + len;
+}
+
+int
+df_client_write(struct df_client *c)
+{
+	ssize_t		 n;
+
+	if ((n = write(c->fd, c->out + c->outoff, c->outlen - c->outoff)) ==
+	    -1)
+		return (errno == EAGAIN || errno == EINTR ? 0 : -1);
+	c->outoff += n;
+	if (c->outoff == c->outlen)
+		c->outoff = c->outlen = 0;
+
+	return (0);
+}
+
+/*
+ * Drop c. Jobs still out for it hold on to it until they come back.
+ */
+void
+df_client_close(struct df_server *s, struct df_client *c)
+{
+	int	 i;
+
+	TAILQ_REMOVE(&s->clients, c, entry);
+	s->nclients--;
+	close(c->fd);
+	for (i = 0; i < c->nfds; i++)
+		close(c->fds[i]);
+	free(c->out);
+	if (c->inflight > 0) {
+		c->dead = 1;
+		return;
+	}
+	free(c);
+}
+
+/*
+ * Have the daemon at path check the files, printing what it says the way
+ * we would have. Ordinary files are opened here and passed over, so it
+ * sees what we can see; anything else goes by its full path.
+ */
+int
+df_ask(const char *path)
+{
+	struct sockaddr_un	 sun;
+	struct df_file		*files, *df;
+	size_t			 head = 0, inflight = 0, i;
+	int			 fd, more = 1, ret = 0;
+
+	bzero(&sun, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		warn("%s", path);
+		return (-1);
+	}
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		warn("%s", path);
+		close(fd);
+		return (-1);
+	}
+	if ((files = calloc(DF_ASK_WINDOW, sizeof(*files))) == NULL)
+		err(1, "calloc");
+
+	for (;;) {
+		while (more && inflight < DF_ASK_WINDOW) {
+			df = &files[(head + inflight) % DF_ASK_WINDOW];
+			if (df_next_file(df) == NULL) {
+				more = 0;
+				break;
+			}
+			/* The slot is found again by the id of its request */
+			if (df_ask_send(fd, df, head + inflight) == -1)
+				goto lost;
+			inflight++;
+		}
+		if (inflight == 0)
+			break;
+
+		df = &files[head % DF_ASK_WINDOW];
+		while (!df->done)
+			if (df_ask_recv(fd, files) == -1)
+				goto lost;
+		if (df->status != 0)
+			warnc(df->status, "%s", df->filename);
+		else
+			df_print(df);
+		df_done_file(df);
+		head++;
+		inflight--;
+	}
+	goto done;
+lost:
+	warnx("%s: lost the daemon", path);
+	ret = -1;
+done:
+	for (i = 0; i < DF_ASK_WINDOW; i++)
+		df_arena_free(&files[i].arena);
+	free(files);
+	close(fd);
+
+	return (ret);
+}
+
+/*
+ * Ask about df as request id.
+ */
+int
+df_ask_send(int sock, struct df_file *df, u_int32_t id)
+{
+	struct df_req	 req;
+	struct msghdr	 msg;
+	struct cmsghdr	*cmsg;
+	struct iovec	 iov[2];
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(sizeof(int))];
+	}		 cmsgbuf;
+	char		 cwd[MAXPATHLEN], *full = NULL;
+	int		 dirfd = df->dir != NULL ? df->dir->fd : AT_FDCWD;
+	int		 fd = -1;
+	ssize_t		 n;
+
+	if (df->flags & DFF_STDIN)
+		fd = STDIN_FILENO;
+	else if (fstatat(dirfd, df->name, &df->sb, AT_SYMLINK_NOFOLLOW) == 0 &&
+	    S_ISREG(df->sb.st_mode))
+		fd = openat(dirfd, df->name, O_RDONLY | O_CLOEXEC);
+
+	bzero(&msg, sizeof(msg));
+	req.id = id;
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof(req);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+	if (fd != -1) {
+		req.type = DF_REQ_FD;
+		req.len = 0;
+		msg.msg_control = &cmsgbuf.buf;
+		msg.msg_controllen = sizeof(cmsgbuf.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+	} else {
+		/* The daemon has a working directory of its own */
+		if (df->filename[0] != '/') {
+			if (getcwd(cwd, sizeof(cwd)) == NULL)
+				err(1, "getcwd");
+			if (asprintf(&full, "%s/%s", cwd, df->filename) == -1)
+				err(1, "asprintf");
+		}
+		req.type = DF_REQ_PATH;
+		iov[1].iov_base = full != NULL ? full : df->filename;
+		iov[1].iov_len = strlen(iov[1].iov_base);
+		req.len = iov[1].iov_len;
+		msg.msg_iovlen = 2;
+		if (req.len >= MAXPATHLEN) {
+			df->status = ENAMETOOLONG;
+			df->done = 1;
+			free(full);
+			return (0);
+		}
+	}
+	while ((n = sendmsg(sock, &msg, 0)) == -1 && errno == EINTR)
+		;
+	if (fd != -1 && fd != STDIN_FILENO)
+		close(fd);
+	free(full);
+	/* Small enough to always go in one piece on a local socket */
+	if (n != (ssize_t)(sizeof(req) + req.len))
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Read the next answer into the slot of files it is about.
+ */
+int
+df_ask_recv(int sock, struct df_file *files)
+{
+	struct df_resp	 resp;
+	struct df_file	*df;
+	char		*desc;
+
+	if (df_readall(sock, &resp, sizeof(resp)) == -1 ||
+	    resp.len >= BUFSIZ)
+		return (-1);
+	df = &files[resp.id % DF_ASK_WINDOW];
+	desc = df_arena_alloc(&df->arena, resp.len + 1);
+	if (df_readall(sock, desc, resp.len) == -1)
+		return (-1);
+	desc[resp.len] = '\0';
+	df->desc = resp.error == 0 && resp.len > 0 ? desc : NULL;
+	df->status = resp.error;
+	df->done = 1;
+
+	return (0);
+}
+
+int
+df_readall(int fd, void *buf, size_t len)
+{
+	ssize_t		 n;
+	size_t		 off = 0;
+
+	while (off < len) {
+		if ((n = read(fd, (char *)buf + off, len - off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		if (n == 0)
+			return (-1);
+		off += n;
+	}
+
+	return (0);
+}